@@ -0,0 +1,543 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * End to end latency benchmark, key press to the write of the light
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+/* Starts the real daemon with a tmpfs file as the light, presses a key and
+ * measures the time until the daemon writes the file, seen with inotify.
+ * The light is turned off by the daemon itself (-t 1) before each press.
+ * Keys come from a uinput keyboard, or with -p from a fifo in place of
+ * /dev/input/mice in a private mount namespace, for machines without uinput.
+ * The presses are measured idle and again with busy threads on every CPU.
+ *
+ * With -R the bench plays systemd instead: it restarts the daemon and
+ * measures the time until the new one sent READY=1, once starting from
+ * scratch and once with the fds the old one parked in the file descriptor
+ * store.
+ */
+
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+struct bench_options {
+  std::string daemon;
+  unsigned int presses = 50;
+  unsigned int stressThreads = std::thread::hardware_concurrency();
+  // mousedev fifo instead of uinput
+  bool fifo = false;
+  unsigned int restarts = 0;
+};
+
+struct stored_fd {
+  std::string name;
+  int fd;
+};
+
+struct bench_state {
+  std::filesystem::path dir;
+  std::string sink;
+  int inotifyFd = -1;
+  int inputFd = -1;
+  pid_t daemon = -1;
+  // NOTIFY_SOCKET of the daemon
+  std::string notifyPath;
+  int notifyFd = -1;
+  bool ready = false;
+  // the file descriptor store, passed to the next daemon
+  std::vector<stored_fd> store;
+};
+
+uint64_t now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void help(const char *name) {
+  printf("%s [-n presses] [-s stress threads] [-p] [-R restarts] <keyboard_backlight>\n"
+		 "    -n key presses per run, defaults to 50\n"
+		 "    -s busy threads of the stress run, defaults to the number of CPUs, 0 skips it\n"
+		 "    -p press keys through a fifo as /dev/input/mice in a private mount\n"
+		 "       namespace (unshare -rm) instead of uinput\n"
+		 "    -R measure the time from SIGTERM until the restarted daemon is ready\n"
+		 "       instead of key presses, without and with the file descriptor store\n"
+		 "Every press waits until the daemon turned the light off, a run takes\n"
+		 "about a second per press.\n",
+		 name);
+}
+
+bool read_sink(const std::string &path, long &value) {
+  FILE *fp = fopen(path.c_str(), "r");
+  if (fp == nullptr) {
+	return false;
+  }
+  bool ok = fscanf(fp, "%ld", &value) == 1;
+  fclose(fp);
+  return ok;
+}
+
+/* Waits until the light has a value the predicate accepts.
+ * Returns the time it was seen, 0 on timeout.
+ */
+uint64_t wait_sink(const bench_state &state, const std::function<bool(long)> &accept,
+				   std::chrono::milliseconds timeout) {
+  uint64_t deadline = now_us() + std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+  long value;
+  while (true) {
+	// a write truncates the file first, an empty file is no value yet
+	if (read_sink(state.sink, value) && accept(value)) {
+	  return now_us();
+	}
+	uint64_t now = now_us();
+	if (now >= deadline) {
+	  return 0;
+	}
+
+	pollfd pfd = {state.inotifyFd, POLLIN, 0};
+	if (poll(&pfd, 1, static_cast<int>((deadline - now) / 1000) + 1) > 0) {
+	  char buf[4096];
+	  while (read(state.inotifyFd, buf, sizeof(buf)) > 0) {
+	  }
+	}
+  }
+}
+
+bool emit(int fd, uint16_t type, uint16_t code, int32_t value) {
+  input_event ie = {};
+  ie.type = type;
+  ie.code = code;
+  ie.value = value;
+  return write(fd, &ie, sizeof(ie)) == sizeof(ie);
+}
+
+bool press_key(const bench_state &state, bool fifo) {
+  if (fifo) {
+	// one ps/2 packet with motion, one without is a wheel notch for the daemon
+	const char packet[3] = {0x08, 1, 0};
+	return write(state.inputFd, packet, sizeof(packet)) == sizeof(packet);
+  }
+  return emit(state.inputFd, EV_KEY, KEY_A, 1) && emit(state.inputFd, EV_SYN, SYN_REPORT, 0)
+	  && emit(state.inputFd, EV_KEY, KEY_A, 0) && emit(state.inputFd, EV_SYN, SYN_REPORT, 0);
+}
+
+int create_keyboard() {
+  int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+	perror("latency_bench: /dev/uinput");
+	return -1;
+  }
+
+  uinput_setup setup = {};
+  setup.id.bustype = BUS_USB;
+  setup.id.vendor = 0x1209;
+  setup.id.product = 0x0001;
+  strcpy(setup.name, "keyboard_backlight latency bench");
+  bool ok = ioctl(fd, UI_SET_EVBIT, EV_KEY) == 0;
+  // the daemon takes devices with KEY_A for keyboards
+  for (int key = KEY_ESC; ok && key <= KEY_SPACE; ++key) {
+	ok = ioctl(fd, UI_SET_KEYBIT, key) == 0;
+  }
+  if (!ok || ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+	perror("latency_bench: uinput");
+	close(fd);
+	return -1;
+  }
+  return fd;
+}
+
+bool start_daemon(bench_state &state, const bench_options &opts) {
+  std::string log = state.dir / "daemon.log";
+  std::string status = state.dir / "status";
+  std::string flight = state.dir / "flight";
+  state.daemon = fork();
+  if (state.daemon < 0) {
+	perror("latency_bench: fork");
+	return false;
+  }
+
+  if (state.daemon == 0) {
+	int logFd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	dup2(logFd, STDOUT_FILENO);
+	dup2(logFd, STDERR_FILENO);
+	close(logFd);
+	setenv("NOTIFY_SOCKET", state.notifyPath.c_str(), 1);
+	if (!state.store.empty()) {
+	  // passed from fd 3 on like systemd does, moved out of the way first
+	  std::vector<int> fds;
+	  std::string names;
+	  for (const auto &stored : state.store) {
+		fds.push_back(fcntl(stored.fd, F_DUPFD, 100));
+		names += (names.empty() ? "" : ":") + stored.name;
+	  }
+	  for (size_t i = 0; i < fds.size(); ++i) {
+		dup2(fds[i], static_cast<int>(3 + i));
+		close(fds[i]);
+	  }
+	  setenv("LISTEN_FDS", std::to_string(fds.size()).c_str(), 1);
+	  setenv("LISTEN_FDNAMES", names.c_str(), 1);
+	  // unshare and sh exec the daemon, it keeps the pid
+	  setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+	}
+	if (opts.fifo) {
+	  // fd 9 keeps a writer on the fifo, the fds of the store start at 3
+	  const char *script = "mount -t tmpfs none /dev/input && mkfifo /dev/input/mice "
+						   "&& exec 9<>/dev/input/mice "
+						   "&& exec \"$0\" -f -b \"$1\" -t 1 -T 0 -m 0 -r \"$2\" -F \"$3\"";
+	  execlp("unshare", "unshare", "-rm", "sh", "-c", script, opts.daemon.c_str(),
+			 state.sink.c_str(), status.c_str(), flight.c_str(), nullptr);
+	} else {
+	  // only the bench keyboard moves, mice are left out
+	  execl(opts.daemon.c_str(), opts.daemon.c_str(), "-f", "-b", state.sink.c_str(),
+			"-t", "1", "-T", "0", "-m", "2", "-r", status.c_str(), "-F", flight.c_str(), nullptr);
+	}
+	perror("latency_bench: exec");
+	_exit(127);
+  }
+  state.ready = false;
+  return true;
+}
+
+bool open_fifo(bench_state &state) {
+  // the fifo is in the namespace of the daemon
+  auto fifo = "/proc/" + std::to_string(state.daemon) + "/root/dev/input/mice";
+  for (int i = 0; i < 100 && state.inputFd < 0; ++i) {
+	std::this_thread::sleep_for(50ms);
+	state.inputFd = open(fifo.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  }
+  if (state.inputFd < 0) {
+	printf("The fifo of the daemon did not appear, see %s\n", (state.dir / "daemon.log").c_str());
+	return false;
+  }
+  return true;
+}
+
+void drop_stored(bench_state &state, const std::string &name) {
+  auto &store = state.store;
+  for (auto it = store.begin(); it != store.end();) {
+	if (name.empty() || it->name == name) {
+	  close(it->fd);
+	  it = store.erase(it);
+	} else {
+	  ++it;
+	}
+  }
+}
+
+// The part of systemd the daemon talks to, see sd_notify(3)
+void receive_notify(bench_state &state) {
+  while (true) {
+	char buf[4096];
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 16)];
+	iovec iov = {buf, sizeof(buf) - 1};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t rd = recvmsg(state.notifyFd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (rd < 0) {
+	  return;
+	}
+	std::vector<int> fds;
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	  if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		fds.resize(fds.size() + count);
+		memcpy(fds.data() + fds.size() - count, CMSG_DATA(cmsg), count * sizeof(int));
+	  }
+	}
+
+	bool fdStore = false;
+	bool remove = false;
+	std::string name;
+	std::istringstream lines(std::string(buf, rd));
+	std::string line;
+	while (std::getline(lines, line)) {
+	  fdStore = fdStore || line == "FDSTORE=1";
+	  remove = remove || line == "FDSTOREREMOVE=1";
+	  state.ready = state.ready || line == "READY=1";
+	  if (line.rfind("FDNAME=", 0) == 0) {
+		name = line.substr(strlen("FDNAME="));
+	  }
+	}
+	if (remove && !name.empty()) {
+	  drop_stored(state, name);
+	}
+	for (int fd : fds) {
+	  if (fdStore) {
+		state.store.push_back({name, fd});
+	  } else {
+		close(fd);
+	  }
+	}
+  }
+}
+
+bool wait_ready(bench_state &state, std::chrono::milliseconds timeout) {
+  uint64_t deadline = now_us() + std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+  while (!state.ready && now_us() < deadline) {
+	pollfd pfd = {state.notifyFd, POLLIN, 0};
+	poll(&pfd, 1, static_cast<int>((deadline - now_us()) / 1000) + 1);
+	receive_notify(state);
+  }
+  return state.ready;
+}
+
+/* Restarts the daemon like systemctl restart while the light is off, a key
+ * is pressed while no daemon runs. Returns the times from SIGTERM until the
+ * new one is ready and until the press turned the light on, in us.
+ * Without the store the parked fds are dropped, the new daemon starts from
+ * scratch.
+ */
+std::pair<std::vector<uint64_t>, std::vector<uint64_t>> run_restarts(bench_state &state, const bench_options &opts,
+																	 bool store) {
+  std::vector<uint64_t> ready;
+  std::vector<uint64_t> lit;
+  for (unsigned int i = 0; i < opts.restarts; ++i) {
+	if (wait_sink(state, [](long value) { return value == 0; }, 5s) == 0) {
+	  printf("The daemon did not turn the light off\n");
+	  break;
+	}
+	uint64_t stopped = now_us();
+	kill(state.daemon, SIGTERM);
+	// the fds arrive while it exits, the socket queue is short
+	while (waitpid(state.daemon, nullptr, WNOHANG) != state.daemon) {
+	  pollfd pfd = {state.notifyFd, POLLIN, 0};
+	  poll(&pfd, 1, 1);
+	  receive_notify(state);
+	}
+	receive_notify(state);
+	state.daemon = -1;
+	// fails without a reader, the key is lost then
+	press_key(state, opts.fifo);
+	if (!store) {
+	  drop_stored(state, "");
+	}
+
+	if (!start_daemon(state, opts) || !wait_ready(state, 5s)) {
+	  printf("The daemon did not get ready, see %s\n", (state.dir / "daemon.log").c_str());
+	  break;
+	}
+	ready.push_back(now_us() - stopped);
+	uint64_t written = wait_sink(state, [](long value) { return value != 0; }, 1s);
+	if (written != 0) {
+	  lit.push_back(written - stopped);
+	}
+  }
+  return {ready, lit};
+}
+
+/* Measures the presses, each one after the daemon turned the light off.
+ * Returns the latencies in us.
+ */
+std::vector<uint64_t> run_presses(const bench_state &state, const bench_options &opts) {
+  std::vector<uint64_t> latencies;
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> jitter(0, 20000);
+  for (unsigned int i = 0; i < opts.presses; ++i) {
+	if (wait_sink(state, [](long value) { return value == 0; }, 5s) == 0) {
+	  printf("The daemon did not turn the light off\n");
+	  break;
+	}
+	// presses are not aligned with the timers of the daemon
+	std::this_thread::sleep_for(std::chrono::microseconds(jitter(random)));
+
+	uint64_t pressed = now_us();
+	if (!press_key(state, opts.fifo)) {
+	  perror("latency_bench: press");
+	  break;
+	}
+	uint64_t written = wait_sink(state, [](long value) { return value != 0; }, 2s);
+	if (written == 0) {
+	  printf("The daemon did not turn the light on\n");
+	  break;
+	}
+	latencies.push_back(written - pressed);
+  }
+  return latencies;
+}
+
+void print_percentiles(const char *name, const char *what, std::vector<uint64_t> latencies) {
+  if (latencies.empty()) {
+	printf("%-7s no %s measured\n", name, what);
+	return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto rank = [&latencies](double p) {
+	size_t i = static_cast<size_t>(p * latencies.size() + 0.999999);
+	return latencies[std::min(latencies.size(), std::max<size_t>(i, 1)) - 1];
+  };
+  printf("%-7s %3zu %-8s  p50 %6lu us  p90 %6lu us  p99 %6lu us  max %6lu us\n",
+		 name, latencies.size(), what, rank(0.5), rank(0.9), rank(0.99), latencies.back());
+}
+
+int main(int argc, char **argv) {
+  bench_options opts;
+  int c;
+  while ((c = getopt(argc, argv, "hn:s:pR:")) != -1) {
+	switch (c) {
+	  case 'n':
+		opts.presses = strtoul(optarg, nullptr, 0);
+		break;
+	  case 's':
+		opts.stressThreads = strtoul(optarg, nullptr, 0);
+		break;
+	  case 'p':
+		opts.fifo = true;
+		break;
+	  case 'R':
+		opts.restarts = strtoul(optarg, nullptr, 0);
+		break;
+	  case 'h':
+	  default:
+		help(argv[0]);
+		return EXIT_FAILURE;
+	}
+  }
+  if (optind + 1 != argc || opts.presses == 0) {
+	help(argv[0]);
+	return EXIT_FAILURE;
+  }
+  opts.daemon = std::filesystem::absolute(argv[optind]);
+
+  // the light lives in memory, the file system adds no latency of its own
+  bench_state state;
+  std::string base = std::filesystem::is_directory("/dev/shm") ? "/dev/shm/kbd_bench.XXXXXX" : "/tmp/kbd_bench.XXXXXX";
+  if (mkdtemp(base.data()) == nullptr) {
+	perror("latency_bench: mkdtemp");
+	return EXIT_FAILURE;
+  }
+  state.dir = base;
+  state.sink = state.dir / "brightness";
+  FILE *fp = fopen(state.sink.c_str(), "w");
+  fprintf(fp, "2");
+  fclose(fp);
+  fp = fopen((state.dir / "max_brightness").c_str(), "w");
+  fprintf(fp, "2");
+  fclose(fp);
+
+  state.notifyPath = state.dir / "notify";
+  state.notifyFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, state.notifyPath.c_str(), sizeof(addr.sun_path) - 1);
+  if (bind(state.notifyFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+	perror("latency_bench: notify socket");
+	return EXIT_FAILURE;
+  }
+
+  // presses into the fifo of a stopped daemon
+  signal(SIGPIPE, SIG_IGN);
+  state.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  inotify_add_watch(state.inotifyFd, state.sink.c_str(), IN_MODIFY);
+  if (!opts.fifo) {
+	state.inputFd = create_keyboard();
+  }
+
+  int result = EXIT_FAILURE;
+  if ((opts.fifo || state.inputFd >= 0) && start_daemon(state, opts) && (!opts.fifo || open_fifo(state))) {
+	// the daemon has to find the keyboard first
+	bool ready = false;
+	for (int i = 0; i < 10 && !ready; ++i) {
+	  press_key(state, opts.fifo);
+	  ready = wait_sink(state, [](long value) { return value != 0; }, 500ms) != 0;
+	}
+	if (ready && opts.restarts > 0) {
+	  // a restart from scratch reads the light while it is off, it forgets the level
+	  auto [storeReady, storeLit] = run_restarts(state, opts, true);
+	  auto [scratchReady, scratchLit] = run_restarts(state, opts, false);
+	  print_percentiles("scratch", "restarts", scratchReady);
+	  print_percentiles("", "presses", scratchLit);
+	  print_percentiles("store", "restarts", storeReady);
+	  print_percentiles("", "presses", storeLit);
+	  result = EXIT_SUCCESS;
+	} else if (ready) {
+	  print_percentiles("idle", "presses", run_presses(state, opts));
+
+	  if (opts.stressThreads > 0) {
+		std::atomic<bool> stop{false};
+		std::vector<std::thread> threads;
+		for (unsigned int i = 0; i < opts.stressThreads; ++i) {
+		  threads.emplace_back([&stop]() {
+			volatile uint64_t spin = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+			  spin = spin + 1;
+			}
+		  });
+		}
+		print_percentiles("stress", "presses", run_presses(state, opts));
+		stop = true;
+		for (auto &thread : threads) {
+		  thread.join();
+		}
+	  }
+	  result = EXIT_SUCCESS;
+	} else {
+	  printf("The daemon did not react to the keyboard, see %s\n", (state.dir / "daemon.log").c_str());
+	}
+  }
+
+  if (state.daemon > 0) {
+	kill(state.daemon, SIGTERM);
+	waitpid(state.daemon, nullptr, 0);
+  }
+  if (state.inputFd >= 0) {
+	close(state.inputFd);
+  }
+  close(state.inotifyFd);
+  drop_stored(state, "");
+  close(state.notifyFd);
+  if (result == EXIT_SUCCESS) {
+	std::filesystem::remove_all(state.dir);
+  }
+  return result;
+}
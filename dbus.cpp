@@ -0,0 +1,928 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Minimal D-Bus client, see dbus.h
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#include "dbus.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+namespace {
+
+enum HEADER_FIELD : uint8_t {
+  FIELD_PATH = 1,
+  FIELD_INTERFACE = 2,
+  FIELD_MEMBER = 3,
+  FIELD_ERROR_NAME = 4,
+  FIELD_REPLY_SERIAL = 5,
+  FIELD_DESTINATION = 6,
+  FIELD_SENDER = 7,
+  FIELD_SIGNATURE = 8
+};
+
+// The bus refuses anything bigger than 128MiB, we refuse a lot earlier
+const uint32_t MAX_MESSAGE_SIZE = 1u << 20u;
+// 32 array and 32 struct levels of the specification, variants count as well
+const int MAX_TYPE_DEPTH = 64;
+// Same as the Hello round trip, a hung bus must not hang the start
+const int AUTH_TIMEOUT_MS = 5000;
+
+size_t type_alignment(char code) {
+  switch (code) {
+	case 'y':
+	case 'g':
+	case 'v':
+	  return 1;
+	case 'n':
+	case 'q':
+	  return 2;
+	case 'b':
+	case 'i':
+	case 'u':
+	case 's':
+	case 'o':
+	case 'a':
+	case 'h':
+	  return 4;
+	default:
+	  return 8;
+  }
+}
+
+// Returns the index after the complete type starting at sig[idx]
+size_t complete_type_end(const std::string &sig, size_t idx) {
+  int nesting = 0;
+  while (idx < sig.size()) {
+	char c = sig[idx++];
+	if (c == 'a') {
+	  continue;
+	}
+	if (c == '(' || c == '{') {
+	  ++nesting;
+	} else if (c == ')' || c == '}') {
+	  --nesting;
+	}
+	if (nesting == 0) {
+	  return idx;
+	}
+  }
+  return idx;
+}
+
+/* Nesting of the complete type at sig[idx], idx is advanced.
+ * -1 if it is no complete type, e.g. unterminated or an empty struct.
+ */
+int type_depth(const std::string &sig, size_t &idx) {
+  if (idx >= sig.size()) {
+	return -1;
+  }
+  char c = sig[idx++];
+  if (c == 'a') {
+	int depth = type_depth(sig, idx);
+	return depth < 0 ? -1 : depth + 1;
+  }
+  if (c == '(' || c == '{') {
+	char close = c == '(' ? ')' : '}';
+	if (idx < sig.size() && sig[idx] == close) {
+	  return -1;
+	}
+	int deepest = 0;
+	while (idx < sig.size() && sig[idx] != close) {
+	  int depth = type_depth(sig, idx);
+	  if (depth < 0) {
+		return -1;
+	  }
+	  deepest = std::max(deepest, depth);
+	}
+	if (idx >= sig.size()) {
+	  return -1;
+	}
+	++idx;
+	return deepest + 1;
+  }
+  return c == ')' || c == '}' ? -1 : 0;
+}
+
+// Returns false if an escape is not followed by two hex digits
+bool unescape_address_value(const std::string &val, std::string &out) {
+  out.clear();
+  for (size_t i = 0; i < val.size(); ++i) {
+	if (val[i] != '%') {
+	  out += val[i];
+	  continue;
+	}
+	if (i + 2 >= val.size() || !isxdigit(val[i + 1]) || !isxdigit(val[i + 2])) {
+	  return false;
+	}
+	out += static_cast<char>(strtol(val.substr(i + 1, 2).c_str(), nullptr, 16));
+	i += 2;
+  }
+  return true;
+}
+
+void add_header_field(dbus_writer &w, uint8_t code, char type,
+					  const std::string &val) {
+  w.open_struct();
+  w.add_byte(code);
+  w.open_variant(std::string(1, type));
+  if (type == 'g') {
+	w.add_byte(static_cast<uint8_t>(val.size()));
+	for (const auto c : val) {
+	  w.add_byte(static_cast<uint8_t>(c));
+	}
+	w.add_byte(0);
+  } else if (type == 'o') {
+	w.add_object_path(val);
+  } else {
+	w.add_string(val);
+  }
+  w.close_container();
+  w.close_container();
+}
+
+} // namespace
+
+dbus_message dbus_method_call(const std::string &destination,
+							  const std::string &path,
+							  const std::string &interface,
+							  const std::string &member) {
+  dbus_message msg;
+  msg.type = DBUS_METHOD_CALL;
+  msg.destination = destination;
+  msg.path = path;
+  msg.interface = interface;
+  msg.member = member;
+  return msg;
+}
+
+dbus_message dbus_signal(const std::string &path,
+						 const std::string &interface,
+						 const std::string &member) {
+  dbus_message msg;
+  msg.type = DBUS_SIGNAL;
+  msg.flags = DBUS_FLAG_NO_REPLY_EXPECTED;
+  msg.path = path;
+  msg.interface = interface;
+  msg.member = member;
+  return msg;
+}
+
+void dbus_writer::align(size_t alignment) {
+  while (buf_.size() % alignment) {
+	buf_.push_back(0);
+  }
+}
+
+void dbus_writer::raw(const void *data, size_t len) {
+  auto p = static_cast<const uint8_t *>(data);
+  buf_.insert(buf_.end(), p, p + len);
+}
+
+void dbus_writer::add_signature(char code) {
+  if (depth_ == 0) {
+	sig_ += code;
+  }
+}
+
+void dbus_writer::add_byte(uint8_t val) {
+  add_signature('y');
+  buf_.push_back(val);
+}
+
+void dbus_writer::add_bool(bool val) {
+  add_signature('b');
+  align(4);
+  uint32_t v = val ? 1 : 0;
+  raw(&v, sizeof(v));
+}
+
+void dbus_writer::add_int32(int32_t val) {
+  add_signature('i');
+  align(4);
+  raw(&val, sizeof(val));
+}
+
+void dbus_writer::add_uint32(uint32_t val) {
+  add_signature('u');
+  align(4);
+  raw(&val, sizeof(val));
+}
+
+void dbus_writer::add_uint64(uint64_t val) {
+  add_signature('t');
+  align(8);
+  raw(&val, sizeof(val));
+}
+
+void dbus_writer::add_double(double val) {
+  add_signature('d');
+  align(8);
+  raw(&val, sizeof(val));
+}
+
+void dbus_writer::add_string(const std::string &val) {
+  add_signature('s');
+  align(4);
+  auto len = static_cast<uint32_t>(val.size());
+  raw(&len, sizeof(len));
+  raw(val.c_str(), val.size() + 1);
+}
+
+void dbus_writer::add_object_path(const std::string &val) {
+  add_signature('o');
+  align(4);
+  auto len = static_cast<uint32_t>(val.size());
+  raw(&len, sizeof(len));
+  raw(val.c_str(), val.size() + 1);
+}
+
+void dbus_writer::open_array(const std::string &elementSignature) {
+  if (depth_ == 0) {
+	sig_ += "a" + elementSignature;
+  }
+  ++depth_;
+  align(4);
+  size_t lenPos = buf_.size();
+  uint32_t len = 0;
+  raw(&len, sizeof(len));
+  // Padding to the first element is not part of the array length
+  align(type_alignment(elementSignature.at(0)));
+  arrays_.emplace_back(lenPos, buf_.size());
+}
+
+void dbus_writer::close_array() {
+  auto [lenPos, start] = arrays_.back();
+  arrays_.pop_back();
+  auto len = static_cast<uint32_t>(buf_.size() - start);
+  memcpy(&buf_[lenPos], &len, sizeof(len));
+  --depth_;
+}
+
+void dbus_writer::open_struct() {
+  // Struct signatures are written by the caller
+  ++depth_;
+  align(8);
+}
+
+void dbus_writer::open_variant(const std::string &signature) {
+  if (depth_ == 0) {
+	sig_ += 'v';
+  }
+  ++depth_;
+  buf_.push_back(static_cast<uint8_t>(signature.size()));
+  raw(signature.c_str(), signature.size() + 1);
+}
+
+void dbus_writer::close_container() {
+  --depth_;
+}
+
+bool dbus_reader::align(size_t alignment) {
+  while (ok_ && pos_ % alignment) {
+	if (pos_ >= buf_.size() || buf_[pos_] != 0) {
+	  ok_ = false;
+	}
+	++pos_;
+  }
+  return ok_;
+}
+
+bool dbus_reader::raw(void *data, size_t len) {
+  if (!ok_ || pos_ + len > buf_.size()) {
+	ok_ = false;
+	return false;
+  }
+  memcpy(data, &buf_[pos_], len);
+  if (bigEndian_) {
+	std::reverse(static_cast<uint8_t *>(data),
+				 static_cast<uint8_t *>(data) + len);
+  }
+  pos_ += len;
+  return true;
+}
+
+bool dbus_reader::read_byte(uint8_t &val) {
+  return raw(&val, 1);
+}
+
+bool dbus_reader::read_bool(bool &val) {
+  uint32_t v;
+  if (!read_uint32(v) || v > 1) {
+	ok_ = false;
+	return false;
+  }
+  val = v == 1;
+  return true;
+}
+
+bool dbus_reader::read_int32(int32_t &val) {
+  return align(4) && raw(&val, sizeof(val));
+}
+
+bool dbus_reader::read_uint32(uint32_t &val) {
+  return align(4) && raw(&val, sizeof(val));
+}
+
+bool dbus_reader::read_uint64(uint64_t &val) {
+  return align(8) && raw(&val, sizeof(val));
+}
+
+bool dbus_reader::read_string(std::string &val) {
+  uint32_t len;
+  if (!read_uint32(len) || pos_ + len + 1 > buf_.size() || buf_[pos_ + len] != 0) {
+	ok_ = false;
+	return false;
+  }
+  val.assign(reinterpret_cast<const char *>(&buf_[pos_]), len);
+  pos_ += len + 1;
+  return true;
+}
+
+bool dbus_reader::read_signature(std::string &val) {
+  uint8_t len;
+  if (!read_byte(len) || pos_ + len + 1 > buf_.size() || buf_[pos_ + len] != 0) {
+	ok_ = false;
+	return false;
+  }
+  val.assign(reinterpret_cast<const char *>(&buf_[pos_]), len);
+  pos_ += len + 1;
+  return true;
+}
+
+bool dbus_reader::enter_array(const std::string &elementSignature, size_t &end) {
+  uint32_t len;
+  if (!read_uint32(len) || len > MAX_MESSAGE_SIZE
+	  || !align(type_alignment(elementSignature.at(0)))
+	  || pos_ + len > buf_.size()) {
+	ok_ = false;
+	return false;
+  }
+  end = pos_ + len;
+  return true;
+}
+
+bool dbus_reader::enter_struct() {
+  return align(8);
+}
+
+bool dbus_reader::skip(const std::string &sig, size_t &idx) {
+  size_t end = idx;
+  int depth = type_depth(sig, end);
+  if (depth < 0 || depth > MAX_TYPE_DEPTH) {
+	ok_ = false;
+	return false;
+  }
+  return skip(sig, idx, 0);
+}
+
+bool dbus_reader::skip(const std::string &sig, size_t &idx, int depth) {
+  if (!ok_ || idx >= sig.size() || depth > MAX_TYPE_DEPTH) {
+	ok_ = false;
+	return false;
+  }
+
+  uint8_t b;
+  uint32_t u;
+  uint64_t t;
+  std::string s;
+  char code = sig[idx++];
+  switch (code) {
+	case 'y':
+	  return read_byte(b);
+	case 'n':
+	case 'q':
+	  return align(2) && raw(&u, 2);
+	case 'b':
+	case 'i':
+	case 'u':
+	case 'h':
+	  return read_uint32(u);
+	case 'x':
+	case 't':
+	case 'd':
+	  return read_uint64(t);
+	case 's':
+	case 'o':
+	  return read_string(s);
+	case 'g':
+	  return read_signature(s);
+	case 'v': {
+	  if (!read_signature(s)) {
+		return false;
+	  }
+	  size_t i = 0;
+	  int inner = type_depth(s, i);
+	  if (inner < 0 || i != s.size() || depth + 1 + inner > MAX_TYPE_DEPTH) {
+		ok_ = false;
+		return false;
+	  }
+	  i = 0;
+	  return skip(s, i, depth + 1) && i == s.size();
+	}
+	case 'a': {
+	  size_t elementEnd = complete_type_end(sig, idx);
+	  if (elementEnd == idx) {
+		ok_ = false;
+		return false;
+	  }
+	  std::string element = sig.substr(idx, elementEnd - idx);
+	  size_t end;
+	  if (!enter_array(element, end)) {
+		return false;
+	  }
+	  while (ok_ && pos_ < end) {
+		size_t i = 0;
+		skip(element, i, depth + 1);
+	  }
+	  idx = elementEnd;
+	  return ok_ && pos_ == end;
+	}
+	case '(':
+	case '{': {
+	  if (!enter_struct()) {
+		return false;
+	  }
+	  char close = code == '(' ? ')' : '}';
+	  // an empty struct takes no bytes, an array of them would never end
+	  if (idx < sig.size() && sig[idx] == close) {
+		ok_ = false;
+		return false;
+	  }
+	  while (ok_ && idx < sig.size() && sig[idx] != close) {
+		skip(sig, idx, depth + 1);
+	  }
+	  if (idx >= sig.size()) {
+		ok_ = false;
+		return false;
+	  }
+	  ++idx;
+	  return ok_;
+	}
+	default:
+	  ok_ = false;
+	  return false;
+  }
+}
+
+dbus_connection::~dbus_connection() {
+  close();
+}
+
+void dbus_connection::close() {
+  if (fd_ >= 0) {
+	::close(fd_);
+  }
+  fd_ = -1;
+  in_.clear();
+  out_.clear();
+  pending_.clear();
+  queued_.clear();
+}
+
+bool dbus_connection::connect_address(const std::string &address) {
+  // unix:path=/run/dbus/system_bus_socket,guid=...
+  if (address.rfind("unix:", 0) != 0) {
+	return false;
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  socklen_t addrLen = 0;
+  std::istringstream ss(address.substr(5));
+  std::string kv;
+  while (std::getline(ss, kv, ',')) {
+	auto eq = kv.find('=');
+	if (eq == std::string::npos) {
+	  continue;
+	}
+	auto key = kv.substr(0, eq);
+	std::string val;
+	if (!unescape_address_value(kv.substr(eq + 1), val)) {
+	  printf("Invalid D-Bus address %s\n", address.c_str());
+	  return false;
+	}
+	if (val.size() >= sizeof(addr.sun_path) - 1) {
+	  return false;
+	}
+	if (key == "path") {
+	  memcpy(addr.sun_path, val.c_str(), val.size() + 1);
+	  addrLen = offsetof(sockaddr_un, sun_path) + val.size() + 1;
+	} else if (key == "abstract") {
+	  memcpy(addr.sun_path + 1, val.c_str(), val.size());
+	  addrLen = offsetof(sockaddr_un, sun_path) + val.size() + 1;
+	}
+  }
+  if (addrLen == 0) {
+	return false;
+  }
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+	return false;
+  }
+  if (connect(fd_, reinterpret_cast<sockaddr *>(&addr), addrLen) < 0) {
+	::close(fd_);
+	fd_ = -1;
+	return false;
+  }
+  return true;
+}
+
+bool dbus_connection::authenticate() {
+  std::string uid = std::to_string(getuid());
+  std::string hexUid;
+  char hex[3];
+  for (const auto c : uid) {
+	snprintf(hex, sizeof(hex), "%02x", c);
+	hexUid += hex;
+  }
+
+  std::string auth = std::string(1, '\0') + "AUTH EXTERNAL " + hexUid + "\r\n";
+  if (write(fd_, auth.data(), auth.size()) != static_cast<ssize_t>(auth.size())) {
+	return false;
+  }
+
+  // the bus sends nothing after the reply line until it got BEGIN
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(AUTH_TIMEOUT_MS);
+  std::string line;
+  while (line.size() < 512
+	  && (line.size() < 2 || line.compare(line.size() - 2, 2, "\r\n") != 0)) {
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+		deadline - std::chrono::steady_clock::now()).count();
+	if (left <= 0) {
+	  printf("The D-Bus daemon did not answer the authentication\n");
+	  return false;
+	}
+	pollfd pfd = {fd_, POLLIN, 0};
+	if (poll(&pfd, 1, static_cast<int>(left)) < 0 && errno != EINTR) {
+	  return false;
+	}
+	char buf[64];
+	auto rd = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+	if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+	  return false;
+	}
+	if (rd > 0) {
+	  line.append(buf, rd);
+	}
+  }
+  if (line.rfind("OK ", 0) != 0) {
+	return false;
+  }
+
+  const std::string begin = "BEGIN\r\n";
+  return write(fd_, begin.data(), begin.size()) == static_cast<ssize_t>(begin.size());
+}
+
+bool dbus_connection::open(const std::string &address) {
+  close();
+  std::istringstream ss(address);
+  std::string candidate;
+  while (std::getline(ss, candidate, ';')) {
+	if (connect_address(candidate)) {
+	  break;
+	}
+  }
+  if (fd_ < 0) {
+	return false;
+  }
+
+  if (!authenticate()) {
+	close();
+	return false;
+  }
+
+  auto hello = dbus_method_call("org.freedesktop.DBus",
+								"/org/freedesktop/DBus",
+								"org.freedesktop.DBus",
+								"Hello");
+  dbus_message reply;
+  if (!call_sync(hello, reply, 5000) || reply.type != DBUS_METHOD_RETURN) {
+	close();
+	return false;
+  }
+  dbus_reader r(reply);
+  if (!r.read_string(uniqueName_)) {
+	close();
+	return false;
+  }
+  return true;
+}
+
+uint32_t dbus_connection::send(dbus_message &msg) {
+  msg.serial = ++serial_;
+
+  dbus_message header;
+  dbus_writer w(header);
+  w.add_byte('l');
+  w.add_byte(msg.type);
+  w.add_byte(msg.flags);
+  w.add_byte(1);
+  w.add_uint32(static_cast<uint32_t>(msg.body.size()));
+  w.add_uint32(msg.serial);
+  w.open_array("(yv)");
+  if (!msg.path.empty()) {
+	add_header_field(w, FIELD_PATH, 'o', msg.path);
+  }
+  if (!msg.interface.empty()) {
+	add_header_field(w, FIELD_INTERFACE, 's', msg.interface);
+  }
+  if (!msg.member.empty()) {
+	add_header_field(w, FIELD_MEMBER, 's', msg.member);
+  }
+  if (!msg.errorName.empty()) {
+	add_header_field(w, FIELD_ERROR_NAME, 's', msg.errorName);
+  }
+  if (msg.replySerial != 0) {
+	w.open_struct();
+	w.add_byte(FIELD_REPLY_SERIAL);
+	w.open_variant("u");
+	w.add_uint32(msg.replySerial);
+	w.close_container();
+	w.close_container();
+  }
+  if (!msg.destination.empty()) {
+	add_header_field(w, FIELD_DESTINATION, 's', msg.destination);
+  }
+  if (!msg.signature.empty()) {
+	add_header_field(w, FIELD_SIGNATURE, 'g', msg.signature);
+  }
+  w.close_array();
+  while (header.body.size() % 8) {
+	header.body.push_back(0);
+  }
+
+  out_.insert(out_.end(), header.body.begin(), header.body.end());
+  out_.insert(out_.end(), msg.body.begin(), msg.body.end());
+  flush();
+  return msg.serial;
+}
+
+uint32_t dbus_connection::call(dbus_message &msg, dbus_reply_handler handler) {
+  auto serial = send(msg);
+  pending_[serial] = std::move(handler);
+  return serial;
+}
+
+void dbus_connection::send_reply(const dbus_message &call,
+								 dbus_message &ret,
+								 DBUS_MESSAGE_TYPE type) {
+  if (call.flags & DBUS_FLAG_NO_REPLY_EXPECTED) {
+	return;
+  }
+  ret.type = type;
+  ret.flags = DBUS_FLAG_NO_REPLY_EXPECTED;
+  ret.replySerial = call.serial;
+  ret.destination = call.sender;
+  send(ret);
+}
+
+void dbus_connection::reply(const dbus_message &call, dbus_message &ret) {
+  send_reply(call, ret, DBUS_METHOD_RETURN);
+}
+
+void dbus_connection::reply_error(const dbus_message &call,
+								  const std::string &name,
+								  const std::string &text) {
+  dbus_message err;
+  err.errorName = name;
+  dbus_writer w(err);
+  w.add_string(text);
+  send_reply(call, err, DBUS_ERROR);
+}
+
+void dbus_connection::add_match(const std::string &rule) {
+  auto msg = dbus_method_call("org.freedesktop.DBus",
+							  "/org/freedesktop/DBus",
+							  "org.freedesktop.DBus",
+							  "AddMatch");
+  msg.flags = DBUS_FLAG_NO_REPLY_EXPECTED;
+  dbus_writer w(msg);
+  w.add_string(rule);
+  send(msg);
+}
+
+bool dbus_connection::flush() {
+  while (!out_.empty()) {
+	auto written = ::send(fd_, out_.data(), out_.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (written < 0) {
+	  if (errno == EINTR) {
+		continue;
+	  }
+	  return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+	out_.erase(out_.begin(), out_.begin() + written);
+  }
+  return true;
+}
+
+bool dbus_connection::read_available() {
+  uint8_t buf[4096];
+  while (true) {
+	auto rd = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+	if (rd > 0) {
+	  in_.insert(in_.end(), buf, buf + rd);
+	  continue;
+	}
+	if (rd == 0) {
+	  return false;
+	}
+	if (errno == EINTR) {
+	  continue;
+	}
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+}
+
+bool dbus_connection::parse_message(dbus_message &msg) {
+  if (in_.size() < 16) {
+	return false;
+  }
+
+  bool bigEndian = in_[0] == 'B';
+  dbus_reader fixed(in_, bigEndian);
+  uint8_t endian, type, flags, version;
+  uint32_t bodyLen, serial, fieldsLen;
+  fixed.read_byte(endian);
+  fixed.read_byte(type);
+  fixed.read_byte(flags);
+  fixed.read_byte(version);
+  fixed.read_uint32(bodyLen);
+  fixed.read_uint32(serial);
+  fixed.read_uint32(fieldsLen);
+  if (bodyLen > MAX_MESSAGE_SIZE || fieldsLen > MAX_MESSAGE_SIZE) {
+	// Nothing sane can follow, drop the connection
+	close();
+	return false;
+  }
+
+  size_t headerLen = 16 + fieldsLen;
+  headerLen = (headerLen + 7) & ~size_t(7);
+  if (in_.size() < headerLen + bodyLen) {
+	return false;
+  }
+
+  msg = dbus_message();
+  msg.type = type;
+  msg.flags = flags;
+  msg.bigEndian = bigEndian;
+  msg.serial = serial;
+
+  std::vector<uint8_t> header(in_.begin(), in_.begin() + 16 + fieldsLen);
+  dbus_reader r(header, bigEndian);
+  r.seek(12);
+  size_t end;
+  if (r.enter_array("(yv)", end)) {
+	while (r.ok() && r.pos() < end) {
+	  uint8_t code = 0;
+	  std::string sig;
+	  r.enter_struct();
+	  r.read_byte(code);
+	  r.read_signature(sig);
+	  std::string *target = nullptr;
+	  switch (code) {
+		case FIELD_PATH:
+		  target = &msg.path;
+		  break;
+		case FIELD_INTERFACE:
+		  target = &msg.interface;
+		  break;
+		case FIELD_MEMBER:
+		  target = &msg.member;
+		  break;
+		case FIELD_ERROR_NAME:
+		  target = &msg.errorName;
+		  break;
+		case FIELD_DESTINATION:
+		  target = &msg.destination;
+		  break;
+		case FIELD_SENDER:
+		  target = &msg.sender;
+		  break;
+		default:
+		  break;
+	  }
+	  if (target != nullptr && (sig == "s" || sig == "o")) {
+		r.read_string(*target);
+	  } else if (code == FIELD_SIGNATURE && sig == "g") {
+		r.read_signature(msg.signature);
+	  } else if (code == FIELD_REPLY_SERIAL && sig == "u") {
+		r.read_uint32(msg.replySerial);
+	  } else {
+		size_t i = 0;
+		r.skip(sig, i);
+	  }
+	}
+  }
+
+  msg.body.assign(in_.begin() + headerLen, in_.begin() + headerLen + bodyLen);
+  in_.erase(in_.begin(), in_.begin() + headerLen + bodyLen);
+  if (!r.ok()) {
+	msg.type = DBUS_INVALID;
+  }
+  return true;
+}
+
+void dbus_connection::handle(const dbus_message &msg,
+							 const std::function<void(const dbus_message &)> &handler) {
+  if (msg.type == DBUS_METHOD_RETURN || msg.type == DBUS_ERROR) {
+	auto it = pending_.find(msg.replySerial);
+	if (it != pending_.end()) {
+	  auto replyHandler = std::move(it->second);
+	  pending_.erase(it);
+	  if (replyHandler) {
+		replyHandler(msg);
+	  }
+	}
+	return;
+  }
+  if (msg.type != DBUS_INVALID && handler) {
+	handler(msg);
+  }
+}
+
+bool dbus_connection::call_sync(dbus_message &msg, dbus_message &reply, int timeoutMs) {
+  auto serial = send(msg);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  while (fd_ >= 0) {
+	dbus_message in;
+	while (parse_message(in)) {
+	  if ((in.type == DBUS_METHOD_RETURN || in.type == DBUS_ERROR)
+		  && in.replySerial == serial) {
+		reply = std::move(in);
+		return true;
+	  }
+	  // Keep everything else for the next dispatch
+	  queued_.push_back(std::move(in));
+	}
+
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+		deadline - std::chrono::steady_clock::now()).count();
+	if (left <= 0) {
+	  return false;
+	}
+	pollfd pfd = {fd_, static_cast<short>(POLLIN | (wants_write() ? POLLOUT : 0)), 0};
+	if (poll(&pfd, 1, static_cast<int>(left)) < 0 && errno != EINTR) {
+	  return false;
+	}
+	if (!flush() || !read_available()) {
+	  close();
+	  return false;
+	}
+  }
+  return false;
+}
+
+bool dbus_connection::dispatch(const std::function<void(const dbus_message &)> &handler) {
+  while (!queued_.empty()) {
+	auto msg = std::move(queued_.front());
+	queued_.pop_front();
+	handle(msg, handler);
+  }
+
+  if (fd_ < 0) {
+	return false;
+  }
+  bool alive = read_available();
+  dbus_message msg;
+  while (fd_ >= 0 && parse_message(msg)) {
+	handle(msg, handler);
+  }
+  return alive && fd_ >= 0 && flush();
+}
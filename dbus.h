@@ -0,0 +1,215 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Minimal D-Bus client used to talk to the system bus from the event loop.
+ * Only the parts of the wire protocol the daemon needs are implemented:
+ * SASL EXTERNAL authentication, little and big endian message parsing and
+ * marshalling of the basic types, arrays, structs and variants.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_DBUS_H
+#define KBD_BACKLIGHT_DBUS_H
+
+#include <cstdint>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+const std::string DBUS_SYSTEM_BUS_DEFAULT_ADDRESS =
+	"unix:path=/var/run/dbus/system_bus_socket";
+
+enum DBUS_MESSAGE_TYPE : uint8_t {
+  DBUS_INVALID = 0,
+  DBUS_METHOD_CALL = 1,
+  DBUS_METHOD_RETURN = 2,
+  DBUS_ERROR = 3,
+  DBUS_SIGNAL = 4
+};
+
+const uint8_t DBUS_FLAG_NO_REPLY_EXPECTED = 0x1;
+const uint32_t DBUS_NAME_FLAG_DO_NOT_QUEUE = 0x4;
+const uint32_t DBUS_REQUEST_NAME_PRIMARY_OWNER = 1;
+
+struct dbus_message {
+  uint8_t type = DBUS_INVALID;
+  uint8_t flags = 0;
+  bool bigEndian = false;
+  uint32_t serial = 0;
+  uint32_t replySerial = 0;
+  std::string path;
+  std::string interface;
+  std::string member;
+  std::string errorName;
+  std::string destination;
+  std::string sender;
+  std::string signature;
+  std::vector<uint8_t> body;
+};
+
+dbus_message dbus_method_call(const std::string &destination,
+							  const std::string &path,
+							  const std::string &interface,
+							  const std::string &member);
+
+dbus_message dbus_signal(const std::string &path,
+						 const std::string &interface,
+						 const std::string &member);
+
+/* Appends values to a message body.
+ * The body always starts on an 8 byte boundary of the message,
+ * so alignment relative to the body is the same as the absolute one.
+ */
+class dbus_writer {
+ public:
+  explicit dbus_writer(dbus_message &msg) : buf_(msg.body), sig_(msg.signature) {}
+
+  void add_byte(uint8_t val);
+  void add_bool(bool val);
+  void add_int32(int32_t val);
+  void add_uint32(uint32_t val);
+  void add_uint64(uint64_t val);
+  void add_double(double val);
+  void add_string(const std::string &val);
+  void add_object_path(const std::string &val);
+
+  // Containers take care of the signature themselves,
+  // values written inside them are not added to the message signature.
+  void open_array(const std::string &elementSignature);
+  void close_array();
+  void open_struct();
+  void open_variant(const std::string &signature);
+  void close_container();
+
+ private:
+  void align(size_t alignment);
+  void raw(const void *data, size_t len);
+  void add_signature(char code);
+
+  std::vector<uint8_t> &buf_;
+  std::string &sig_;
+  int depth_ = 0;
+  // length field position and first element offset of open arrays
+  std::vector<std::pair<size_t, size_t>> arrays_;
+};
+
+/* Reads values from a message body.
+ * All functions return false if the body is malformed or the value does not
+ * match, after that the reader stays in the failed state.
+ */
+class dbus_reader {
+ public:
+  explicit dbus_reader(const dbus_message &msg)
+	  : buf_(msg.body), bigEndian_(msg.bigEndian) {}
+  dbus_reader(const std::vector<uint8_t> &buf, bool bigEndian)
+	  : buf_(buf), bigEndian_(bigEndian) {}
+
+  bool read_byte(uint8_t &val);
+  bool read_bool(bool &val);
+  bool read_int32(int32_t &val);
+  bool read_uint32(uint32_t &val);
+  bool read_uint64(uint64_t &val);
+  bool read_string(std::string &val);
+  bool read_signature(std::string &val);
+
+  // Arrays: read the length and return the end offset in `end`.
+  // Iterate while `pos() < end`.
+  bool enter_array(const std::string &elementSignature, size_t &end);
+  bool enter_struct();
+  size_t pos() const { return pos_; }
+  void seek(size_t pos) { pos_ = pos; }
+  bool ok() const { return ok_; }
+
+  // Skip exactly one complete type starting at sig[idx], idx is advanced
+  bool skip(const std::string &sig, size_t &idx);
+
+ private:
+  // depth counts the arrays, structs, dict entries and variants around the type
+  bool skip(const std::string &sig, size_t &idx, int depth);
+  bool align(size_t alignment);
+  bool raw(void *data, size_t len);
+
+  const std::vector<uint8_t> &buf_;
+  bool bigEndian_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+using dbus_reply_handler = std::function<void(const dbus_message &)>;
+
+class dbus_connection {
+ public:
+  dbus_connection() = default;
+  dbus_connection(const dbus_connection &) = delete;
+  dbus_connection &operator=(const dbus_connection &) = delete;
+  ~dbus_connection();
+
+  // Connects, authenticates and says Hello. Blocks until the bus answered.
+  bool open(const std::string &address);
+  void close();
+  int fd() const { return fd_; }
+  const std::string &unique_name() const { return uniqueName_; }
+
+  // Queues the message, assigns the serial and tries to write it out
+  uint32_t send(dbus_message &msg);
+  uint32_t call(dbus_message &msg, dbus_reply_handler handler);
+  void reply(const dbus_message &call, dbus_message &ret);
+  void reply_error(const dbus_message &call,
+				   const std::string &name,
+				   const std::string &text);
+  void add_match(const std::string &rule);
+
+  // Blocking round trip, only meant to be used before the event loop runs
+  bool call_sync(dbus_message &msg, dbus_message &reply, int timeoutMs);
+
+  // Writes as much of the outgoing queue as possible without blocking
+  bool flush();
+  bool wants_write() const { return !out_.empty(); }
+
+  // Reads everything that is available and hands each message that is not a
+  // reply to a pending call to `handler`. Returns false if the bus is gone.
+  bool dispatch(const std::function<void(const dbus_message &)> &handler);
+
+ private:
+  bool connect_address(const std::string &address);
+  bool authenticate();
+  bool read_available();
+  bool parse_message(dbus_message &msg);
+  void send_reply(const dbus_message &call, dbus_message &ret, DBUS_MESSAGE_TYPE type);
+  void handle(const dbus_message &msg,
+			  const std::function<void(const dbus_message &)> &handler);
+
+  int fd_ = -1;
+  uint32_t serial_ = 0;
+  std::string uniqueName_;
+  std::vector<uint8_t> in_;
+  std::vector<uint8_t> out_;
+  std::deque<dbus_message> queued_;
+  std::map<uint32_t, dbus_reply_handler> pending_;
+};
+
+#endif //KBD_BACKLIGHT_DBUS_H
@@ -0,0 +1,3590 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Engine of the service: device discovery, input filters, the timeout policy
+ * and the brightness sink, driven through a single epoll fd.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#include <linux/input.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include "dbus.h"
+#include "engine.h"
+#include "hub.h"
+#include "kbd_backlight.h"
+#include "recorder.h"
+#include "sink_profile.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <regex>
+#include <fstream>
+#include <chrono>
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+std::chrono::time_point<std::chrono::steady_clock> lastEvent_;
+// Last input which turns the keyboard light on while only keys do that
+std::chrono::time_point<std::chrono::steady_clock> lastKey_;
+
+const size_t TRACE_CAPACITY = 16384;
+// Devices which need longer to open are reported and added once they are ready
+const std::chrono::milliseconds PROBE_TIMEOUT = 2000ms;
+// Retry delay for devices which failed, doubled on every failure
+const std::chrono::milliseconds DEVICE_BACKOFF_MIN = 1000ms;
+const std::chrono::milliseconds DEVICE_BACKOFF_MAX = 60000ms;
+const std::string INPUT_DEVICE_DIR = "/dev/input";
+// A key of a virtual keyboard this soon after one of a physical keyboard repeats it,
+// long enough for the hold timeouts of remappers
+const std::chrono::milliseconds MIRROR_WINDOW = 1000ms;
+// Faulty devices are checked again after this delay, doubled while they stay faulty
+const std::chrono::milliseconds QUARANTINE_RECHECK_MIN = 60000ms;
+const std::chrono::milliseconds QUARANTINE_RECHECK_MAX = 1800000ms;
+// How long a quarantined device is read without turning on the light to check it
+const std::chrono::milliseconds QUARANTINE_PROBATION = 10000ms;
+// A press of a key this soon after its release is a bounce of the contact
+const std::chrono::milliseconds CHATTER_GAP = 8ms;
+const std::chrono::milliseconds CHATTER_WINDOW = 60000ms;
+// The fastest mice report at 8 kHz, more than twice that is no longer input
+const unsigned long FLOOD_FRAMES_PER_SECOND = 20000;
+
+// Own name of the service. It serves the UPower KbdBacklight interface on the
+// same path, so a client of UPower only has to change the destination.
+const std::string SERVICE_BUS_NAME = "io.github.alexmohr.KeyboardBacklight";
+// Desktops change the brightness through UPower, the service follows it
+const std::string UPOWER_BUS_NAME = "org.freedesktop.UPower";
+const std::string UPOWER_KBD_PATH = "/org/freedesktop/UPower/KbdBacklight";
+const std::string UPOWER_KBD_INTERFACE = "org.freedesktop.UPower.KbdBacklight";
+const std::string LOGIND_BUS_NAME = "org.freedesktop.login1";
+const std::string LOGIND_SEAT_PATH = "/org/freedesktop/login1/seat/seat0";
+const std::string LOGIND_SEAT_INTERFACE = "org.freedesktop.login1.Seat";
+const std::string LOGIND_SESSION_INTERFACE = "org.freedesktop.login1.Session";
+const std::string UPOWER_KBD_INTROSPECTION =
+	"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+	" \"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+	"<node>\n"
+	" <interface name=\"org.freedesktop.UPower.KbdBacklight\">\n"
+	"  <method name=\"GetMaxBrightness\"><arg type=\"i\" direction=\"out\"/></method>\n"
+	"  <method name=\"GetBrightness\"><arg type=\"i\" direction=\"out\"/></method>\n"
+	"  <method name=\"SetBrightness\"><arg type=\"i\" direction=\"in\"/></method>\n"
+	"  <signal name=\"BrightnessChanged\"><arg type=\"i\"/></signal>\n"
+	"  <signal name=\"BrightnessChangedWithSource\"><arg type=\"i\"/><arg type=\"s\"/></signal>\n"
+	" </interface>\n"
+	" <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
+	"  <method name=\"Introspect\"><arg type=\"s\" direction=\"out\"/></method>\n"
+	" </interface>\n"
+	" <interface name=\"org.freedesktop.DBus.Peer\">\n"
+	"  <method name=\"Ping\"/>\n"
+	" </interface>\n"
+	"</node>\n";
+
+enum EVENT_SOURCE {
+  SOURCE_INPUT = 0,
+  SOURCE_TIMER = 1,
+  // fds the host watches through the engine
+  SOURCE_HOST = 2,
+  SOURCE_DBUS = 3,
+  SOURCE_AUDIT = 4,
+  SOURCE_PROBE = 5,
+  SOURCE_PROBE_TIMER = 6,
+  SOURCE_DEVICE_TIMER = 7,
+  SOURCE_HOTPLUG = 8,
+  SOURCE_HUB = 9,
+  SOURCE_HUB_TIMER = 10,
+  SOURCE_FADE_TIMER = 11
+};
+
+// Wakeups are attributed to these for the self audit
+enum AUDIT_SOURCE {
+  AUDIT_INPUT = 0,
+  AUDIT_TIMER = 1,
+  AUDIT_SINK = 2,
+  AUDIT_CONTROL = 3,
+  AUDIT_SOURCE_COUNT = 4
+};
+
+const char *AUDIT_SOURCE_NAMES[AUDIT_SOURCE_COUNT] = {"input", "timer", "sink", "control"};
+
+struct audit_counters {
+  uint64_t loopWakeups;
+  uint64_t events[AUDIT_SOURCE_COUNT];
+};
+
+struct process_sample {
+  std::chrono::time_point<std::chrono::steady_clock> time;
+  // /proc/self/schedstat
+  uint64_t runNs;
+  uint64_t waitNs;
+  uint64_t timeslices;
+  // /proc/self/status
+  uint64_t voluntarySwitches;
+  uint64_t involuntarySwitches;
+  uint64_t rssKb;
+  // includes the current rss, ru_maxrss of getrusage lags behind it
+  uint64_t maxRssKb;
+  // /proc/self/io, only read and write like calls are counted there
+  uint64_t readCalls;
+  uint64_t writeCalls;
+  rusage usage;
+  audit_counters counters;
+};
+
+struct event_source {
+  EVENT_SOURCE type;
+  int fd;
+  // the device or host source this is part of
+  void *owner = nullptr;
+};
+
+enum SINK_TYPE {
+  SINK_KEYBOARD = 0,
+  SINK_DISPLAY = 1
+};
+
+const char *SINK_TYPE_NAMES[] = {"keyboard", "display"};
+
+struct sink_stage {
+  // idle time after which the stage starts
+  std::chrono::milliseconds after;
+  // of the on level, 0 turns the light off
+  unsigned int percent;
+};
+
+/* Time a light spent at each level and the energy that took.
+ * It is updated when the level changes, an idle light costs nothing.
+ */
+struct energy_ledger {
+  // a blanked display counts as level 0
+  std::map<uint64_t, std::chrono::microseconds> levelTime;
+  // successful writes of the brightness and of bl_power, on a thinkpad each is an EC command
+  uint64_t writes = 0;
+  double usedMj = 0;
+  // the same time at the on level, what the light takes without the service
+  double alwaysOnMj = 0;
+  std::chrono::time_point<std::chrono::steady_clock> since;
+};
+
+// A light is faded down over this time if its profile allows it, it is turned up at once
+const std::chrono::milliseconds FADE_DURATION(500);
+
+// How the levels get to a light, picked from its profile at start
+struct sink_output {
+  sink_profile profile;
+  // set for a slow light, the writes do not block the event loop then
+  std::shared_ptr<sink_writer> writer;
+  bool fading = false;
+  uint64_t fadeFrom = 0;
+  uint64_t fadeTo = 0;
+  std::chrono::time_point<std::chrono::steady_clock> fadeStart;
+  std::chrono::nanoseconds fadeFrame{0};
+};
+
+/* A light which follows the activity timeline.
+ * It is on after input and steps through its stages while there is none.
+ */
+struct light_sink {
+  SINK_TYPE type;
+  std::string path;
+  std::vector<sink_stage> stages;
+  // level chosen by the user, restored on input
+  uint64_t onLevel;
+  uint64_t current;
+  // 0 while on, otherwise the number of stages that started
+  size_t stage;
+  // bl_power of a display, the panel is blanked instead of dimmed to 0
+  std::string powerPath;
+  // max_brightness, the power model spans level 0 to it
+  uint64_t maxLevel = 0;
+  std::vector<unsigned int> powerModel;
+  energy_ledger ledger;
+  sink_output output;
+};
+
+// Of the active session on seat0, from logind
+enum SESSION_STATE {
+  SESSION_UNLOCKED = 0,
+  SESSION_LOCKED = 1,
+  SESSION_STATE_COUNT = 2
+};
+
+const char *SESSION_STATE_NAMES[SESSION_STATE_COUNT] = {"unlocked", "locked"};
+
+/* Timeline of the keyboard light and what turns it on, one per session state.
+ * They are built at start, a change of the session switches between them.
+ */
+struct input_policy {
+  std::vector<sink_stage> keyboardStages;
+  // someone may type a password on a locked screen, a moved mouse does not need the keyboard light.
+  // Any input still restores the other lights.
+  bool keysOnly = false;
+  SCROLL_MODE scroll = SCROLL_WAKE;
+};
+
+struct host_source {
+  event_source source;
+  std::function<void()> handler;
+};
+
+// What turned the light on
+enum WAKE_TRIGGER {
+  WAKE_INPUT = 0,
+  WAKE_LID = 1,
+  WAKE_RESUME = 2,
+  WAKE_TOUCHPAD = 3,
+  WAKE_SCROLL = 4,
+  WAKE_TRIGGER_COUNT = 5
+};
+
+const char *WAKE_TRIGGER_NAMES[WAKE_TRIGGER_COUNT] = {"input", "lid", "resume", "touchpad", "scroll"};
+const char *SCROLL_MODE_NAMES[] = {"wake", "keep", "ignore"};
+
+// Scrolling moves the idle deadline right away, the rest of the activity path runs at most this often
+const std::chrono::seconds SCROLL_ACTIVITY_INTERVAL(1);
+
+struct scroll_stats {
+  // reads which only scrolled, a read holds all frames the device queued meanwhile
+  uint64_t batches;
+  // of them, the ones passed on as activity
+  uint64_t activities;
+};
+
+struct wake_stats {
+  // trigger until the brightness write returned
+  uint64_t count;
+  uint64_t totalUs;
+  uint64_t maxUs;
+  // early wake until the first key press, this is the hidden write latency
+  uint64_t leadCount;
+  uint64_t leadTotalUs;
+};
+
+/* Idle gaps between bursts of activity, one bucket per second.
+ * The gaps do not depend on the timeout that is used, so they tell what any
+ * other timeout would have done without storing a trace.
+ */
+class idle_histogram {
+ public:
+  static const unsigned long MAX_SECONDS = 600;
+
+  struct estimate {
+	unsigned long timeout;
+	// light turned off and on again
+	uint64_t toggles;
+	uint64_t ledOnMs;
+	// the user came back after the light was off
+	uint64_t wakes;
+  };
+
+  void add_activity(std::chrono::time_point<std::chrono::steady_clock> now) {
+	if (started_) {
+	  auto gapMs = static_cast<uint64_t>(std::chrono::duration_cast<
+		  std::chrono::milliseconds>(now - lastActivity_).count());
+	  if (gapMs < BURST_GAP_MS) {
+		activeMs_ += gapMs;
+	  } else {
+		auto bucket = std::min<uint64_t>(gapMs / 1000, MAX_SECONDS);
+		counts_[bucket]++;
+		sumsMs_[bucket] += gapMs;
+		gaps_++;
+	  }
+	}
+	started_ = true;
+	lastActivity_ = now;
+  }
+
+  uint64_t gaps() const { return gaps_; }
+  uint64_t active_ms() const { return activeMs_; }
+
+  // Estimates for every timeout from 1 to MAX_SECONDS in one pass over the buckets
+  std::vector<estimate> estimate_all() const {
+	std::vector<estimate> estimates;
+	estimates.reserve(MAX_SECONDS);
+
+	uint64_t longer = gaps_;
+	uint64_t shorterMs = 0;
+	for (unsigned long timeout = 1; timeout <= MAX_SECONDS; ++timeout) {
+	  // gaps in bucket `timeout - 1` are shorter than the timeout
+	  longer -= counts_[timeout - 1];
+	  shorterMs += sumsMs_[timeout - 1];
+	  estimates.push_back({timeout,
+						   2 * longer,
+						   activeMs_ + shorterMs + longer * timeout * 1000,
+						   longer});
+	}
+	return estimates;
+  }
+
+ private:
+  // activity closer together than this belongs to the same burst
+  static const uint64_t BURST_GAP_MS = 1000;
+
+  uint32_t counts_[MAX_SECONDS + 1] = {};
+  uint64_t sumsMs_[MAX_SECONDS + 1] = {};
+  uint64_t gaps_ = 0;
+  uint64_t activeMs_ = 0;
+  bool started_ = false;
+  std::chrono::time_point<std::chrono::steady_clock> lastActivity_;
+};
+
+// Resting position of a gamepad axis, it counts once it moved further than the threshold
+struct axis_rest {
+  int32_t value = 0;
+  int32_t halfRange = 0;
+  int32_t flat = 0;
+  int32_t threshold = 0;
+};
+
+// sticks, triggers, wheels and hats
+const unsigned int GAMEPAD_AXES = ABS_HAT3Y + 1;
+
+const char *DEVICE_CLASS_NAMES[CLASS_COUNT] = {"tablet", "gamepad", "trackpoint"};
+const char *CLASS_FILTER_NAMES[] = {"off", "all", "buttons", "proximity", "deadzone"};
+
+struct probe_result {
+  std::string path;
+  int fd;
+  bool evdev;
+  // Early wake devices announce that the user is about to type
+  bool lid;
+  bool touchpad;
+  bool wakeOnly;
+  // errno of a failed open
+  int error;
+  bool keyboard;
+  // created through uinput, e.g. by a key remapper
+  bool virtualDevice;
+  device_identity identity;
+  DEVICE_CLASS deviceClass = CLASS_NONE;
+  std::array<axis_rest, GAMEPAD_AXES> axes = {};
+};
+
+enum DEVICE_STATE {
+  DEVICE_PROBING = 0,
+  DEVICE_ACTIVE = 1,
+  // Virtual keyboard which repeats the physical ones, it is read but its keys do not count
+  DEVICE_MIRRORED = 2,
+  // Not accessible, waits until the node changes
+  DEVICE_ERRORED = 3,
+  // Failed or disconnected, retried after a delay or when the node changes
+  DEVICE_BACKING_OFF = 4,
+  DEVICE_REMOVED = 5,
+  // Faulty, masked and not in the loop until it is checked again
+  DEVICE_QUARANTINED = 6,
+  // Quarantined device which is read for a while to see if it recovered
+  DEVICE_CHECKING = 7,
+  DEVICE_STATE_COUNT = 8
+};
+
+const char *DEVICE_STATE_NAMES[DEVICE_STATE_COUNT] = {
+	"probing", "active", "mirrored", "errored", "backing off", "removed", "quarantined", "checking"};
+
+enum DEVICE_FAULT {
+  FAULT_NONE = 0,
+  // the same key repeats without a release
+  FAULT_STUCK_KEY = 1,
+  // a key bounces between press and release
+  FAULT_CHATTER = 2,
+  // an optical sensor reports single counts of motion on its own
+  FAULT_MICRO_MOTION = 3,
+  FAULT_FLOOD = 4,
+  FAULT_COUNT = 5
+};
+
+const char *DEVICE_FAULT_NAMES[FAULT_COUNT] = {
+	"none", "stuck key", "key chatter", "sensor noise", "event flood"};
+
+// How much of a pattern makes a device faulty
+struct fault_limits {
+  std::chrono::milliseconds stuckKeyAfter;
+  unsigned int chatterCount;
+  std::chrono::milliseconds microMotionAfter;
+  unsigned int floodSeconds;
+};
+
+const fault_limits FAULT_LIMITS = {120000ms, 20, 180000ms, 10};
+// While a quarantined device is checked, a stuck key is looked up with EVIOCGKEY
+const fault_limits PROBATION_LIMITS = {QUARANTINE_PROBATION, 3, QUARANTINE_PROBATION - 2000ms, 1};
+
+// Estimators of the patterns, fed with the event timestamps
+struct device_health {
+  DEVICE_FAULT fault = FAULT_NONE;
+  // key or axis which showed the fault
+  unsigned int faultCode = 0;
+
+  unsigned int heldKey = 0;
+  std::chrono::time_point<std::chrono::steady_clock> heldSince;
+
+  unsigned int releasedKey = 0;
+  std::chrono::time_point<std::chrono::steady_clock> releasedAt;
+  unsigned int chatterCount = 0;
+  std::chrono::time_point<std::chrono::steady_clock> chatterSince;
+
+  bool noisy = false;
+  std::chrono::time_point<std::chrono::steady_clock> noiseSince;
+  std::chrono::time_point<std::chrono::steady_clock> lastNoise;
+
+  std::chrono::time_point<std::chrono::steady_clock> frameSecond;
+  unsigned long frames = 0;
+  unsigned int floodSeconds = 0;
+};
+
+// What a suspended device lifecycle waits for, several can be combined
+enum DEVICE_WAIT : unsigned int {
+  WAIT_NONE = 0,
+  WAIT_READABLE = 1,
+  WAIT_TIMER = 2,
+  WAIT_HOTPLUG = 4,
+  WAIT_PROBE = 8
+};
+
+/* Coroutine which runs until its first suspension when it is created and
+ * is resumed by the event loop from then on. The frame is kept after it
+ * finished so the owner can see that it is done, it is freed with the task.
+ */
+class device_task {
+ public:
+  struct promise_type {
+	device_task get_return_object() {
+	  return device_task(std::coroutine_handle<promise_type>::from_promise(*this));
+	}
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_always final_suspend() noexcept { return {}; }
+	void return_void() {}
+	void unhandled_exception() { std::terminate(); }
+  };
+
+  device_task() = default;
+  explicit device_task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  device_task(device_task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  device_task &operator=(device_task &&other) noexcept {
+	if (this != &other) {
+	  destroy();
+	  handle_ = std::exchange(other.handle_, {});
+	}
+	return *this;
+  }
+  device_task(const device_task &) = delete;
+  device_task &operator=(const device_task &) = delete;
+  ~device_task() { destroy(); }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+ private:
+  void destroy() {
+	if (handle_) {
+	  handle_.destroy();
+	  handle_ = {};
+	}
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+struct input_device {
+  event_source source = {SOURCE_INPUT, -1};
+  std::string path;
+  // canonical path of the node, symlinks and the node itself are the same device
+  std::filesystem::path node;
+  // mousedev nodes like /dev/input/mice deliver ps/2 packets instead of input_event
+  bool evdev = false;
+  // of the last ps/2 packet
+  uint8_t ps2Buttons = 0;
+  // BTN_TOOL_DOUBLETAP of a touchpad, its motion is scrolling then
+  bool twoFingers = false;
+  int ignoreNextValues = 0;
+  // Only used for early wake (lid switch, touchpad proximity), other events are ignored
+  bool wakeOnly = false;
+  bool keyboard = false;
+  bool virtualDevice = false;
+  // matched an include rule, used as it is even if it is a virtual keyboard
+  bool included = false;
+  // CLASS_NONE unless a filter of its class is enabled
+  DEVICE_CLASS deviceClass = CLASS_NONE;
+  CLASS_FILTER classFilter = CLASS_FILTER_OFF;
+  std::array<axis_rest, GAMEPAD_AXES> axes = {};
+  device_identity identity;
+  device_health health;
+  // fault of the last quarantine
+  DEVICE_FAULT fault = FAULT_NONE;
+  unsigned int faultCode = 0;
+  unsigned int quarantines = 0;
+  // N of the eventN node, -1 for other nodes, names the device in the flight recorder
+  int nodeNumber = -1;
+
+  DEVICE_STATE state = DEVICE_PROBING;
+  device_task task;
+  // set while the lifecycle is suspended
+  std::coroutine_handle<> waiter;
+  unsigned int waitFor = WAIT_NONE;
+  std::chrono::time_point<std::chrono::steady_clock> wakeAt;
+  DEVICE_WAIT resumeReason = WAIT_NONE;
+  probe_result probe = {};
+  // open fd of the previous instance, the first probe uses it instead of opening the node
+  int parkedFd = -1;
+};
+
+int epollFd_ = -1;
+event_source timer_ = {SOURCE_TIMER, -1};
+event_source dbusSource_ = {SOURCE_DBUS, -1};
+event_source auditTimer_ = {SOURCE_AUDIT, -1};
+event_source probeSource_ = {SOURCE_PROBE, -1};
+event_source probeTimer_ = {SOURCE_PROBE_TIMER, -1};
+event_source deviceTimer_ = {SOURCE_DEVICE_TIMER, -1};
+event_source hotplug_ = {SOURCE_HOTPLUG, -1};
+event_source hubSource_ = {SOURCE_HUB, -1};
+event_source hubTimer_ = {SOURCE_HUB_TIMER, -1};
+event_source fadeTimer_ = {SOURCE_FADE_TIMER, -1};
+activity_hub hub_;
+bool hubTimerArmed_ = false;
+dbus_connection dbus_;
+bool dbusWantsWrite_ = false;
+// unique name of UPower, empty while it is not running
+std::string upowerOwner_;
+// levels we asked UPower to set, their BrightnessChanged is no change of the user
+std::vector<int32_t> upowerEchoes_;
+// object path of the active session, empty while logind is not followed or nobody is logged in
+std::string activeSession_;
+SESSION_STATE sessionState_ = SESSION_UNLOCKED;
+std::array<input_policy, SESSION_STATE_COUNT> policies_;
+std::list<host_source> hostSources_;
+options opts_;
+// The keyboard is always the first one
+std::vector<light_sink> sinks_;
+bool timerArmed_ = false;
+
+audit_counters auditCounters_;
+process_sample auditStart_;
+std::string lastAudit_;
+wake_stats wakeStats_[WAKE_TRIGGER_COUNT];
+idle_histogram idleHistogram_;
+// Set while the light is on because of an early wake and no key was pressed yet
+WAKE_TRIGGER earlyWakeTrigger_ = WAKE_INPUT;
+std::chrono::time_point<std::chrono::steady_clock> earlyWakeTime_;
+// Last scroll, the stage timer moves lastEvent_ to it when it expires
+std::chrono::time_point<std::chrono::steady_clock> lastScroll_;
+std::chrono::time_point<std::chrono::steady_clock> lastScrollActivity_;
+scroll_stats scrollStats_;
+
+std::list<input_device> devices_;
+// A lifecycle finished and has to be removed from devices_
+bool devicesFinished_ = false;
+// The earliest device deadline changed
+bool deviceTimerChanged_ = false;
+// Nodes which are no input device we use, skipped until they are recreated
+std::set<std::filesystem::path> rejectedNodes_;
+// Last key event of a physical keyboard, virtual keyboards are compared against it
+std::chrono::time_point<std::chrono::steady_clock> lastPhysicalKey_;
+
+bool file_read_uint64(const std::string &filename, uint64_t *val) {
+  FILE *fp;
+  uint64_t data;
+
+  fp = fopen(filename.c_str(), "r");
+  if (!fp) {
+	return false;
+  }
+
+  if (fscanf(fp, "%lu", &data) != 1) {
+	fclose(fp);
+	return false;
+  }
+
+  *val = data;
+
+  fclose(fp);
+  return true;
+}
+
+bool file_write_uint64(const std::string &filename, uint64_t val) {
+  FILE *fp;
+
+  fp = fopen(filename.c_str(), "w");
+  if (!fp) {
+	return false;
+  }
+
+  if (fprintf(fp, "%lu", val) < 0) {
+	fclose(fp);
+	return false;
+  }
+
+  fclose(fp);
+  return true;
+}
+
+bool is_device_ignored(const std::string &device,
+					   const std::vector<std::string> &ignoredDevices) {
+  for (const auto &ignoredDev : ignoredDevices) {
+	if (device.find(ignoredDev) != std::string::npos) {
+	  return true;
+	}
+  }
+  return false;
+}
+
+const device_rule *find_device_rule(const std::vector<device_rule> &rules,
+									const device_identity &identity) {
+  for (const auto &rule : rules) {
+	if (device_rule_matches(rule, identity)) {
+	  return &rule;
+	}
+  }
+  return nullptr;
+}
+
+/* Get keyboards from /proc/bus/input/devices
+ * Example entry
+	I: Bus=0011 Vendor=0001 Product=0001 Version=ab54
+	N: Name="AT Translated Set 2 keyboard"
+	P: Phys=isa0060/serio0/input0
+	S: Sysfs=/devices/platform/i8042/serio0/input/input3
+	U: Uniq=
+	H: Handlers=sysrq kbd event3 leds
+	B: PROP=0
+	B: EV=120013
+	B: KEY=402000000 3803078f800d001 feffffdfffefffff fffffffffffffffe
+ */
+void get_keyboards(const std::vector<std::string> &ignoredDevices,
+				   std::vector<std::string> &keyboards) {
+  const std::string path = "/proc/bus/input/devices";
+  std::ifstream file(path);
+  if (!file.is_open()) {
+	print_debug("Failed to open %s...\n", path.c_str());
+	return;
+  }
+
+  bool isKeyboard = false;
+  std::string line;
+  std::string token;
+  std::istringstream ss;
+  while (std::getline(file, line)) {
+	auto lineLower = line;
+	std::transform(lineLower.begin(), lineLower.end(), lineLower.begin(), tolower);
+	// get device name
+	if (lineLower.find("name=") != std::string::npos) {
+	  isKeyboard = lineLower.find("keyboard") != std::string::npos;
+	  if (isKeyboard) {
+		print_debug("Detected keyboard: %s\n", lineLower.c_str());
+	  } else {
+		print_debug("Ignoring non keyboard device: %s\n", lineLower.c_str());
+	  }
+	}
+
+	if (lineLower.find("handlers=") != std::string::npos) {
+	  if (!isKeyboard) {
+		continue;
+	  }
+
+	  ss = std::istringstream(line);
+	  while (std::getline(ss, token, ' ')) {
+		if (token.find("event") != std::string::npos) {
+		  std::string deviceEventPath = "/dev/input/" + token;
+		  if (!is_device_ignored(deviceEventPath, ignoredDevices)) {
+			print_debug_n("Added keyboard\n");
+			keyboards.emplace_back(deviceEventPath);
+		  } else {
+			print_debug_n("Keyboard is ignored\n");
+		  }
+		  break;
+		}
+	  }
+	}
+  }
+}
+
+void get_devices_in_path(const std::vector<std::string> &ignoredDevices,
+						 const std::string &devicePath,
+						 const std::regex &regex,
+						 std::vector<std::string> &devices) {
+  for (const auto &dev : std::filesystem::directory_iterator(devicePath)) {
+	if (is_device_ignored(dev.path(), ignoredDevices)) {
+	  continue;
+	}
+
+	if (regex_match(std::string(dev.path()), regex)) {
+	  devices.push_back(dev.path());
+	}
+  }
+}
+
+bool device_has_code(int fd, unsigned int type, unsigned int code) {
+  const size_t bitsPerLong = sizeof(unsigned long) * 8;
+  unsigned long bits[KEY_MAX / bitsPerLong + 1] = {};
+  if (ioctl(fd, EVIOCGBIT(type, sizeof(bits)), bits) < 0) {
+	return false;
+  }
+  return (bits[code / bitsPerLong] >> (code % bitsPerLong)) & 1ul;
+}
+
+void set_device_state(input_device &dev, DEVICE_STATE state) {
+  dev.state = state;
+  recorder_.record(FLIGHT_DEVICE, dev.nodeNumber, state);
+}
+
+bool device_has_property(int fd, unsigned int prop) {
+  const size_t bitsPerLong = sizeof(unsigned long) * 8;
+  unsigned long bits[INPUT_PROP_MAX / bitsPerLong + 1] = {};
+  if (ioctl(fd, EVIOCGPROP(sizeof(bits)), bits) < 0) {
+	return false;
+  }
+  return (bits[prop / bitsPerLong] >> (prop % bitsPerLong)) & 1ul;
+}
+
+// All evdev nodes, the lid switch and touchpads are picked by the probe
+void get_event_devices(const std::vector<std::string> &ignoredDevices,
+					   std::vector<std::string> &devices) {
+  const std::string devicePath = "/dev/input/";
+  if (!std::filesystem::is_directory(devicePath)) {
+	return;
+  }
+
+  for (const auto &dev : std::filesystem::directory_iterator(devicePath)) {
+	std::string path = dev.path();
+	if (path.find("event") != std::string::npos
+		&& !is_device_ignored(path, ignoredDevices)) {
+	  devices.push_back(path);
+	}
+  }
+}
+
+// Remappers create their keyboard through uinput, most of them with a fake bus
+bool device_is_virtual(const device_identity &identity, const std::string &path) {
+  if (identity.bus == BUS_VIRTUAL) {
+	return true;
+  }
+
+  std::error_code ec;
+  auto node = std::filesystem::canonical(path, ec);
+  if (ec) {
+	return false;
+  }
+  auto sysfs = std::filesystem::canonical(
+	  std::filesystem::path("/sys/class/input") / node.filename() / "device", ec);
+  return !ec && sysfs.string().find("/devices/virtual/") != std::string::npos;
+}
+
+/* Keyboards are no class device, even if they have joystick buttons.
+ * The tablet pen is checked first, some tablets announce BTN_JOYSTICK for their pad.
+ */
+DEVICE_CLASS classify_device(int fd) {
+  if (device_has_code(fd, EV_KEY, BTN_TOOL_PEN)) {
+	return CLASS_TABLET;
+  }
+  if (device_has_code(fd, EV_KEY, BTN_GAMEPAD) || device_has_code(fd, EV_KEY, BTN_JOYSTICK)) {
+	return CLASS_GAMEPAD;
+  }
+  if (device_has_property(fd, INPUT_PROP_POINTING_STICK)) {
+	return CLASS_TRACKPOINT;
+  }
+  return CLASS_NONE;
+}
+
+void read_axes(int fd, std::array<axis_rest, GAMEPAD_AXES> &axes) {
+  for (unsigned int code = 0; code < GAMEPAD_AXES; ++code) {
+	input_absinfo info = {};
+	if (!device_has_code(fd, EV_ABS, code) || ioctl(fd, EVIOCGABS(code), &info) < 0) {
+	  continue;
+	}
+	axes[code].value = info.value;
+	axes[code].halfRange = (info.maximum - info.minimum) / 2;
+	axes[code].flat = info.flat;
+  }
+}
+
+int open_device(const std::string &path) {
+  int fd;
+
+  if ((fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+	int error = errno;
+	perror("tp_kbd_backlight: open");
+	errno = error;
+	return -1;
+  }
+
+  return fd;
+}
+
+// Returns the number of keyboards found
+size_t discover_devices(const options &opts,
+						std::vector<std::string> &inputDevices,
+						std::vector<std::string> &wakeDevices) {
+  print_debug_n("Getting keyboards...\n");
+  get_keyboards(opts.ignoredDevices, inputDevices);
+  size_t keyboards = inputDevices.size();
+
+  switch (opts.mouseMode) {
+	case ALL:
+	  get_devices_in_path(opts.ignoredDevices,
+						  "/dev/input/",
+						  std::regex(".*mice.*"),
+						  inputDevices);
+	  break;
+	case INTERNAL:
+	  get_devices_in_path(opts.ignoredDevices,
+						  "/dev/input/by-path",
+						  std::regex("..*event\\-mouse.*"),
+						  inputDevices);
+	  break;
+	case NONE:
+	  break;
+  }
+
+  // include rules and classes can match any event device, the probe sorts them out
+  bool classes = std::any_of(opts.classFilters.begin(), opts.classFilters.end(),
+							 [](CLASS_FILTER filter) { return filter != CLASS_FILTER_OFF; });
+  if (opts.earlyWake || !opts.includeRules.empty() || classes) {
+	get_event_devices(opts.ignoredDevices, wakeDevices);
+  }
+  return keyboards;
+}
+
+/* Opens devices and queries their capabilities on short lived threads.
+ * A device which blocks in open() or an ioctl, e.g. a half connected
+ * bluetooth keyboard, only delays itself. Finished probes are collected
+ * by the event loop, which is woken up through an eventfd.
+ */
+class device_prober {
+ public:
+  bool start() {
+	shared_ = std::make_shared<shared_state>();
+	shared_->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return shared_->eventFd >= 0;
+  }
+
+  int fd() const { return shared_->eventFd; }
+
+  // fd is an open fd of the device or -1 to open the path
+  void probe(const std::string &path, bool wakeOnly, int fd) {
+	pending_[path] = std::chrono::steady_clock::now() + PROBE_TIMEOUT;
+	std::thread([shared = shared_, path, wakeOnly, fd]() {
+	  probe_result result = probe_device(path, wakeOnly, fd);
+	  std::lock_guard<std::mutex> lock(shared->mutex);
+	  shared->done.push_back(result);
+	  uint64_t one = 1;
+	  if (write(shared->eventFd, &one, sizeof(one)) < 0) {
+		perror("tp_kbd_backlight: eventfd");
+	  }
+	}).detach();
+  }
+
+  std::vector<probe_result> take_results() {
+	uint64_t count;
+	if (read(shared_->eventFd, &count, sizeof(count)) < 0) {
+	  return {};
+	}
+
+	std::vector<probe_result> results;
+	{
+	  std::lock_guard<std::mutex> lock(shared_->mutex);
+	  results.swap(shared_->done);
+	}
+	for (const auto &result : results) {
+	  pending_.erase(result.path);
+	}
+	return results;
+  }
+
+  // Probes which are past their deadline, each one is only returned once
+  std::vector<std::string> take_overdue() {
+	std::vector<std::string> overdue;
+	auto now = std::chrono::steady_clock::now();
+	for (auto &pending : pending_) {
+	  if (pending.second <= now) {
+		overdue.push_back(pending.first);
+		pending.second = std::chrono::time_point<std::chrono::steady_clock>::max();
+	  }
+	}
+	return overdue;
+  }
+
+  // Deadline of the probe which is due next, max if none is
+  std::chrono::time_point<std::chrono::steady_clock> next_deadline() const {
+	auto deadline = std::chrono::time_point<std::chrono::steady_clock>::max();
+	for (const auto &pending : pending_) {
+	  deadline = std::min(deadline, pending.second);
+	}
+	return deadline;
+  }
+
+ private:
+  struct shared_state {
+	std::mutex mutex;
+	std::vector<probe_result> done;
+	int eventFd = -1;
+	~shared_state() {
+	  // the last running probe closes it, not the event loop
+	  if (eventFd >= 0) {
+		close(eventFd);
+	  }
+	  for (const auto &result : done) {
+		close(result.fd);
+	  }
+	}
+  };
+
+  static device_identity read_identity(int fd) {
+	device_identity identity;
+	input_id id = {};
+	if (ioctl(fd, EVIOCGID, &id) == 0) {
+	  identity.bus = id.bustype;
+	  identity.vendor = id.vendor;
+	  identity.product = id.product;
+	}
+
+	char buf[256] = {};
+	if (ioctl(fd, EVIOCGNAME(sizeof(buf) - 1), buf) >= 0) {
+	  identity.name = buf;
+	}
+	memset(buf, 0, sizeof(buf));
+	if (ioctl(fd, EVIOCGPHYS(sizeof(buf) - 1), buf) >= 0) {
+	  identity.phys = buf;
+	}
+	memset(buf, 0, sizeof(buf));
+	if (ioctl(fd, EVIOCGUNIQ(sizeof(buf) - 1), buf) >= 0) {
+	  identity.uniq = buf;
+	}
+	return identity;
+  }
+
+  static probe_result probe_device(const std::string &path, bool wakeOnly, int fd) {
+	trace_span span(TRACE_PROBE);
+	probe_result result = {path, fd >= 0 ? fd : open_device(path), false, false, false, wakeOnly, 0, false, false, {}};
+	if (result.fd < 0) {
+	  result.error = errno;
+	  return result;
+	}
+
+	int version;
+	result.evdev = ioctl(result.fd, EVIOCGVERSION, &version) == 0;
+	if (result.evdev) {
+	  // Event timestamps are used to measure the wake latency
+	  int clock = CLOCK_MONOTONIC;
+	  ioctl(result.fd, EVIOCSCLOCKID, &clock);
+	  result.lid = device_has_code(result.fd, EV_SW, SW_LID);
+	  result.touchpad = device_has_code(result.fd, EV_KEY, BTN_TOOL_FINGER)
+		  && !device_has_code(result.fd, EV_KEY, BTN_TOOL_PEN)
+		  && device_has_property(result.fd, INPUT_PROP_POINTER);
+	  result.keyboard = device_has_code(result.fd, EV_KEY, KEY_A);
+	  if (!result.keyboard) {
+		result.deviceClass = classify_device(result.fd);
+	  }
+	  if (result.deviceClass == CLASS_GAMEPAD) {
+		read_axes(result.fd, result.axes);
+	  }
+	  result.identity = read_identity(result.fd);
+	  result.virtualDevice = device_is_virtual(result.identity, path);
+	}
+	return result;
+  }
+
+  std::shared_ptr<shared_state> shared_;
+  std::map<std::string, std::chrono::time_point<std::chrono::steady_clock>> pending_;
+};
+
+device_prober prober_;
+
+bool loop_add(event_source *source, uint32_t events) {
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.ptr = source;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, source->fd, &ev) < 0) {
+	perror("tp_kbd_backlight: epoll_ctl");
+	return false;
+  }
+  return true;
+}
+
+void loop_modify(event_source *source, uint32_t events) {
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.ptr = source;
+  epoll_ctl(epollFd_, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+void loop_remove(event_source *source) {
+  epoll_ctl(epollFd_, EPOLL_CTL_DEL, source->fd, nullptr);
+}
+
+/* Arms the timer for an absolute deadline.
+ * The deadline is rounded up to the next multiple of the tolerance, so the
+ * timeout is never shorter than configured. Aligned deadlines of all timers
+ * using the same grid (e.g. round_jiffies() on full seconds) expire together
+ * and the CPU is woken up once instead of several times.
+ */
+void arm_timer(const event_source &timer,
+			   std::chrono::time_point<std::chrono::steady_clock> deadline,
+			   std::chrono::milliseconds tolerance) {
+  trace_span span(TRACE_TIMER_ARM);
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+  if (tolerance.count() > 0) {
+	auto step = std::chrono::duration_cast<std::chrono::nanoseconds>(tolerance);
+	ns = ((ns + step - 1ns) / step) * step;
+  }
+
+  itimerspec spec = {};
+  spec.it_value.tv_sec = ns.count() / 1000000000;
+  spec.it_value.tv_nsec = ns.count() % 1000000000;
+  // a zero value would disarm the timer
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+	spec.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+  span.set_arg(ns.count() / 1000000);
+}
+
+// Every probe has its own deadline, the timer runs for the earliest one
+void arm_probe_timer() {
+  auto deadline = prober_.next_deadline();
+  if (deadline != std::chrono::time_point<std::chrono::steady_clock>::max()) {
+	arm_timer(probeTimer_, deadline, 0ms);
+	return;
+  }
+  itimerspec disarm = {};
+  timerfd_settime(probeTimer_.fd, 0, &disarm, nullptr);
+}
+
+uint64_t get_max_brightness(const light_sink &sink) {
+  uint64_t maxBrightness;
+  auto maxPath = std::filesystem::path(sink.path).parent_path() / "max_brightness";
+  if (!file_read_uint64(maxPath, &maxBrightness)) {
+	return std::max(sink.onLevel, sink.current);
+  }
+  return maxBrightness;
+}
+
+void dbus_brightness_changed(uint64_t brightness) {
+  if (dbus_.fd() < 0) {
+	return;
+  }
+
+  auto changed = dbus_signal(UPOWER_KBD_PATH, UPOWER_KBD_INTERFACE, "BrightnessChanged");
+  dbus_writer(changed).add_int32(static_cast<int32_t>(brightness));
+  dbus_.send(changed);
+
+  auto withSource = dbus_signal(UPOWER_KBD_PATH,
+								UPOWER_KBD_INTERFACE,
+								"BrightnessChangedWithSource");
+  dbus_writer w(withSource);
+  w.add_int32(static_cast<int32_t>(brightness));
+  w.add_string("internal");
+  dbus_.send(withSource);
+}
+
+/* The light is written directly, the wake does not wait for the bus.
+ * UPower writes the same level once more and tells the desktops about it,
+ * otherwise their sliders would show a stale level.
+ */
+void upower_set_brightness(uint64_t brightness) {
+  if (dbus_.fd() < 0 || upowerOwner_.empty()) {
+	return;
+  }
+
+  auto call = dbus_method_call(UPOWER_BUS_NAME, UPOWER_KBD_PATH, UPOWER_KBD_INTERFACE, "SetBrightness");
+  dbus_writer(call).add_int32(static_cast<int32_t>(brightness));
+  upowerEchoes_.push_back(static_cast<int32_t>(brightness));
+  dbus_.call(call, [brightness](const dbus_message &reply) {
+	// UPower signals the change before it returns, a later signal is not ours
+	auto echo = std::find(upowerEchoes_.begin(), upowerEchoes_.end(), static_cast<int32_t>(brightness));
+	if (echo != upowerEchoes_.end()) {
+	  upowerEchoes_.erase(echo);
+	}
+	if (reply.type == DBUS_ERROR) {
+	  printf("UPower did not set the brightness: %s\n", reply.errorName.c_str());
+	}
+  });
+}
+
+// The points of the model are spread evenly from level 0 to the maximum
+double sink_power_mw(const light_sink &sink, uint64_t level) {
+  const auto &model = sink.powerModel;
+  if (model.empty()) {
+	return 0;
+  }
+  if (model.size() == 1 || sink.maxLevel == 0) {
+	return model.back();
+  }
+  double pos = static_cast<double>(std::min(level, sink.maxLevel)) * (model.size() - 1) / sink.maxLevel;
+  auto i = static_cast<size_t>(pos);
+  if (i + 1 >= model.size()) {
+	return model.back();
+  }
+  return model[i] + (static_cast<double>(model[i + 1]) - model[i]) * (pos - i);
+}
+
+bool is_blanked(const light_sink &sink);
+
+// Books the time since the last change at the level the light had, called before every change
+void account_energy(light_sink &sink, std::chrono::time_point<std::chrono::steady_clock> now) {
+  auto &ledger = sink.ledger;
+  auto spent = std::chrono::duration_cast<std::chrono::microseconds>(now - ledger.since);
+  if (spent.count() <= 0) {
+	return;
+  }
+  uint64_t level = is_blanked(sink) ? 0 : sink.current;
+  ledger.levelTime[level] += spent;
+  // mW * us = nJ
+  ledger.usedMj += sink_power_mw(sink, level) * spent.count() / 1e6;
+  ledger.alwaysOnMj += sink_power_mw(sink, sink.onLevel) * spent.count() / 1e6;
+  ledger.since = now;
+}
+
+void account_energy(light_sink &sink) {
+  account_energy(sink, std::chrono::steady_clock::now());
+}
+
+// The writer of a slow light counts its own writes
+uint64_t sink_writes(const light_sink &sink) {
+  return sink.ledger.writes + (sink.output.writer ? sink.output.writer->writes() : 0);
+}
+
+void set_brightness(light_sink &sink, uint64_t brightness) {
+  account_energy(sink);
+  if (sink.output.writer) {
+	sink.output.writer->write(brightness);
+  } else {
+	bool written;
+	{
+	  trace_span span(TRACE_SINK_WRITE, static_cast<int64_t>(brightness));
+	  written = write_level(sink.path, brightness, sink.output.profile.verify);
+	}
+	recorder_.record(written ? FLIGHT_SINK_WRITE : FLIGHT_SINK_FAILED, sink.type, static_cast<int64_t>(brightness));
+	sink.ledger.writes += written;
+  }
+  auditCounters_.events[AUDIT_SINK]++;
+  sink.current = brightness;
+  if (sink.type == SINK_KEYBOARD) {
+	dbus_brightness_changed(brightness);
+	upower_set_brightness(brightness);
+  }
+}
+
+bool is_blanked(const light_sink &sink) {
+  return sink.stage > 0 && sink.stages[sink.stage - 1].percent == 0 && !sink.powerPath.empty();
+}
+
+// Ticks at the frame rate of the fastest running fade, disarmed without one
+void arm_fade_timer() {
+  std::chrono::nanoseconds frame{0};
+  for (const auto &sink : sinks_) {
+	if (sink.output.fading && (frame.count() == 0 || sink.output.fadeFrame < frame)) {
+	  frame = sink.output.fadeFrame;
+	}
+  }
+
+  itimerspec spec = {};
+  spec.it_interval.tv_sec = frame.count() / 1000000000;
+  spec.it_interval.tv_nsec = frame.count() % 1000000000;
+  spec.it_value = spec.it_interval;
+  timerfd_settime(fadeTimer_.fd, 0, &spec, nullptr);
+}
+
+void start_fade(light_sink &sink, uint64_t level) {
+  auto &output = sink.output;
+  output.fading = true;
+  output.fadeFrom = sink.current;
+  output.fadeTo = level;
+  output.fadeStart = std::chrono::steady_clock::now();
+  // no more frames than levels the light shows on the way down
+  uint64_t steps = std::max<uint64_t>(output.profile.levels, 2) - 1;
+  steps = std::max<uint64_t>((output.fadeFrom - level) * steps / std::max<uint64_t>(sink.maxLevel, 1), 1);
+  output.fadeFrame = std::max<std::chrono::nanoseconds>(std::chrono::seconds(1) / output.profile.fadeFps,
+														 FADE_DURATION / steps);
+  arm_fade_timer();
+}
+
+void on_fade_timer() {
+  uint64_t expirations;
+  if (read(fadeTimer_.fd, &expirations, sizeof(expirations)) < 0) {
+	return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  bool fading = false, finished = false;
+  for (auto &sink : sinks_) {
+	auto &output = sink.output;
+	if (!output.fading) {
+	  continue;
+	}
+	fading = true;
+	uint64_t level = output.fadeTo;
+	auto elapsed = now - output.fadeStart;
+	if (elapsed < FADE_DURATION) {
+	  double left = std::chrono::duration<double>(FADE_DURATION - elapsed) / FADE_DURATION;
+	  level += static_cast<uint64_t>(static_cast<double>(output.fadeFrom - output.fadeTo) * left);
+	} else {
+	  output.fading = false;
+	  finished = true;
+	}
+	if (level != sink.current) {
+	  set_brightness(sink, level);
+	}
+  }
+  // the restore of a light cancels its fade without touching the timer
+  if (finished || !fading) {
+	arm_fade_timer();
+  }
+}
+
+void enter_stage(light_sink &sink, size_t stage) {
+  account_energy(sink);
+  // a later stage takes over from a running fade
+  sink.output.fading = false;
+  if (sink.stage == 0) {
+	// The level may have been changed by hand, e.g. with Fn+Space.
+	// A queued write is not in the file yet, the level it writes is the current one.
+	uint64_t level = sink.current;
+	if (!sink.output.writer || !sink.output.writer->busy()) {
+	  file_read_uint64(sink.path, &level);
+	}
+	sink.onLevel = level;
+	sink.current = level;
+  }
+
+  bool wasBlanked = is_blanked(sink);
+  sink.stage = stage;
+  recorder_.record(FLIGHT_STAGE, sink.type, static_cast<int64_t>(stage));
+  const auto &next = sink.stages[stage - 1];
+  print_debug("Turning %s to %u%% of %lu\n", SINK_TYPE_NAMES[sink.type], next.percent, sink.onLevel);
+  if (is_blanked(sink)) {
+	if (!wasBlanked) {
+	  // FB_BLANK_POWERDOWN, the brightness is kept for the wake up
+	  sink.ledger.writes += file_write_uint64(sink.powerPath, 4);
+	  recorder_.record(FLIGHT_SINK_POWER, sink.type, 4);
+	  auditCounters_.events[AUDIT_SINK]++;
+	}
+	return;
+  }
+
+  uint64_t level = sink.onLevel * next.percent / 100;
+  if (next.percent > 0 && sink.onLevel > 0) {
+	level = std::max<uint64_t>(level, 1);
+  }
+  if (level < sink.current && sink.output.profile.fadeFps > 0) {
+	start_fade(sink, level);
+  } else if (level != sink.current) {
+	set_brightness(sink, level);
+  }
+}
+
+// Returns true if something was written
+bool restore_sink(light_sink &sink) {
+  account_energy(sink);
+  sink.output.fading = false;
+  bool blanked = is_blanked(sink);
+  bool changed = sink.current != sink.onLevel;
+  sink.stage = 0;
+  if (changed) {
+	set_brightness(sink, sink.onLevel);
+  }
+  if (blanked) {
+	// FB_BLANK_UNBLANK
+	sink.ledger.writes += file_write_uint64(sink.powerPath, 0);
+	recorder_.record(FLIGHT_SINK_POWER, sink.type, 0);
+	auditCounters_.events[AUDIT_SINK]++;
+  }
+  return changed || blanked;
+}
+
+// While only keys turn the keyboard light on, the other input restores the other lights
+bool input_restores(const light_sink &sink, bool keyPressed) {
+  return keyPressed || sink.type != SINK_KEYBOARD || !policies_[sessionState_].keysOnly;
+}
+
+// Start of the idle time of the sink
+std::chrono::time_point<std::chrono::steady_clock> last_input(const light_sink &sink) {
+  return input_restores(sink, false) ? lastEvent_ : lastKey_;
+}
+
+// Wakes up for the next stage of any sink, not at all once everything is off
+void arm_stage_timer() {
+  auto next = std::chrono::time_point<std::chrono::steady_clock>::max();
+  for (const auto &sink : sinks_) {
+	if (sink.stage < sink.stages.size()) {
+	  next = std::min(next, last_input(sink) + sink.stages[sink.stage].after);
+	}
+  }
+
+  timerArmed_ = next != std::chrono::time_point<std::chrono::steady_clock>::max();
+  if (timerArmed_) {
+	arm_timer(timer_, next, opts_.tolerance);
+  }
+  recorder_.record(FLIGHT_TIMER_ARM, timerArmed_, timerArmed_
+	  ? std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count()
+	  : 0);
+}
+
+void brightness_control() {
+  trace_span span(TRACE_TIMEOUT);
+  uint64_t expirations;
+  if (read(timer_.fd, &expirations, sizeof(expirations)) < 0) {
+	return;
+  }
+
+  lastEvent_ = std::max(lastEvent_, lastScroll_);
+  auto now = std::chrono::steady_clock::now();
+  auto idle = now - lastEvent_;
+  recorder_.record(FLIGHT_TIMEOUT, 0, std::chrono::duration_cast<std::chrono::milliseconds>(idle).count());
+  print_debug("Ms since last event: %ld\n",
+			  static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(idle).count()));
+  for (auto &sink : sinks_) {
+	idle = now - last_input(sink);
+	size_t stage = sink.stage;
+	while (stage < sink.stages.size() && idle >= sink.stages[stage].after) {
+	  stage++;
+	}
+	if (stage > sink.stage) {
+	  enter_stage(sink, stage);
+	}
+  }
+  arm_stage_timer();
+}
+
+std::chrono::time_point<std::chrono::steady_clock> event_time(const input_event &ie) {
+  // devices are switched to CLOCK_MONOTONIC which is what steady_clock uses
+  return std::chrono::time_point<std::chrono::steady_clock>(
+	  std::chrono::seconds(ie.time.tv_sec) + std::chrono::microseconds(ie.time.tv_usec));
+}
+
+/* Feeds one event to the fault estimators.
+ * Returns true once the device shows one of the faults.
+ */
+bool check_health(device_health &health, const input_event &ie, const fault_limits &limits) {
+  auto now = event_time(ie);
+  if (ie.type == EV_KEY) {
+	health.noisy = false;
+	if (ie.value == 1) {
+	  if (ie.code == health.releasedKey && now - health.releasedAt < CHATTER_GAP) {
+		if (health.chatterCount == 0 || now - health.chatterSince > CHATTER_WINDOW) {
+		  health.chatterCount = 0;
+		  health.chatterSince = now;
+		}
+		if (++health.chatterCount >= limits.chatterCount) {
+		  health.fault = FAULT_CHATTER;
+		  health.faultCode = ie.code;
+		}
+	  }
+	  health.heldKey = ie.code;
+	  health.heldSince = now;
+	} else if (ie.value == 0) {
+	  health.releasedKey = ie.code;
+	  health.releasedAt = now;
+	  if (ie.code == health.heldKey) {
+		health.heldKey = 0;
+	  }
+	} else if (ie.code == health.heldKey && now - health.heldSince >= limits.stuckKeyAfter) {
+	  health.fault = FAULT_STUCK_KEY;
+	  health.faultCode = ie.code;
+	}
+  } else if (ie.type == EV_REL && (ie.code == REL_X || ie.code == REL_Y)) {
+	if (ie.value > 1 || ie.value < -1) {
+	  health.noisy = false;
+	} else {
+	  // a pause of a second ends a run of noise
+	  if (!health.noisy || now - health.lastNoise > 1s) {
+		health.noisy = true;
+		health.noiseSince = now;
+	  }
+	  health.lastNoise = now;
+	  if (now - health.noiseSince >= limits.microMotionAfter) {
+		health.fault = FAULT_MICRO_MOTION;
+		health.faultCode = ie.code;
+	  }
+	}
+  } else if (ie.type == EV_SYN && ie.code == SYN_REPORT) {
+	if (now - health.frameSecond >= 1s) {
+	  bool consecutive = now - health.frameSecond < 2s;
+	  health.floodSeconds = consecutive && health.frames > FLOOD_FRAMES_PER_SECOND
+		  ? health.floodSeconds + 1 : 0;
+	  health.frameSecond = now;
+	  health.frames = 0;
+	  if (health.floodSeconds >= limits.floodSeconds) {
+		health.fault = FAULT_FLOOD;
+	  }
+	}
+	health.frames++;
+  }
+  return health.fault != FAULT_NONE;
+}
+
+// The timer only has to run while a client of the hub waits to become idle
+void update_hub_timer(std::chrono::time_point<std::chrono::steady_clock> now) {
+  auto deadline = hub_.expire(now);
+  hubTimerArmed_ = deadline != std::chrono::time_point<std::chrono::steady_clock>::max();
+  if (hubTimerArmed_) {
+	arm_timer(hubTimer_, deadline, opts_.tolerance);
+  }
+}
+
+// Input without a decision about the lights, the timeline and the hub clients see it
+void note_activity() {
+  lastEvent_ = std::chrono::steady_clock::now();
+  idleHistogram_.add_activity(lastEvent_);
+  if (hub_.is_open() && hub_.activity(lastEvent_) && !hubTimerArmed_) {
+	update_hub_timer(lastEvent_);
+  }
+}
+
+// keyPressed is false for input which only counts as a key press while the session is unlocked
+void on_activity(WAKE_TRIGGER trigger,
+				 std::chrono::time_point<std::chrono::steady_clock> eventTime,
+				 bool keyPressed = true) {
+  trace_span span(TRACE_DECISION, trigger);
+  note_activity();
+  if (keyPressed) {
+	lastKey_ = lastEvent_;
+  }
+
+  bool restored = false;
+  for (auto &sink : sinks_) {
+	if (input_restores(sink, keyPressed)) {
+	  restored |= restore_sink(sink);
+	}
+  }
+  recorder_.record(FLIGHT_ACTIVITY, trigger, restored);
+  if (!timerArmed_) {
+	arm_stage_timer();
+  }
+
+  if (restored) {
+	auto latencyUs = static_cast<uint64_t>(std::max<int64_t>(
+		0, std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - eventTime).count()));
+	auto &stats = wakeStats_[trigger];
+	stats.count++;
+	stats.totalUs += latencyUs;
+	stats.maxUs = std::max(stats.maxUs, latencyUs);
+	earlyWakeTrigger_ = trigger;
+	earlyWakeTime_ = lastEvent_;
+	print_debug("Wake by %s, turning lights on after %lu us\n",
+				WAKE_TRIGGER_NAMES[trigger], latencyUs);
+	return;
+  }
+
+  // First input after an early wake found the light already on
+  if (trigger == WAKE_INPUT && earlyWakeTrigger_ != WAKE_INPUT) {
+	auto &stats = wakeStats_[earlyWakeTrigger_];
+	stats.leadCount++;
+	stats.leadTotalUs += std::chrono::duration_cast<std::chrono::microseconds>(
+		eventTime - earlyWakeTime_).count();
+	earlyWakeTrigger_ = WAKE_INPUT;
+  }
+}
+
+/* Reading a document comes notch by notch, so a read which only scrolled
+ * just moves the scroll time. The stage timer picks it up when it expires.
+ * The activity path runs at most once per SCROLL_ACTIVITY_INTERVAL, or right
+ * away if the scroll turns a light on.
+ */
+void on_scroll(std::chrono::time_point<std::chrono::steady_clock> eventTime) {
+  auto mode = policies_[sessionState_].scroll;
+  if (mode == SCROLL_IGNORE) {
+	return;
+  }
+  lastScroll_ = std::max(lastScroll_, eventTime);
+  scrollStats_.batches++;
+  bool dark = mode == SCROLL_WAKE && std::any_of(sinks_.begin(), sinks_.end(), [](const light_sink &sink) {
+	return sink.stage > 0 && input_restores(sink, false);
+  });
+  if (!dark && eventTime - lastScrollActivity_ < SCROLL_ACTIVITY_INTERVAL) {
+	return;
+  }
+
+  lastScrollActivity_ = eventTime;
+  scrollStats_.activities++;
+  if (mode == SCROLL_WAKE) {
+	on_activity(WAKE_SCROLL, eventTime, false);
+  } else {
+	note_activity();
+  }
+}
+
+// Touchpads report two finger scrolling as the motion of both fingers
+bool is_scroll(input_device &dev, const input_event &ie) {
+  if (ie.type == EV_KEY && ie.code == BTN_TOOL_DOUBLETAP) {
+	dev.twoFingers = ie.value != 0;
+	return false;
+  }
+  if (ie.type == EV_REL) {
+	return ie.code == REL_WHEEL || ie.code == REL_HWHEEL
+		|| ie.code == REL_WHEEL_HI_RES || ie.code == REL_HWHEEL_HI_RES;
+  }
+  return ie.type == EV_ABS && dev.twoFingers;
+}
+
+/* mousedev speaks ps/2 without a wheel unless a reader switches it to imps/2,
+ * a notch shows up as a packet without motion or a button change.
+ * Returns false if any packet of the read moved the mouse or changed a button.
+ */
+bool is_ps2_scroll(input_device &dev, const uint8_t *data, size_t size) {
+  bool scroll = size > 0 && size % 3 == 0;
+  for (size_t i = 0; i + 3 <= size; i += 3) {
+	uint8_t buttons = data[i] & 0x07;
+	if (data[i + 1] != 0 || data[i + 2] != 0 || buttons != dev.ps2Buttons) {
+	  scroll = false;
+	}
+	dev.ps2Buttons = buttons;
+  }
+  return scroll;
+}
+
+void resume_device(input_device &dev, DEVICE_WAIT reason);
+
+bool is_mirror_candidate(const input_device &dev) {
+  return dev.keyboard && dev.virtualDevice && !dev.included;
+}
+
+/* Key remappers like keyd, kmonad or interception-tools repeat the keys of
+ * the physical keyboards on a virtual one. If they grab a physical keyboard
+ * its keys only show up on the virtual keyboard, otherwise on both.
+ * A key of a virtual keyboard only counts if no physical keyboard delivered
+ * a key shortly before, so every key press is processed once and a grab is
+ * noticed with the next key, without touching the physical keyboards.
+ */
+void update_mirror(input_device &dev, std::chrono::time_point<std::chrono::steady_clock> keyTime) {
+  bool mirrored = keyTime - lastPhysicalKey_ <= MIRROR_WINDOW;
+  if (!mirrored) {
+	// the physical key it repeats may be waiting in the same round of the loop.
+	// The lifecycle of the keyboard reads it, so a vanished or faulty one is handled as usual.
+	for (auto &other : devices_) {
+	  if (other.keyboard && !other.virtualDevice && other.state == DEVICE_ACTIVE) {
+		resume_device(other, WAIT_READABLE);
+	  }
+	}
+	mirrored = keyTime - lastPhysicalKey_ <= MIRROR_WINDOW;
+  }
+
+  if (mirrored && dev.state == DEVICE_ACTIVE) {
+	set_device_state(dev, DEVICE_MIRRORED);
+	printf("Ignoring virtual keyboard %s (%s), it mirrors the physical keyboards\n",
+		   dev.path.c_str(), dev.identity.name.c_str());
+	fflush(stdout);
+  } else if (!mirrored && dev.state == DEVICE_MIRRORED) {
+	set_device_state(dev, DEVICE_ACTIVE);
+	printf("Using virtual keyboard %s (%s), the physical keyboards are silent or grabbed\n",
+		   dev.path.c_str(), dev.identity.name.c_str());
+	fflush(stdout);
+  }
+}
+
+bool is_tool_code(unsigned int code) {
+  return (code >= BTN_TOOL_PEN && code <= BTN_TOOL_QUINTTAP)
+	  || (code >= BTN_TOOL_DOUBLETAP && code <= BTN_TOOL_QUADTAP);
+}
+
+// Filter of a class device, it only looks at the event itself
+bool class_event_counts(const input_device &dev, const input_event &ie) {
+  switch (dev.classFilter) {
+	case CLASS_FILTER_ALL:
+	  return true;
+	case CLASS_FILTER_BUTTONS:
+	  return ie.type == EV_KEY && ie.value == 1 && !is_tool_code(ie.code);
+	case CLASS_FILTER_PROXIMITY:
+	  // the tool codes come first when the pen is in range, before it touches
+	  return ie.type == EV_KEY && ie.value == 1;
+	case CLASS_FILTER_DEADZONE:
+	  if (ie.type == EV_KEY) {
+		return ie.value == 1;
+	  }
+	  return ie.type == EV_ABS && ie.code < GAMEPAD_AXES
+		  && std::abs(ie.value - dev.axes[ie.code].value) > dev.axes[ie.code].threshold;
+	case CLASS_FILTER_OFF:
+	  break;
+  }
+  return false;
+}
+
+/* Reads all pending events of a device.
+ * Returns false if the device is gone and should be removed.
+ */
+bool read_events(input_device &dev, const options &opts) {
+  trace_span span(TRACE_INPUT_BATCH, dev.source.fd);
+  struct input_event events[64];
+  while (true) {
+	ssize_t rd = read(dev.source.fd, events, sizeof(events));
+	if (rd < 0) {
+	  if (errno == EINTR) {
+		continue;
+	  }
+	  return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+	if (rd == 0) {
+	  return false;
+	}
+
+	// Any other data from mousedev is movement
+	bool scrolled = !dev.evdev && is_ps2_scroll(dev, reinterpret_cast<const uint8_t *>(events), rd);
+	bool activity = !dev.evdev && !scrolled;
+	WAKE_TRIGGER trigger = WAKE_INPUT;
+	auto eventTime = std::chrono::steady_clock::now();
+	auto scrollTime = eventTime;
+	size_t count = dev.evdev ? rd / sizeof(struct input_event) : 0;
+	const auto &limits = dev.state == DEVICE_CHECKING ? PROBATION_LIMITS : FAULT_LIMITS;
+	bool mirrorChecked = !is_mirror_candidate(dev) || dev.state == DEVICE_CHECKING;
+	bool faulty = false;
+	bool keyPressed = false;
+	for (size_t i = 0; i < count; ++i) {
+	  const auto &ie = events[i];
+	  // the rest is dropped when the device is masked, the input before still counts
+	  if (check_health(dev.health, ie, limits)) {
+		faulty = true;
+		break;
+	  }
+	  if (dev.deviceClass != CLASS_NONE) {
+		if (class_event_counts(dev, ie)) {
+		  if (!activity) {
+			eventTime = event_time(ie);
+		  }
+		  activity = true;
+		}
+		continue;
+	  }
+	  if (ie.type == EV_SW && ie.code == SW_LID && ie.value == 0) {
+		trigger = WAKE_LID;
+		eventTime = event_time(ie);
+		activity = true;
+		continue;
+	  }
+	  if (ie.type == EV_KEY && ie.code == BTN_TOOL_FINGER && ie.value == 1) {
+		if (!activity) {
+		  trigger = WAKE_TOUCHPAD;
+		  eventTime = event_time(ie);
+		}
+		activity = true;
+		continue;
+	  }
+	  if (dev.wakeOnly) {
+		continue;
+	  }
+	  if (is_scroll(dev, ie)) {
+		scrolled = true;
+		scrollTime = event_time(ie);
+		continue;
+	  }
+	  if (ie.type == EV_KEY) {
+		if (dev.keyboard && !dev.virtualDevice) {
+		  lastPhysicalKey_ = std::max(lastPhysicalKey_, event_time(ie));
+		} else if (!mirrorChecked) {
+		  update_mirror(dev, event_time(ie));
+		  mirrorChecked = true;
+		}
+	  }
+
+	  if (opts.showPressedKeys && ie.type == EV_MSC && ie.code == MSC_SCAN) {
+		printf("Pressed key value: %d\n", ie.value);
+		fflush(stdout);
+	  }
+
+	  bool correctKey = true;
+	  if (ie.type == EV_MSC && ie.code == MSC_SCAN) {
+		if (opts.ignoredKeys.count(ie.value) != 0) {
+		  correctKey = false;
+		  // There are 3 events for every key press, so we are ignoring
+		  // the next 2 events
+		  dev.ignoreNextValues = 2;
+#if DEBUG_KEYS_IGNORE
+		  printf("Ignoring key: type: %u, code: %u, value: %d\n",
+				 ie.type, ie.code, ie.value);
+		  fflush(stdout);
+#endif
+		}
+	  } else if (dev.ignoreNextValues > 0) {
+		correctKey = false;
+		dev.ignoreNextValues--;
+	  }
+
+	  // frame markers carry no input, a frame of scroll events is a scroll
+	  if (correctKey && ie.type != EV_SYN && !(ie.type == EV_MSC && ie.code == MSC_TIMESTAMP)) {
+#if DEBUG_KEYS_IGNORE
+		printf("Processing key type: %u, code: %u, value: %d\n",
+			   ie.type, ie.code, ie.value);
+		fflush(stdout);
+#endif
+		if (!activity) {
+		  eventTime = event_time(ie);
+		}
+		activity = true;
+		keyPressed = keyPressed || (dev.keyboard && ie.type == EV_KEY && ie.value == 1);
+	  }
+	}
+
+	// mirrored keyboards and quarantined devices which are checked are read without effect
+	if (activity && dev.state == DEVICE_ACTIVE) {
+	  on_activity(trigger, eventTime, keyPressed);
+	} else if (scrolled && dev.state == DEVICE_ACTIVE) {
+	  on_scroll(scrollTime);
+	}
+
+	if (faulty || static_cast<size_t>(rd) < sizeof(events)) {
+	  return true;
+	}
+  }
+}
+
+void resume_device(input_device &dev, DEVICE_WAIT reason) {
+  if (!dev.waiter || (dev.waitFor & reason) == 0) {
+	return;
+  }
+
+  if (dev.waitFor & WAIT_TIMER) {
+	deviceTimerChanged_ = true;
+  }
+  auto waiter = std::exchange(dev.waiter, {});
+  dev.waitFor = WAIT_NONE;
+  dev.resumeReason = reason;
+  waiter.resume();
+}
+
+/* Suspends a device lifecycle until one of the reasons happens.
+ * Evaluates to the reason it was resumed for.
+ */
+struct device_wait {
+  input_device &dev;
+  unsigned int reasons;
+  std::chrono::time_point<std::chrono::steady_clock> deadline = {};
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> waiter) {
+	dev.waiter = waiter;
+	dev.waitFor = reasons;
+	dev.wakeAt = deadline;
+	if (reasons & WAIT_TIMER) {
+	  deviceTimerChanged_ = true;
+	}
+  }
+
+  DEVICE_WAIT await_resume() const noexcept { return dev.resumeReason; }
+};
+
+// One timer serves the deadlines of all devices
+void arm_device_timer(std::chrono::milliseconds tolerance) {
+  auto deadline = std::chrono::time_point<std::chrono::steady_clock>::max();
+  for (const auto &dev : devices_) {
+	if (dev.waitFor & WAIT_TIMER) {
+	  deadline = std::min(deadline, dev.wakeAt);
+	}
+  }
+
+  if (deadline != std::chrono::time_point<std::chrono::steady_clock>::max()) {
+	arm_timer(deviceTimer_, deadline, tolerance);
+	return;
+  }
+  itimerspec disarm = {};
+  timerfd_settime(deviceTimer_.fd, 0, &disarm, nullptr);
+}
+
+/* Masks all event types of the device, so the kernel does not even queue
+ * its events. EV_SYN can not be masked, but empty reports are dropped.
+ */
+bool mask_device(int fd, bool masked) {
+  uint8_t types[(EV_CNT + 7) / 8];
+  memset(types, masked ? 0x00 : 0xff, sizeof(types));
+  input_mask mask = {0, sizeof(types), reinterpret_cast<uint64_t>(types)};
+  return ioctl(fd, EVIOCSMASK, &mask) == 0;
+}
+
+void quarantine_device(input_device &dev, std::chrono::milliseconds recheck) {
+  if (dev.state != DEVICE_QUARANTINED) {
+	loop_remove(&dev.source);
+  }
+  dev.fault = dev.health.fault;
+  dev.faultCode = dev.health.faultCode;
+  if (dev.state != DEVICE_CHECKING) {
+	dev.quarantines++;
+	printf("Quarantined %s (%s): %s, checking again in %ld s\n",
+		   dev.path.c_str(), dev.identity.name.c_str(), DEVICE_FAULT_NAMES[dev.fault],
+		   static_cast<long>(std::chrono::duration_cast<std::chrono::seconds>(recheck).count()));
+	fflush(stdout);
+  }
+  if (!mask_device(dev.source.fd, true)) {
+	print_debug("Failed to mask %s: %s\n", dev.path.c_str(), strerror(errno));
+  }
+  set_device_state(dev, DEVICE_QUARANTINED);
+}
+
+/* Starts reading a quarantined device again without effect.
+ * Returns false if it still shows its fault right away.
+ */
+bool check_device(input_device &dev) {
+  if (dev.fault == FAULT_STUCK_KEY) {
+	uint8_t keys[(KEY_CNT + 7) / 8] = {};
+	if (ioctl(dev.source.fd, EVIOCGKEY(sizeof(keys)), keys) >= 0
+		&& (keys[dev.faultCode / 8] & (1 << (dev.faultCode % 8))) != 0) {
+	  return false;
+	}
+  }
+
+  mask_device(dev.source.fd, false);
+  // events queued before the mask are from the faulty period
+  input_event stale[64];
+  while (read(dev.source.fd, stale, sizeof(stale)) > 0) {
+  }
+  dev.health = {};
+  set_device_state(dev, DEVICE_CHECKING);
+  loop_add(&dev.source, EPOLLIN);
+  return true;
+}
+
+void release_device(input_device &dev) {
+  printf("%s (%s) recovered from %s\n", dev.path.c_str(), dev.identity.name.c_str(),
+		 DEVICE_FAULT_NAMES[dev.fault]);
+  fflush(stdout);
+  dev.health = {};
+  dev.fault = FAULT_NONE;
+  set_device_state(dev, DEVICE_ACTIVE);
+}
+
+/* Lifecycle of one input device
+ *   probing -> active -> backing off -> probing ...
+ *   probing -> mirrored <-> active, for virtual keyboards
+ *   active -> quarantined -> checking -> active or quarantined, for faulty devices
+ *   probing -> errored, until the node changes, e.g. its permissions
+ *   any state -> removed, once the node is gone
+ * The event loop resumes it when the device is readable, a probe finished,
+ * its retry delay passed or the node changed, so neither retries nor
+ * reconnects need a thread or polling.
+ */
+device_task device_lifecycle(input_device &dev, const options &opts) {
+  auto backoff = DEVICE_BACKOFF_MIN;
+  while (true) {
+	set_device_state(dev, DEVICE_PROBING);
+	prober_.probe(dev.path, dev.wakeOnly, std::exchange(dev.parkedFd, -1));
+	arm_probe_timer();
+	co_await device_wait{dev, WAIT_PROBE};
+	const auto result = dev.probe;
+
+	if (result.fd >= 0) {
+	  // rules are evaluated once per open, an ignore rule wins over an include rule
+	  const device_rule *ignore = result.evdev ? find_device_rule(opts.ignoreRules, result.identity) : nullptr;
+	  dev.included = result.evdev && ignore == nullptr
+		  && find_device_rule(opts.includeRules, result.identity) != nullptr;
+	  if (ignore != nullptr) {
+		printf("Ignoring %s (%s), it matches '%s'\n",
+			   dev.path.c_str(), result.identity.name.c_str(), ignore->text.c_str());
+		fflush(stdout);
+	  }
+	  auto filter = result.deviceClass != CLASS_NONE && ignore == nullptr
+		  ? opts.classFilters[result.deviceClass] : CLASS_FILTER_OFF;
+	  if (dev.included || filter != CLASS_FILTER_OFF) {
+		dev.wakeOnly = false;
+	  } else if (ignore != nullptr
+		  || (result.wakeOnly && (!opts.earlyWake || (!result.lid && !result.touchpad)))) {
+		close(result.fd);
+		rejectedNodes_.insert(dev.node);
+		break;
+	  }
+
+	  print_debug("Using %s%s\n", dev.path.c_str(), dev.wakeOnly ? " for early wake" : "");
+	  dev.source.fd = result.fd;
+	  dev.evdev = result.evdev;
+	  dev.ignoreNextValues = 0;
+	  dev.keyboard = result.keyboard && !dev.wakeOnly;
+	  dev.virtualDevice = result.virtualDevice;
+	  dev.identity = result.identity;
+	  dev.deviceClass = filter != CLASS_FILTER_OFF ? result.deviceClass : CLASS_NONE;
+	  dev.classFilter = filter;
+	  dev.axes = result.axes;
+	  for (auto &axis : dev.axes) {
+		axis.threshold = std::max(axis.flat, axis.halfRange * static_cast<int32_t>(opts.gamepadDeadzone) / 100);
+	  }
+	  dev.health = {};
+	  backoff = DEVICE_BACKOFF_MIN;
+	  // virtual keyboards count once their keys come without a physical key
+	  set_device_state(dev, is_mirror_candidate(dev) ? DEVICE_MIRRORED : DEVICE_ACTIVE);
+	  loop_add(&dev.source, EPOLLIN);
+
+	  while (true) {
+		co_await device_wait{dev, WAIT_READABLE | WAIT_HOTPLUG};
+		if (!read_events(dev, opts)) {
+		  break;
+		} else if (dev.health.fault == FAULT_NONE) {
+		  continue;
+		}
+
+		// Faulty, ignored until a check shows that it recovered
+		bool gone = false;
+		auto recheck = QUARANTINE_RECHECK_MIN;
+		quarantine_device(dev, recheck);
+		while (!gone && dev.state == DEVICE_QUARANTINED) {
+		  auto checkAt = std::chrono::steady_clock::now() + recheck;
+		  while (!gone && std::chrono::steady_clock::now() < checkAt) {
+			if (co_await device_wait{dev, WAIT_TIMER | WAIT_HOTPLUG, checkAt} == WAIT_HOTPLUG) {
+			  gone = !std::filesystem::exists(dev.path);
+			}
+		  }
+		  if (gone || !check_device(dev)) {
+			recheck = std::min(recheck * 2, QUARANTINE_RECHECK_MAX);
+			continue;
+		  }
+
+		  auto checkedAt = std::chrono::steady_clock::now() + QUARANTINE_PROBATION;
+		  while (!gone && dev.health.fault == FAULT_NONE) {
+			auto reason = co_await device_wait{dev, WAIT_READABLE | WAIT_TIMER | WAIT_HOTPLUG, checkedAt};
+			if (reason == WAIT_TIMER) {
+			  break;
+			}
+			gone = reason == WAIT_HOTPLUG ? !std::filesystem::exists(dev.path) : !read_events(dev, opts);
+		  }
+		  if (gone) {
+			break;
+		  }
+		  if (dev.health.fault == FAULT_NONE) {
+			release_device(dev);
+		  } else {
+			recheck = std::min(recheck * 2, QUARANTINE_RECHECK_MAX);
+			quarantine_device(dev, recheck);
+		  }
+		}
+		if (gone) {
+		  break;
+		}
+	  }
+
+	  print_debug("Device %s is gone\n", dev.path.c_str());
+	  if (dev.state != DEVICE_QUARANTINED) {
+		loop_remove(&dev.source);
+	  }
+	  close(dev.source.fd);
+	  dev.source.fd = -1;
+	  set_device_state(dev, DEVICE_ERRORED);
+	}
+
+	if (!std::filesystem::exists(dev.path)) {
+	  break;
+	}
+
+	if (result.fd < 0 && (result.error == EACCES || result.error == EPERM)) {
+	  set_device_state(dev, DEVICE_ERRORED);
+	  co_await device_wait{dev, WAIT_HOTPLUG};
+	  continue;
+	}
+
+	set_device_state(dev, DEVICE_BACKING_OFF);
+	print_debug("Retrying %s in %ld ms\n", dev.path.c_str(), static_cast<long>(backoff.count()));
+	co_await device_wait{dev, WAIT_TIMER | WAIT_HOTPLUG,
+						 std::chrono::steady_clock::now() + backoff};
+	backoff = std::min(backoff * 2, DEVICE_BACKOFF_MAX);
+  }
+
+  set_device_state(dev, DEVICE_REMOVED);
+  devicesFinished_ = true;
+}
+
+// parkedFd is an open fd of the device from the previous instance, it is closed if the device is not tracked
+void track_device(const std::string &path, bool wakeOnly, const options &opts, int parkedFd = -1) {
+  std::error_code ec;
+  std::filesystem::path node = std::filesystem::canonical(path, ec);
+  if (ec) {
+	node = path;
+  }
+
+  bool tracked = rejectedNodes_.count(node) != 0;
+  for (const auto &dev : devices_) {
+	tracked = tracked || dev.node == node;
+  }
+  if (tracked) {
+	if (parkedFd >= 0) {
+	  close(parkedFd);
+	}
+	return;
+  }
+
+  devices_.emplace_back();
+  auto &dev = devices_.back();
+  dev.source.owner = &dev;
+  dev.path = path;
+  dev.node = node;
+  dev.wakeOnly = wakeOnly;
+  dev.parkedFd = parkedFd;
+  auto name = node.filename().string();
+  if (name.rfind("event", 0) == 0) {
+	dev.nodeNumber = atoi(name.c_str() + strlen("event"));
+  }
+  dev.task = device_lifecycle(dev, opts);
+}
+
+void track_devices(const options &opts) {
+  std::vector<std::string> inputDevices;
+  std::vector<std::string> wakeDevices;
+  discover_devices(opts, inputDevices, wakeDevices);
+  for (const auto &path : inputDevices) {
+	track_device(path, false, opts);
+  }
+  for (const auto &path : wakeDevices) {
+	track_device(path, true, opts);
+  }
+}
+
+void on_device_timer() {
+  uint64_t expirations;
+  if (read(deviceTimer_.fd, &expirations, sizeof(expirations)) < 0) {
+	return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto &dev : devices_) {
+	if ((dev.waitFor & WAIT_TIMER) && dev.wakeAt <= now) {
+	  resume_device(dev, WAIT_TIMER);
+	}
+  }
+  deviceTimerChanged_ = true;
+}
+
+// Nodes in /dev/input were created, deleted or changed their permissions
+void on_hotplug(const options &opts) {
+  alignas(inotify_event) char buf[4096];
+  bool created = false;
+  while (true) {
+	ssize_t rd = read(hotplug_.fd, buf, sizeof(buf));
+	if (rd <= 0) {
+	  break;
+	}
+
+	for (char *p = buf; p < buf + rd;) {
+	  const auto *ev = reinterpret_cast<const inotify_event *>(p);
+	  p += sizeof(inotify_event) + ev->len;
+	  if (ev->len == 0) {
+		continue;
+	  }
+
+	  auto node = std::filesystem::path(INPUT_DEVICE_DIR) / ev->name;
+	  if (ev->mask & IN_DELETE) {
+		rejectedNodes_.erase(node);
+	  } else {
+		created = true;
+	  }
+	  for (auto &dev : devices_) {
+		if (dev.node == node) {
+		  resume_device(dev, WAIT_HOTPLUG);
+		}
+	  }
+	}
+  }
+
+  if (created) {
+	track_devices(opts);
+  }
+}
+
+bool dbus_request_name(const std::string &name) {
+  // A second instance must not take over the light of the first one
+  auto request = dbus_method_call("org.freedesktop.DBus",
+								  "/org/freedesktop/DBus",
+								  "org.freedesktop.DBus",
+								  "RequestName");
+  dbus_writer w(request);
+  w.add_string(name);
+  w.add_uint32(DBUS_NAME_FLAG_DO_NOT_QUEUE);
+
+  dbus_message reply;
+  uint32_t result = 0;
+  if (!dbus_.call_sync(request, reply, 5000)
+	  || reply.type != DBUS_METHOD_RETURN
+	  || !dbus_reader(reply).read_uint32(result)) {
+	printf("Failed to request bus name %s: %s\n",
+		   name.c_str(), reply.errorName.c_str());
+	return false;
+  }
+
+  if (result != DBUS_REQUEST_NAME_PRIMARY_OWNER) {
+	printf("%s is owned by another process\n", name.c_str());
+	return false;
+  }
+  return true;
+}
+
+// Returns the unique name of the owner, empty if the name has none
+std::string dbus_name_owner(const std::string &name) {
+  auto call = dbus_method_call("org.freedesktop.DBus",
+							   "/org/freedesktop/DBus",
+							   "org.freedesktop.DBus",
+							   "GetNameOwner");
+  dbus_writer(call).add_string(name);
+  dbus_message reply;
+  std::string owner;
+  if (!dbus_.call_sync(call, reply, 5000) || reply.type != DBUS_METHOD_RETURN
+	  || !dbus_reader(reply).read_string(owner)) {
+	return {};
+  }
+  return owner;
+}
+
+void set_session_state(SESSION_STATE state) {
+  if (state == sessionState_) {
+	return;
+  }
+  sessionState_ = state;
+  recorder_.record(FLIGHT_SESSION, state);
+  printf("Session %s\n", SESSION_STATE_NAMES[state]);
+  fflush(stdout);
+  sinks_.front().stages = policies_[state].keyboardStages;
+  // a shorter timeout may be over already, then the light goes off right away
+  arm_stage_timer();
+}
+
+// The handler gets the reader at the value and the signature of the value
+void logind_get(const std::string &path, const std::string &interface, const std::string &property,
+				std::function<void(dbus_reader &, const std::string &)> handler) {
+  auto call = dbus_method_call(LOGIND_BUS_NAME, path, "org.freedesktop.DBus.Properties", "Get");
+  dbus_writer w(call);
+  w.add_string(interface);
+  w.add_string(property);
+  dbus_.call(call, [handler](const dbus_message &reply) {
+	dbus_reader r(reply);
+	std::string signature;
+	if (reply.type == DBUS_METHOD_RETURN && reply.signature == "v" && r.read_signature(signature)) {
+	  handler(r, signature);
+	}
+  });
+}
+
+void logind_follow_session(const std::string &path) {
+  if (path == activeSession_) {
+	return;
+  }
+  activeSession_ = path;
+  print_debug("Active session %s\n", path.c_str());
+  if (path.empty() || path == "/") {
+	set_session_state(SESSION_UNLOCKED);
+	return;
+  }
+  logind_get(path, LOGIND_SESSION_INTERFACE, "LockedHint", [path](dbus_reader &r, const std::string &signature) {
+	bool locked;
+	if (path == activeSession_ && signature == "b" && r.read_bool(locked)) {
+	  set_session_state(locked ? SESSION_LOCKED : SESSION_UNLOCKED);
+	}
+  });
+}
+
+/* Lock and Unlock of the active session, its LockedHint set by the screen
+ * locker and the ActiveSession of the seat. Returns false if the signal is
+ * not one of them.
+ */
+bool logind_handle_signal(const dbus_message &msg) {
+  if (msg.interface == LOGIND_SESSION_INTERFACE) {
+	if (!activeSession_.empty() && msg.path == activeSession_ && (msg.member == "Lock" || msg.member == "Unlock")) {
+	  set_session_state(msg.member == "Lock" ? SESSION_LOCKED : SESSION_UNLOCKED);
+	}
+	return true;
+  }
+  if (msg.interface != "org.freedesktop.DBus.Properties" || msg.member != "PropertiesChanged"
+	  || msg.path.rfind("/org/freedesktop/login1/", 0) != 0) {
+	return false;
+  }
+
+  dbus_reader r(msg);
+  std::string interface;
+  size_t end;
+  if (msg.signature != "sa{sv}as" || !r.read_string(interface) || !r.enter_array("{sv}", end)) {
+	return true;
+  }
+  while (r.ok() && r.pos() < end) {
+	std::string key, signature;
+	if (!r.enter_struct() || !r.read_string(key) || !r.read_signature(signature)) {
+	  break;
+	}
+	if (msg.path == LOGIND_SEAT_PATH && interface == LOGIND_SEAT_INTERFACE
+		&& key == "ActiveSession" && signature == "(so)") {
+	  std::string id, path;
+	  if (r.enter_struct() && r.read_string(id) && r.read_string(path)) {
+		logind_follow_session(path);
+	  }
+	} else if (msg.path == activeSession_ && interface == LOGIND_SESSION_INTERFACE
+		&& key == "LockedHint" && signature == "b") {
+	  bool locked;
+	  if (r.read_bool(locked)) {
+		set_session_state(locked ? SESSION_LOCKED : SESSION_UNLOCKED);
+	  }
+	} else {
+	  size_t i = 0;
+	  r.skip(signature, i);
+	}
+  }
+  return true;
+}
+
+bool dbus_open(const options &opts) {
+  const char *env = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+  std::string address = env != nullptr ? env : DBUS_SYSTEM_BUS_DEFAULT_ADDRESS;
+  if (!dbus_.open(address)) {
+	printf("Failed to connect to the system bus at %s\n", address.c_str());
+	return false;
+  }
+  print_debug("Connected to system bus as %s\n", dbus_.unique_name().c_str());
+
+  if (opts.useDbus) {
+	if (!dbus_request_name(SERVICE_BUS_NAME)) {
+	  dbus_.close();
+	  return false;
+	}
+	dbus_.add_match("type='signal',sender='org.freedesktop.DBus',"
+					"interface='org.freedesktop.DBus',member='NameOwnerChanged',"
+					"arg0='" + UPOWER_BUS_NAME + "'");
+	dbus_.add_match("type='signal',sender='" + UPOWER_BUS_NAME + "',"
+					"path='" + UPOWER_KBD_PATH + "',"
+					"interface='" + UPOWER_KBD_INTERFACE + "',member='BrightnessChanged'");
+	upowerOwner_ = dbus_name_owner(UPOWER_BUS_NAME);
+	if (upowerOwner_.empty()) {
+	  printf("UPower is not running, the desktop does not see the brightness changes\n");
+	}
+  }
+
+  if (opts.earlyWake) {
+	dbus_.add_match("type='signal',sender='org.freedesktop.login1',"
+					"path='/org/freedesktop/login1',"
+					"interface='org.freedesktop.login1.Manager',"
+					"member='PrepareForSleep'");
+  }
+
+  // Nothing is polled, the state follows the signals and the initial answers of logind
+  if (opts.lockedTimeout.count() > 0) {
+	dbus_.add_match("type='signal',sender='" + LOGIND_BUS_NAME + "',"
+					"interface='" + LOGIND_SESSION_INTERFACE + "'");
+	dbus_.add_match("type='signal',sender='" + LOGIND_BUS_NAME + "',"
+					"interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',"
+					"path_namespace='/org/freedesktop/login1'");
+	logind_get(LOGIND_SEAT_PATH, LOGIND_SEAT_INTERFACE, "ActiveSession",
+			   [](dbus_reader &r, const std::string &signature) {
+				 std::string id, path;
+				 if (signature == "(so)" && r.enter_struct() && r.read_string(id) && r.read_string(path)) {
+				   logind_follow_session(path);
+				 }
+			   });
+  }
+  return true;
+}
+
+void on_resume() {
+  // The firmware restores its own level after resume, so always write ours
+  auto &keyboard = sinks_.front();
+  account_energy(keyboard);
+  keyboard.current = keyboard.onLevel + 1;
+  on_activity(WAKE_RESUME, std::chrono::steady_clock::now());
+}
+
+// The user picked a level, it is used until the next one is picked
+void adopt_keyboard_level(uint64_t level) {
+  auto &keyboard = sinks_.front();
+  account_energy(keyboard);
+  keyboard.onLevel = level;
+  keyboard.stage = 0;
+  lastEvent_ = std::chrono::steady_clock::now();
+  lastKey_ = lastEvent_;
+  if (!timerArmed_) {
+	arm_stage_timer();
+  }
+}
+
+void upower_handle_signal(const dbus_message &msg) {
+  if (msg.interface == "org.freedesktop.DBus" && msg.member == "NameOwnerChanged") {
+	std::string name, oldOwner, newOwner;
+	dbus_reader r(msg);
+	if (r.read_string(name) && r.read_string(oldOwner) && r.read_string(newOwner)
+		&& name == UPOWER_BUS_NAME) {
+	  upowerOwner_ = newOwner;
+	  upowerEchoes_.clear();
+	  printf("UPower %s\n", newOwner.empty() ? "stopped" : "started");
+	  fflush(stdout);
+	}
+	return;
+  }
+
+  int32_t value;
+  if (upowerOwner_.empty() || msg.sender != upowerOwner_ || msg.member != "BrightnessChanged"
+	  || msg.signature != "i" || !dbus_reader(msg).read_int32(value) || value < 0) {
+	return;
+  }
+  auto echo = std::find(upowerEchoes_.begin(), upowerEchoes_.end(), value);
+  if (echo != upowerEchoes_.end()) {
+	upowerEchoes_.erase(echo);
+	return;
+  }
+
+  // changed in the desktop, UPower wrote it already
+  print_debug("UPower changed the brightness to %d\n", value);
+  recorder_.record(FLIGHT_BUS_LEVEL, 1, value);
+  auto &keyboard = sinks_.front();
+  account_energy(keyboard);
+  keyboard.current = value;
+  adopt_keyboard_level(value);
+  dbus_brightness_changed(value);
+}
+
+void dbus_handle_message(const dbus_message &msg, const options &opts) {
+  auto &keyboard = sinks_.front();
+  if (msg.type == DBUS_SIGNAL) {
+	bool sleeping;
+	if (opts.earlyWake && msg.member == "PrepareForSleep"
+		&& msg.interface == "org.freedesktop.login1.Manager"
+		&& dbus_reader(msg).read_bool(sleeping) && !sleeping) {
+	  print_debug_n("Resumed from sleep\n");
+	  on_resume();
+	} else if (opts.lockedTimeout.count() > 0 && logind_handle_signal(msg)) {
+	  return;
+	} else if (opts.useDbus) {
+	  upower_handle_signal(msg);
+	}
+	return;
+  }
+
+  if (msg.type != DBUS_METHOD_CALL) {
+	return;
+  }
+
+  dbus_message ret;
+  dbus_writer w(ret);
+  if (msg.interface == "org.freedesktop.DBus.Peer" && msg.member == "Ping") {
+	dbus_.reply(msg, ret);
+	return;
+  }
+
+  if (msg.path != UPOWER_KBD_PATH) {
+	dbus_.reply_error(msg, "org.freedesktop.DBus.Error.UnknownObject",
+					  "No such object " + msg.path);
+	return;
+  }
+
+  if (msg.interface == "org.freedesktop.DBus.Introspectable"
+	  && msg.member == "Introspect") {
+	w.add_string(UPOWER_KBD_INTROSPECTION);
+	dbus_.reply(msg, ret);
+	return;
+  }
+
+  if (!msg.interface.empty() && msg.interface != UPOWER_KBD_INTERFACE) {
+	dbus_.reply_error(msg, "org.freedesktop.DBus.Error.UnknownInterface",
+					  "No such interface " + msg.interface);
+	return;
+  }
+
+  if (msg.member == "GetBrightness") {
+	w.add_int32(static_cast<int32_t>(keyboard.current));
+	dbus_.reply(msg, ret);
+  } else if (msg.member == "GetMaxBrightness") {
+	w.add_int32(static_cast<int32_t>(get_max_brightness(keyboard)));
+	dbus_.reply(msg, ret);
+  } else if (msg.member == "SetBrightness") {
+	int32_t value;
+	if (msg.signature != "i" || !dbus_reader(msg).read_int32(value)
+		|| value < 0 || static_cast<uint64_t>(value) > get_max_brightness(keyboard)) {
+	  dbus_.reply_error(msg, "org.freedesktop.DBus.Error.InvalidArgs",
+						"Invalid brightness");
+	  return;
+	}
+	// Treat it like the user changed the level on the keyboard
+	recorder_.record(FLIGHT_BUS_LEVEL, 0, value);
+	set_brightness(keyboard, value);
+	adopt_keyboard_level(value);
+	dbus_.reply(msg, ret);
+  } else {
+	dbus_.reply_error(msg, "org.freedesktop.DBus.Error.UnknownMethod",
+					  "No such method " + msg.member);
+  }
+}
+
+void dbus_process(const options &opts) {
+  trace_span span(TRACE_DBUS);
+  bool alive = dbus_.dispatch([&opts](const dbus_message &msg) {
+	dbus_handle_message(msg, opts);
+  });
+  if (!alive) {
+	printf("Lost connection to the system bus\n");
+	loop_remove(&dbusSource_);
+	dbus_.close();
+	dbusSource_.fd = -1;
+  }
+}
+
+void print_timeout_estimates(FILE *fp, unsigned long currentTimeout) {
+  const unsigned long candidates[] = {1, 2, 3, 5, 10, 15, 20, 30, 45, 60, 90, 120, 180, 300, 600};
+
+  fprintf(fp, "timeout what-if (%lu idle gaps, %.0f s active):\n",
+		  idleHistogram_.gaps(), idleHistogram_.active_ms() / 1000.0);
+  fprintf(fp, "  timeout  toggles  led on s  wakes\n");
+  for (const auto &estimate : idleHistogram_.estimate_all()) {
+	bool current = estimate.timeout == currentTimeout;
+	if (!current && std::find(std::begin(candidates), std::end(candidates),
+							  estimate.timeout) == std::end(candidates)) {
+	  continue;
+	}
+	fprintf(fp, "%c %6lus %8lu %9.0f %6lu\n",
+			current ? '*' : ' ',
+			estimate.timeout,
+			estimate.toggles,
+			estimate.ledOnMs / 1000.0,
+			estimate.wakes);
+  }
+}
+
+// Estimated with the power model, the times are exact
+void print_energy(FILE *fp) {
+  fprintf(fp, "energy (estimated with the power model):\n");
+  auto now = std::chrono::steady_clock::now();
+  for (auto &sink : sinks_) {
+	account_energy(sink, now);
+	const auto &ledger = sink.ledger;
+	std::chrono::microseconds total{0}, off{0};
+	for (const auto &level : ledger.levelTime) {
+	  total += level.second;
+	  if (level.first == 0) {
+		off = level.second;
+	  }
+	}
+	fprintf(fp, "  %-8s on %.1f s of %.1f s, %lu writes\n", SINK_TYPE_NAMES[sink.type],
+			(total - off).count() / 1e6, total.count() / 1e6, sink_writes(sink));
+	for (const auto &level : ledger.levelTime) {
+	  fprintf(fp, "    level %-6lu %9.1f s %7.0f mW\n",
+			  level.first, level.second.count() / 1e6, sink_power_mw(sink, level.first));
+	}
+	double saved = ledger.alwaysOnMj - ledger.usedMj;
+	// 3600 mJ are one mWh
+	fprintf(fp, "    used %.1f mWh, always on %.1f mWh, saved %.1f mWh (%.0f%%)\n",
+			ledger.usedMj / 3600, ledger.alwaysOnMj / 3600, saved / 3600,
+			ledger.alwaysOnMj > 0 ? 100 * saved / ledger.alwaysOnMj : 0.0);
+  }
+}
+
+void print_status(FILE *fp, const options &opts) {
+  for (const auto &sink : sinks_) {
+	fprintf(fp, "%s brightness: %lu, on level: %lu, stage %zu of %zu%s\n",
+			SINK_TYPE_NAMES[sink.type], sink.current, sink.onLevel,
+			sink.stage, sink.stages.size(), is_blanked(sink) ? " (blanked)" : "");
+	const auto &profile = sink.output.profile;
+	if (profile.maxLevel > 0) {
+	  fprintf(fp, "  profile: %s writes%s, %s, write p90 %ld us\n",
+			  profile.async ? "asynchronous" : "synchronous", profile.verify ? " verified" : "",
+			  profile.fadeFps > 0 ? ("fades at " + std::to_string(profile.fadeFps) + " fps").c_str() : "no fades",
+			  static_cast<long>(profile.writeLatency.count()));
+	}
+  }
+  if (opts.lockedTimeout.count() > 0) {
+	fprintf(fp, "session: %s%s\n", activeSession_.empty() ? "none" : activeSession_.c_str(),
+			sessionState_ == SESSION_LOCKED ? ", locked, only keys turn the keyboard light on" : "");
+  }
+  fprintf(fp, "scroll (%s): %lu reads, %lu passed on as activity\n",
+		  SCROLL_MODE_NAMES[policies_[sessionState_].scroll], scrollStats_.batches, scrollStats_.activities);
+
+  print_energy(fp);
+
+  fprintf(fp, "wake latency (trigger until the light is on):\n");
+  for (int i = 0; i < WAKE_TRIGGER_COUNT; ++i) {
+	const auto &stats = wakeStats_[i];
+	if (stats.count == 0) {
+	  continue;
+	}
+	fprintf(fp, "  %-8s count %lu avg %.3f ms max %.3f ms\n",
+			WAKE_TRIGGER_NAMES[i],
+			stats.count,
+			stats.totalUs / 1000.0 / stats.count,
+			stats.maxUs / 1000.0);
+  }
+
+  fprintf(fp, "early wake (light already on at the first input):\n");
+  for (int i = WAKE_INPUT + 1; i < WAKE_TRIGGER_COUNT; ++i) {
+	const auto &stats = wakeStats_[i];
+	if (stats.leadCount == 0) {
+	  continue;
+	}
+	fprintf(fp, "  %-8s hidden %lu of %lu wakes, avg lead %.3f ms\n",
+			WAKE_TRIGGER_NAMES[i],
+			stats.leadCount,
+			stats.count,
+			stats.leadTotalUs / 1000.0 / stats.leadCount);
+  }
+
+  fprintf(fp, "devices:\n");
+  for (const auto &dev : devices_) {
+	std::string deviceClass;
+	if (dev.deviceClass != CLASS_NONE) {
+	  deviceClass = std::string(" (") + DEVICE_CLASS_NAMES[dev.deviceClass] + ", "
+		  + CLASS_FILTER_NAMES[dev.classFilter] + ")";
+	}
+	fprintf(fp, "  %-24s %s%s%s%s%s%s%s%s%s\n", dev.path.c_str(), DEVICE_STATE_NAMES[dev.state],
+			dev.fault != FAULT_NONE ? " " : "",
+			dev.fault != FAULT_NONE ? DEVICE_FAULT_NAMES[dev.fault] : "",
+			dev.wakeOnly ? " (early wake)" : "",
+			deviceClass.c_str(),
+			dev.included ? " (included)" : "",
+			dev.virtualDevice ? " (virtual)" : "",
+			dev.identity.name.empty() ? "" : " ",
+			dev.identity.name.c_str());
+  }
+
+  if (hub_.is_open()) {
+	fprintf(fp, "activity hub: %zu clients\n", hub_.clients());
+  }
+
+  print_timeout_estimates(fp, opts.timeout);
+
+  if (!lastAudit_.empty()) {
+	fputs(lastAudit_.c_str(), fp);
+  }
+}
+
+void write_status(const options &opts) {
+  FILE *fp = fopen(opts.statusPath.c_str(), "w");
+  if (fp) {
+	print_status(fp, opts);
+	fclose(fp);
+  }
+  if (opts.foreground) {
+	print_status(stdout, opts);
+	fflush(stdout);
+  }
+}
+
+process_sample sample_process() {
+  process_sample sample = {};
+  sample.time = std::chrono::steady_clock::now();
+  sample.counters = auditCounters_;
+
+  std::ifstream schedstat("/proc/self/schedstat");
+  schedstat >> sample.runNs >> sample.waitNs >> sample.timeslices;
+
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+	uint64_t *target = nullptr;
+	if (line.rfind("voluntary_ctxt_switches:", 0) == 0) {
+	  target = &sample.voluntarySwitches;
+	} else if (line.rfind("nonvoluntary_ctxt_switches:", 0) == 0) {
+	  target = &sample.involuntarySwitches;
+	} else if (line.rfind("VmRSS:", 0) == 0) {
+	  target = &sample.rssKb;
+	} else if (line.rfind("VmHWM:", 0) == 0) {
+	  target = &sample.maxRssKb;
+	}
+	if (target != nullptr) {
+	  *target = strtoull(line.substr(line.find(':') + 1).c_str(), nullptr, 10);
+	}
+  }
+
+  std::ifstream io("/proc/self/io");
+  while (std::getline(io, line)) {
+	if (line.rfind("syscr:", 0) == 0) {
+	  sample.readCalls = strtoull(line.c_str() + 6, nullptr, 10);
+	} else if (line.rfind("syscw:", 0) == 0) {
+	  sample.writeCalls = strtoull(line.c_str() + 6, nullptr, 10);
+	}
+  }
+
+  getrusage(RUSAGE_SELF, &sample.usage);
+  return sample;
+}
+
+std::string format_audit(const process_sample &start, const process_sample &end) {
+  auto seconds = std::chrono::duration<double>(end.time - start.time).count();
+  auto rate = [seconds](uint64_t count) { return seconds > 0 ? count / seconds : 0.0; };
+  auto cpuUs = [](const rusage &u) {
+	return (u.ru_utime.tv_sec + u.ru_stime.tv_sec) * 1000000ull
+		+ u.ru_utime.tv_usec + u.ru_stime.tv_usec;
+  };
+
+  char buf[256];
+  std::string report;
+  snprintf(buf, sizeof(buf), "self audit over %.1f s:\n", seconds);
+  report += buf;
+
+  auto wakeups = end.counters.loopWakeups - start.counters.loopWakeups;
+  snprintf(buf, sizeof(buf), "  wakeups %lu (%.2f/s):", wakeups, rate(wakeups));
+  report += buf;
+  for (int i = 0; i < AUDIT_SOURCE_COUNT; ++i) {
+	snprintf(buf, sizeof(buf), " %s %lu", AUDIT_SOURCE_NAMES[i],
+			 end.counters.events[i] - start.counters.events[i]);
+	report += buf;
+  }
+  report += "\n";
+
+  // sampling the process reads /proc too, so an idle window is never 0
+  auto reads = end.readCalls - start.readCalls;
+  auto writes = end.writeCalls - start.writeCalls;
+  snprintf(buf, sizeof(buf), "  read/write syscalls %lu (%.2f/s): %lu read %lu write\n",
+		   reads + writes, rate(reads + writes), reads, writes);
+  report += buf;
+
+  auto switches = end.voluntarySwitches - start.voluntarySwitches
+	  + end.involuntarySwitches - start.involuntarySwitches;
+  snprintf(buf, sizeof(buf), "  context switches %lu (%.2f/s), %lu involuntary, %lu timeslices\n",
+		   switches, rate(switches),
+		   end.involuntarySwitches - start.involuntarySwitches,
+		   end.timeslices - start.timeslices);
+  report += buf;
+
+  snprintf(buf, sizeof(buf), "  cpu %.3f ms (%.3f ms/s), run queue wait %.3f ms\n",
+		   (cpuUs(end.usage) - cpuUs(start.usage)) / 1000.0,
+		   rate(cpuUs(end.usage) - cpuUs(start.usage)) / 1000.0,
+		   (end.waitNs - start.waitNs) / 1000000.0);
+  report += buf;
+
+  snprintf(buf, sizeof(buf), "  rss %lu kB, max rss %lu kB, page faults %ld\n",
+		   end.rssKb, end.maxRssKb,
+		   end.usage.ru_minflt + end.usage.ru_majflt
+			   - start.usage.ru_minflt - start.usage.ru_majflt);
+  report += buf;
+  return report;
+}
+
+void start_audit(unsigned long seconds) {
+  auditStart_ = sample_process();
+  itimerspec spec = {};
+  spec.it_value.tv_sec = static_cast<time_t>(seconds);
+  timerfd_settime(auditTimer_.fd, 0, &spec, nullptr);
+  print_debug("Starting self audit for %lu s\n", seconds);
+}
+
+void finish_audit(const options &opts) {
+  uint64_t expirations;
+  if (read(auditTimer_.fd, &expirations, sizeof(expirations)) < 0) {
+	return;
+  }
+  lastAudit_ = format_audit(auditStart_, sample_process());
+  write_status(opts);
+}
+
+AUDIT_SOURCE audit_source(EVENT_SOURCE type) {
+  switch (type) {
+	case SOURCE_INPUT:
+	  return AUDIT_INPUT;
+	case SOURCE_TIMER:
+	case SOURCE_DEVICE_TIMER:
+	case SOURCE_HUB_TIMER:
+	case SOURCE_FADE_TIMER:
+	  return AUDIT_TIMER;
+	default:
+	  return AUDIT_CONTROL;
+  }
+}
+
+void deliver_probe_results() {
+  for (const auto &result : prober_.take_results()) {
+	auto dev = std::find_if(devices_.begin(), devices_.end(), [&result](const input_device &d) {
+	  return d.path == result.path && (d.waitFor & WAIT_PROBE);
+	});
+	if (dev == devices_.end()) {
+	  if (result.fd >= 0) {
+		close(result.fd);
+	  }
+	  continue;
+	}
+	dev->probe = result;
+	resume_device(*dev, WAIT_PROBE);
+  }
+}
+
+void report_overdue_probes() {
+  uint64_t expirations;
+  if (read(probeTimer_.fd, &expirations, sizeof(expirations)) < 0) {
+	return;
+  }
+
+  for (const auto &path : prober_.take_overdue()) {
+	printf("%s did not open within %ld ms, it is used once it is ready\n",
+		   path.c_str(), static_cast<long>(PROBE_TIMEOUT.count()));
+  }
+  arm_probe_timer();
+}
+
+bool engine_dispatch(int timeoutMs) {
+  const auto &opts = opts_;
+  epoll_event events[16];
+  int count = epoll_wait(epollFd_, events, 16, timeoutMs);
+  auditCounters_.loopWakeups++;
+  if (count < 0) {
+	if (errno == EINTR) {
+	  return true;
+	}
+	perror("tp_kbd_backlight: epoll_wait");
+	return false;
+  }
+
+  for (int i = 0; i < count; ++i) {
+	auto source = static_cast<event_source *>(events[i].data.ptr);
+	auditCounters_.events[audit_source(source->type)]++;
+	switch (source->type) {
+	  case SOURCE_INPUT:
+		resume_device(*static_cast<input_device *>(source->owner), WAIT_READABLE);
+		break;
+	  case SOURCE_TIMER:
+		brightness_control();
+		break;
+	  case SOURCE_FADE_TIMER:
+		on_fade_timer();
+		break;
+	  case SOURCE_HOST:
+		static_cast<host_source *>(source->owner)->handler();
+		break;
+	  case SOURCE_DBUS:
+		dbus_process(opts);
+		break;
+	  case SOURCE_AUDIT:
+		finish_audit(opts);
+		break;
+	  case SOURCE_PROBE:
+		deliver_probe_results();
+		break;
+	  case SOURCE_PROBE_TIMER:
+		report_overdue_probes();
+		break;
+	  case SOURCE_DEVICE_TIMER:
+		on_device_timer();
+		break;
+	  case SOURCE_HOTPLUG:
+		on_hotplug(opts);
+		break;
+	  case SOURCE_HUB:
+		// a client may have asked for an earlier idle deadline than the armed one
+		hub_.dispatch(std::chrono::steady_clock::now());
+		update_hub_timer(std::chrono::steady_clock::now());
+		break;
+	  case SOURCE_HUB_TIMER: {
+		uint64_t expirations;
+		if (read(hubTimer_.fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+		  update_hub_timer(std::chrono::steady_clock::now());
+		}
+		break;
+	  }
+	}
+  }
+
+  // Finished lifecycles are removed after all events of this round were handled
+  if (devicesFinished_) {
+	devices_.remove_if([](const input_device &dev) { return dev.task.done(); });
+	devicesFinished_ = false;
+  }
+  if (deviceTimerChanged_) {
+	arm_device_timer(opts.tolerance);
+	deviceTimerChanged_ = false;
+  }
+
+  // Only wait for the bus to become writable while there is data queued
+  if (dbusSource_.fd >= 0 && dbus_.wants_write() != dbusWantsWrite_) {
+	dbusWantsWrite_ = dbus_.wants_write();
+	loop_modify(&dbusSource_, EPOLLIN | (dbusWantsWrite_ ? EPOLLOUT : 0u));
+  }
+  return true;
+}
+
+bool is_brightness_writable(const std::string &brightnessPath) {
+  std::filesystem::path p(brightnessPath);
+  if (!std::filesystem::exists(p)) {
+	printf("Brightness device %s does not exist\n", brightnessPath.c_str());
+	return false;
+  }
+
+  uint64_t level;
+  if (!file_read_uint64(brightnessPath, &level)
+	  || !file_write_uint64(brightnessPath, level)) {
+	printf("Write access to brightness device %s failed."
+		   " Please run with root privileges", brightnessPath.c_str());
+	return false;
+  }
+  return true;
+}
+
+bool setup_event_loop() {
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ < 0) {
+	perror("tp_kbd_backlight: epoll_create1");
+	return false;
+  }
+
+  timer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  auditTimer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  probeTimer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  deviceTimer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  fadeTimer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_.fd < 0 || auditTimer_.fd < 0 || probeTimer_.fd < 0
+	  || deviceTimer_.fd < 0 || fadeTimer_.fd < 0 || !prober_.start()) {
+	perror("tp_kbd_backlight: timerfd/eventfd");
+	return false;
+  }
+  probeSource_.fd = prober_.fd();
+
+  // Devices plugged in later are picked up, without it only the ones present at start are used
+  hotplug_.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (hotplug_.fd >= 0) {
+	inotify_add_watch(hotplug_.fd, INPUT_DEVICE_DIR.c_str(), IN_CREATE | IN_ATTRIB | IN_DELETE);
+	// udev adds the by-path links after the node
+	inotify_add_watch(hotplug_.fd, (INPUT_DEVICE_DIR + "/by-path").c_str(), IN_CREATE);
+	loop_add(&hotplug_, EPOLLIN);
+  } else {
+	perror("tp_kbd_backlight: inotify_init1");
+  }
+
+  return loop_add(&timer_, EPOLLIN)
+	  && loop_add(&auditTimer_, EPOLLIN)
+	  && loop_add(&probeSource_, EPOLLIN)
+	  && loop_add(&probeTimer_, EPOLLIN)
+	  && loop_add(&deviceTimer_, EPOLLIN)
+	  && loop_add(&fadeTimer_, EPOLLIN);
+}
+
+void close_source(event_source &source) {
+  if (source.fd >= 0) {
+	close(source.fd);
+	source.fd = -1;
+  }
+}
+
+// The lights of the options, their levels are not read yet
+void build_sinks() {
+  sinks_.push_back({SINK_KEYBOARD, opts_.backlightPath,
+					{{std::chrono::seconds(opts_.timeout), 0}}, 0, 0, 0, {}, 0, {}, {}, {}});
+  policies_[SESSION_UNLOCKED] = {sinks_.front().stages, false, opts_.scrollMode};
+  policies_[SESSION_LOCKED] = {{{opts_.lockedTimeout, 0}}, true, opts_.scrollMode};
+  if (!opts_.displayPath.empty()) {
+	light_sink display = {SINK_DISPLAY, opts_.displayPath, {}, 0, 0, 0, {}, 0, {}, {}, {}};
+	if (opts_.displayDimAfter.count() > 0) {
+	  display.stages.push_back({opts_.displayDimAfter, opts_.displayDimPercent});
+	}
+	if (opts_.displayOffAfter.count() > 0) {
+	  display.stages.push_back({opts_.displayOffAfter, 0});
+	}
+	std::sort(display.stages.begin(), display.stages.end(),
+			  [](const sink_stage &a, const sink_stage &b) { return a.after < b.after; });
+	auto power = std::filesystem::path(opts_.displayPath).parent_path() / "bl_power";
+	if (std::filesystem::exists(power)) {
+	  display.powerPath = power;
+	}
+	sinks_.push_back(display);
+  }
+}
+
+// Without a profile the light is written synchronously and stepped at once
+void load_profile(light_sink &sink) {
+  auto file = sink_profile_path(opts_.profileDir, sink.path);
+  sink_profile profile;
+  if (opts_.profileDir.empty() || !load_sink_profile(file, profile)) {
+	return;
+  }
+  if (profile.path != sink.path || profile.maxLevel != sink.maxLevel) {
+	printf("%s does not fit the %s light, calibrate it again with -C\n",
+		   file.c_str(), SINK_TYPE_NAMES[sink.type]);
+	return;
+  }
+
+  sink.output.profile = profile;
+  if (profile.async) {
+	sink.output.writer = std::make_shared<sink_writer>(sink.path, sink.type, profile.verify);
+  }
+}
+
+void init_sink(light_sink &sink) {
+  sink.maxLevel = get_max_brightness(sink);
+  sink.powerModel = sink.type == SINK_KEYBOARD ? opts_.keyboardPowerMw : opts_.displayPowerMw;
+  sink.ledger.since = std::chrono::steady_clock::now();
+  load_profile(sink);
+}
+
+// Everything besides the lights, the devices and the stage timer
+void start_services() {
+  if ((opts_.useDbus || opts_.earlyWake || opts_.lockedTimeout.count() > 0) && dbus_open(opts_)) {
+	dbusSource_.fd = dbus_.fd();
+	loop_add(&dbusSource_, EPOLLIN);
+  }
+
+  if (!opts_.activitySocket.empty()) {
+	hubTimer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (hubTimer_.fd >= 0 && hub_.open(opts_.activitySocket, std::chrono::seconds(opts_.timeout))) {
+	  hubSource_.fd = hub_.fd();
+	  loop_add(&hubSource_, EPOLLIN);
+	  loop_add(&hubTimer_, EPOLLIN);
+	}
+  }
+
+  if (opts_.auditSeconds > 0) {
+	start_audit(opts_.auditSeconds);
+  }
+}
+
+bool engine_start(const options &opts) {
+  opts_ = opts;
+  if (!opts_.tracePath.empty() && !trace_.enabled()) {
+	trace_.enable(TRACE_CAPACITY);
+  }
+
+  build_sinks();
+  for (auto &sink : sinks_) {
+	if (!is_brightness_writable(sink.path) || !file_read_uint64(sink.path, &sink.onLevel)) {
+	  engine_stop();
+	  return false;
+	}
+	sink.current = sink.onLevel;
+	init_sink(sink);
+  }
+
+  if (!setup_event_loop()) {
+	engine_stop();
+	return false;
+  }
+  lastEvent_ = std::chrono::steady_clock::now();
+  lastKey_ = lastEvent_;
+
+  // The light is managed right away, devices join as soon as they are open
+  track_devices(opts_);
+  start_services();
+  arm_stage_timer();
+  return true;
+}
+
+/* Parked state, one record per line
+ *   last_event <ns of CLOCK_MONOTONIC>
+ *   sink <type> <on level> <current level> <stage> <path>
+ *   device <fd name or -> <wake only> <path>
+ * Devices without an fd are opened again, e.g. the ones which are backing off.
+ */
+const std::string PARKED_STATE_VERSION = "keyboard_backlight-state 1";
+
+std::vector<parked_fd> engine_park() {
+  // the next instance starts at the level the fade ends at
+  for (auto &sink : sinks_) {
+	if (sink.output.fading) {
+	  sink.output.fading = false;
+	  set_brightness(sink, sink.output.fadeTo);
+	}
+  }
+
+  lastEvent_ = std::max(lastEvent_, lastScroll_);
+  std::ostringstream state;
+  state << PARKED_STATE_VERSION << "\n"
+		<< "last_event " << std::chrono::duration_cast<std::chrono::nanoseconds>(lastEvent_.time_since_epoch()).count()
+		<< "\n";
+  for (const auto &sink : sinks_) {
+	state << "sink " << SINK_TYPE_NAMES[sink.type] << " " << sink.onLevel << " " << sink.current << " "
+		  << sink.stage << " " << sink.path << "\n";
+  }
+
+  std::vector<parked_fd> parked;
+  for (const auto &dev : devices_) {
+	if (dev.state == DEVICE_REMOVED) {
+	  continue;
+	}
+	// a quarantined device is masked, the next instance opens it again and checks it from scratch
+	std::string name = "-";
+	if (dev.state == DEVICE_ACTIVE || dev.state == DEVICE_MIRRORED) {
+	  int fd = fcntl(dev.source.fd, F_DUPFD_CLOEXEC, 3);
+	  if (fd >= 0) {
+		name = "input" + std::to_string(parked.size());
+		parked.push_back({name, fd});
+	  }
+	}
+	state << "device " << name << " " << dev.wakeOnly << " " << dev.path << "\n";
+  }
+
+  int timer = fcntl(timer_.fd, F_DUPFD_CLOEXEC, 3);
+  if (timer >= 0) {
+	parked.push_back({"timer", timer});
+  }
+
+  int fd = memfd_create("keyboard_backlight-state", MFD_CLOEXEC);
+  auto text = state.str();
+  if (fd < 0 || write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size())) {
+	perror("tp_kbd_backlight: parked state");
+	if (fd >= 0) {
+	  close(fd);
+	}
+	// the fds alone are no state
+	for (const auto &p : parked) {
+	  close(p.fd);
+	}
+	return {};
+  }
+  parked.push_back({"state", fd});
+  return parked;
+}
+
+std::string read_parked_state(int fd) {
+  std::string state;
+  char buf[4096];
+  ssize_t rd;
+  off_t offset = 0;
+  while ((rd = pread(fd, buf, sizeof(buf), offset)) > 0) {
+	state.append(buf, rd);
+	offset += rd;
+  }
+  return state;
+}
+
+/* Takes over the stage timer of the previous instance. It is re-armed for the
+ * current options unless it expired during the restart, then the expiry is
+ * handled like any other.
+ */
+void adopt_stage_timer(int fd) {
+  itimerspec spec = {};
+  if (fd < 0 || timerfd_gettime(fd, &spec) < 0) {
+	if (fd >= 0) {
+	  close(fd);
+	}
+	arm_stage_timer();
+	return;
+  }
+
+  loop_remove(&timer_);
+  close(timer_.fd);
+  timer_.fd = fd;
+  loop_add(&timer_, EPOLLIN);
+  pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, 0) > 0) {
+	timerArmed_ = true;
+  } else {
+	arm_stage_timer();
+  }
+}
+
+bool engine_resume(const options &opts, const std::vector<parked_fd> &fds) {
+  std::map<std::string, int> parked;
+  for (const auto &p : fds) {
+	// inherited fds are neither close on exec nor non blocking
+	fcntl(p.fd, F_SETFD, FD_CLOEXEC);
+	fcntl(p.fd, F_SETFL, fcntl(p.fd, F_GETFL) | O_NONBLOCK);
+	if (!parked.emplace(p.name, p.fd).second) {
+	  close(p.fd);
+	}
+  }
+  auto take = [&parked](const std::string &name) {
+	auto it = parked.find(name);
+	if (it == parked.end()) {
+	  return -1;
+	}
+	int fd = it->second;
+	parked.erase(it);
+	return fd;
+  };
+
+  opts_ = opts;
+  if (!opts_.tracePath.empty() && !trace_.enabled()) {
+	trace_.enable(TRACE_CAPACITY);
+  }
+  build_sinks();
+
+  int stateFd = take("state");
+  std::istringstream state(stateFd >= 0 ? read_parked_state(stateFd) : "");
+  if (stateFd >= 0) {
+	close(stateFd);
+  }
+
+  struct parked_device {
+	std::string path;
+	bool wakeOnly;
+	int fd;
+  };
+  std::vector<parked_device> devices;
+  auto closeUnused = [&parked, &devices]() {
+	for (const auto &p : parked) {
+	  close(p.second);
+	}
+	for (const auto &dev : devices) {
+	  if (dev.fd >= 0) {
+		close(dev.fd);
+	  }
+	}
+  };
+  std::set<size_t> restored;
+  lastEvent_ = std::chrono::steady_clock::now();
+  std::string line;
+  bool valid = std::getline(state, line) && line == PARKED_STATE_VERSION;
+  while (valid && std::getline(state, line)) {
+	std::istringstream record(line);
+	std::string kind;
+	record >> kind;
+	if (kind == "last_event") {
+	  long long ns = -1;
+	  record >> ns;
+	  valid = ns >= 0;
+	  lastEvent_ = std::min(std::chrono::time_point<std::chrono::steady_clock>(std::chrono::nanoseconds(ns)),
+							std::chrono::steady_clock::now());
+	} else if (kind == "sink") {
+	  std::string type, path;
+	  uint64_t onLevel, current;
+	  size_t stage;
+	  valid = static_cast<bool>(record >> type >> onLevel >> current >> stage >> std::ws)
+		  && std::getline(record, path);
+	  for (size_t i = 0; valid && i < sinks_.size(); ++i) {
+		if (type == SINK_TYPE_NAMES[sinks_[i].type] && path == sinks_[i].path) {
+		  sinks_[i].onLevel = onLevel;
+		  sinks_[i].current = current;
+		  // the timeline may have fewer stages now
+		  sinks_[i].stage = std::min(stage, sinks_[i].stages.size());
+		  restored.insert(i);
+		}
+	  }
+	} else if (kind == "device") {
+	  std::string name, path;
+	  bool wakeOnly;
+	  valid = static_cast<bool>(record >> name >> wakeOnly >> std::ws) && std::getline(record, path);
+	  if (valid) {
+		devices.push_back({path, wakeOnly, name == "-" ? -1 : take(name)});
+	  }
+	}
+  }
+
+  lastKey_ = lastEvent_;
+  // another light than the parked one is started from scratch
+  if (!valid || restored.size() != sinks_.size() || !setup_event_loop()) {
+	closeUnused();
+	engine_stop();
+	return false;
+  }
+  for (auto &sink : sinks_) {
+	init_sink(sink);
+  }
+
+  // The devices are probed on their open fds, events of the restart are still queued in them
+  for (const auto &dev : devices) {
+	track_device(dev.path, dev.wakeOnly, opts_, dev.fd);
+  }
+  devices.clear();
+  adopt_stage_timer(take("timer"));
+  closeUnused();
+  start_services();
+  return true;
+}
+
+void engine_stop() {
+  for (auto &sink : sinks_) {
+	account_energy(sink);
+	if (sink.ledger.alwaysOnMj > 0) {
+	  printf("The %s light used %.1f mWh instead of %.1f mWh (estimated)\n", SINK_TYPE_NAMES[sink.type],
+			 sink.ledger.usedMj / 3600, sink.ledger.alwaysOnMj / 3600);
+	}
+  }
+  for (auto &dev : devices_) {
+	close_source(dev.source);
+  }
+  devices_.clear();
+  sinks_.clear();
+  timerArmed_ = false;
+  rejectedNodes_.clear();
+  devicesFinished_ = false;
+  deviceTimerChanged_ = false;
+  lastPhysicalKey_ = {};
+  hostSources_.clear();
+
+  if (dbusSource_.fd >= 0) {
+	dbus_.close();
+	dbusSource_.fd = -1;
+  }
+  dbusWantsWrite_ = false;
+  upowerOwner_.clear();
+  upowerEchoes_.clear();
+  activeSession_.clear();
+  sessionState_ = SESSION_UNLOCKED;
+  policies_ = {};
+
+  // the eventfd is closed by the last running probe
+  prober_ = device_prober();
+  probeSource_.fd = -1;
+  hub_.close();
+  hubSource_.fd = -1;
+  hubTimerArmed_ = false;
+
+  // nothing of this instance is carried over to the next one
+  auditCounters_ = {};
+  auditStart_ = {};
+  lastAudit_.clear();
+  std::fill(std::begin(wakeStats_), std::end(wakeStats_), wake_stats{});
+  idleHistogram_ = idle_histogram();
+  earlyWakeTrigger_ = WAKE_INPUT;
+  earlyWakeTime_ = {};
+  lastScroll_ = {};
+  lastScrollActivity_ = {};
+  scrollStats_ = {};
+  lastEvent_ = {};
+  lastKey_ = {};
+  trace_.disable();
+  recorder_.clear();
+  opts_ = options();
+  for (auto source : {&timer_, &auditTimer_, &probeTimer_, &deviceTimer_, &hotplug_, &hubTimer_, &fadeTimer_}) {
+	close_source(*source);
+  }
+  if (epollFd_ >= 0) {
+	close(epollFd_);
+	epollFd_ = -1;
+  }
+}
+
+int engine_fd() {
+  return epollFd_;
+}
+
+bool engine_watch(int fd, std::function<void()> handler) {
+  hostSources_.push_back({{SOURCE_HOST, fd}, std::move(handler)});
+  hostSources_.back().source.owner = &hostSources_.back();
+  return loop_add(&hostSources_.back().source, EPOLLIN);
+}
+
+void engine_notify_activity() {
+  on_activity(WAKE_INPUT, std::chrono::steady_clock::now());
+}
+
+void engine_write_status() {
+  write_status(opts_);
+  if (trace_.enabled() && !trace_.write(opts_.tracePath)) {
+	printf("Failed to write trace to %s\n", opts_.tracePath.c_str());
+  }
+}
+
+void engine_start_audit(unsigned long seconds) {
+  start_audit(seconds);
+}
+
+void add_ignored_devices(options &opts, const std::string &devices) {
+  std::istringstream ss(devices);
+  std::string token;
+  while (std::getline(ss, token, ' ')) {
+	opts.ignoredDevices.push_back(token);
+
+	// if the device is a symlink add the actual target to the
+	// ignored device list too, relative links are resolved against
+	// their directory, not the working directory
+	std::error_code ec;
+	auto node = std::filesystem::canonical(token, ec);
+	if (!ec) {
+	  opts.ignoredDevices.push_back(node);
+	}
+  }
+}
+
+const std::map<std::string, uint16_t> BUS_NAMES = {
+	{"usb", BUS_USB},
+	{"bluetooth", BUS_BLUETOOTH},
+	{"virtual", BUS_VIRTUAL},
+	{"i8042", BUS_I8042},
+	{"i2c", BUS_I2C},
+	{"host", BUS_HOST},
+};
+
+bool parse_device_id(const std::string &text, uint16_t &id) {
+  char *end;
+  unsigned long val = strtoul(text.c_str(), &end, 16);
+  if (text.empty() || *end != '\0' || val > UINT16_MAX) {
+	return false;
+  }
+  id = static_cast<uint16_t>(val);
+  return true;
+}
+
+bool add_device_rule(std::vector<device_rule> &rules, const std::string &text) {
+  device_rule rule;
+  rule.text = text;
+  std::istringstream ss(text);
+  std::string token;
+  while (std::getline(ss, token, ',')) {
+	auto eq = token.find('=');
+	if (eq == std::string::npos) {
+	  return false;
+	}
+	std::string key = token.substr(0, eq);
+	std::string value = token.substr(eq + 1);
+
+	rule_term term = {};
+	if (key == "bus") {
+	  term.field = RULE_BUS;
+	  auto it = BUS_NAMES.find(value);
+	  if (it != BUS_NAMES.end()) {
+		term.id = it->second;
+	  } else if (!parse_device_id(value, term.id)) {
+		return false;
+	  }
+	} else if (key == "vendor" || key == "product") {
+	  term.field = key == "vendor" ? RULE_VENDOR : RULE_PRODUCT;
+	  if (!parse_device_id(value, term.id)) {
+		return false;
+	  }
+	} else if (key == "name" || key == "phys" || key == "uniq") {
+	  term.field = key == "name" ? RULE_NAME : key == "phys" ? RULE_PHYS : RULE_UNIQ;
+	  term.pattern = value;
+	} else {
+	  return false;
+	}
+	rule.terms.push_back(term);
+  }
+
+  if (rule.terms.empty()) {
+	return false;
+  }
+  rules.push_back(rule);
+  return true;
+}
+
+bool set_class_filter(options &opts, const std::string &text) {
+  auto eq = text.find('=');
+  if (eq == std::string::npos) {
+	return false;
+  }
+  std::string name = text.substr(0, eq);
+  std::string filterName = text.substr(eq + 1);
+  std::string deadzone;
+  auto colon = filterName.find(':');
+  if (colon != std::string::npos) {
+	deadzone = filterName.substr(colon + 1);
+	filterName = filterName.substr(0, colon);
+  }
+
+  auto deviceClass = std::find_if(std::begin(DEVICE_CLASS_NAMES), std::end(DEVICE_CLASS_NAMES),
+								  [&name](const char *n) { return name == n; });
+  auto filter = std::find_if(std::begin(CLASS_FILTER_NAMES), std::end(CLASS_FILTER_NAMES),
+							 [&filterName](const char *n) { return filterName == n; });
+  if (deviceClass == std::end(DEVICE_CLASS_NAMES) || filter == std::end(CLASS_FILTER_NAMES)) {
+	return false;
+  }
+
+  auto c = static_cast<DEVICE_CLASS>(deviceClass - std::begin(DEVICE_CLASS_NAMES));
+  auto f = static_cast<CLASS_FILTER>(filter - std::begin(CLASS_FILTER_NAMES));
+  if ((f == CLASS_FILTER_PROXIMITY && c != CLASS_TABLET)
+	  || (f == CLASS_FILTER_DEADZONE && c != CLASS_GAMEPAD)
+	  || (!deadzone.empty() && f != CLASS_FILTER_DEADZONE)) {
+	return false;
+  }
+  if (!deadzone.empty()) {
+	char *end;
+	unsigned long percent = strtoul(deadzone.c_str(), &end, 10);
+	if (*end != '\0' || percent > 100) {
+	  return false;
+	}
+	opts.gamepadDeadzone = static_cast<unsigned int>(percent);
+  }
+  opts.classFilters[c] = f;
+  return true;
+}
+
+bool set_power_model(options &opts, const std::string &text) {
+  auto eq = text.find('=');
+  if (eq == std::string::npos) {
+	return false;
+  }
+  std::string sink = text.substr(0, eq);
+  std::vector<unsigned int> model;
+  std::istringstream ss(text.substr(eq + 1));
+  std::string token;
+  while (std::getline(ss, token, ',')) {
+	char *end;
+	unsigned long mw = strtoul(token.c_str(), &end, 10);
+	if (token.empty() || *end != '\0' || mw > UINT32_MAX) {
+	  return false;
+	}
+	model.push_back(static_cast<unsigned int>(mw));
+  }
+
+  if (model.empty()) {
+	return false;
+  }
+  if (sink == SINK_TYPE_NAMES[SINK_KEYBOARD]) {
+	opts.keyboardPowerMw = model;
+  } else if (sink == SINK_TYPE_NAMES[SINK_DISPLAY]) {
+	opts.displayPowerMw = model;
+  } else {
+	return false;
+  }
+  return true;
+}
+
+bool device_rule_matches(const device_rule &rule, const device_identity &identity) {
+  for (const auto &term : rule.terms) {
+	bool match = false;
+	switch (term.field) {
+	  case RULE_BUS:
+		match = identity.bus == term.id;
+		break;
+	  case RULE_VENDOR:
+		match = identity.vendor == term.id;
+		break;
+	  case RULE_PRODUCT:
+		match = identity.product == term.id;
+		break;
+	  case RULE_NAME:
+		match = fnmatch(term.pattern.c_str(), identity.name.c_str(), 0) == 0;
+		break;
+	  case RULE_PHYS:
+		match = fnmatch(term.pattern.c_str(), identity.phys.c_str(), 0) == 0;
+		break;
+	  case RULE_UNIQ:
+		match = fnmatch(term.pattern.c_str(), identity.uniq.c_str(), 0) == 0;
+		break;
+	}
+	if (!match) {
+	  return false;
+	}
+  }
+  return true;
+}
+
+bool add_ignored_keys(options &opts, const std::string &keys) {
+  std::istringstream ss(keys);
+  std::string token;
+  while (std::getline(ss, token, ',')) {
+	char *end;
+	long key = strtol(token.c_str(), &end, 0);
+	if (token.empty() || *end != '\0') {
+	  return false;
+	}
+	opts.ignoredKeys[static_cast<int>(key)] = true;
+  }
+  return true;
+}
+
+// The handle carries no state, the engine is a singleton
+struct kbd_backlight {
+};
+
+kbd_backlight instance_;
+bool instanceUsed_ = false;
+
+void kbd_backlight_config_init(kbd_backlight_config *config) {
+  options defaults;
+  *config = {};
+  config->timeout = defaults.timeout;
+  config->mouse_mode = defaults.mouseMode;
+  config->scroll_mode = defaults.scrollMode;
+  config->tolerance_ms = defaults.tolerance.count();
+  config->display_dim = std::chrono::duration_cast<std::chrono::seconds>(defaults.displayDimAfter).count();
+  config->display_off = std::chrono::duration_cast<std::chrono::seconds>(defaults.displayOffAfter).count();
+  config->display_dim_percent = defaults.displayDimPercent;
+}
+
+kbd_backlight *kbd_backlight_new(const kbd_backlight_config *config) {
+  if (instanceUsed_) {
+	return nullptr;
+  }
+
+  options opts;
+  if (config->backlight_path != nullptr) {
+	opts.backlightPath = config->backlight_path;
+  }
+  if (config->status_path != nullptr) {
+	opts.statusPath = config->status_path;
+  }
+  if (config->activity_socket != nullptr) {
+	opts.activitySocket = config->activity_socket;
+  }
+  if (config->profile_dir != nullptr) {
+	opts.profileDir = config->profile_dir;
+  }
+  if (config->display_path != nullptr) {
+	opts.displayPath = config->display_path;
+	opts.displayDimAfter = std::chrono::seconds(config->display_dim);
+	opts.displayOffAfter = std::chrono::seconds(config->display_off);
+	opts.displayDimPercent = config->display_dim_percent;
+  }
+  if (config->timeout == 0 || config->mouse_mode < ALL || config->mouse_mode > NONE
+	  || config->scroll_mode < SCROLL_WAKE || config->scroll_mode > SCROLL_IGNORE) {
+	return nullptr;
+  }
+  opts.timeout = config->timeout;
+  opts.lockedTimeout = std::chrono::seconds(config->locked_timeout);
+  opts.mouseMode = static_cast<MOUSE_MODE>(config->mouse_mode);
+  opts.scrollMode = static_cast<SCROLL_MODE>(config->scroll_mode);
+  opts.tolerance = std::chrono::milliseconds(config->tolerance_ms);
+  opts.earlyWake = config->early_wake != 0;
+  if (config->ignored_devices != nullptr) {
+	add_ignored_devices(opts, config->ignored_devices);
+  }
+  if (config->ignored_keys != nullptr && !add_ignored_keys(opts, config->ignored_keys)) {
+	return nullptr;
+  }
+  for (auto rule = config->ignore_rules; rule != nullptr && *rule != nullptr; rule++) {
+	if (!add_device_rule(opts.ignoreRules, *rule)) {
+	  return nullptr;
+	}
+  }
+  for (auto rule = config->include_rules; rule != nullptr && *rule != nullptr; rule++) {
+	if (!add_device_rule(opts.includeRules, *rule)) {
+	  return nullptr;
+	}
+  }
+  for (auto filter = config->class_filters; filter != nullptr && *filter != nullptr; filter++) {
+	if (!set_class_filter(opts, *filter)) {
+	  return nullptr;
+	}
+  }
+  for (auto model = config->power_models; model != nullptr && *model != nullptr; model++) {
+	if (!set_power_model(opts, *model)) {
+	  return nullptr;
+	}
+  }
+
+  if (!engine_start(opts)) {
+	return nullptr;
+  }
+  instanceUsed_ = true;
+  return &instance_;
+}
+
+int kbd_backlight_get_fd(const kbd_backlight *) {
+  return engine_fd();
+}
+
+int kbd_backlight_dispatch(kbd_backlight *) {
+  return engine_dispatch(0) ? 0 : -1;
+}
+
+void kbd_backlight_notify_activity(kbd_backlight *) {
+  engine_notify_activity();
+}
+
+void kbd_backlight_write_status(kbd_backlight *) {
+  engine_write_status();
+}
+
+int kbd_backlight_dump_flight(kbd_backlight *, const char *path) {
+  return recorder_.dump(path, "requested") ? 0 : -1;
+}
+
+void kbd_backlight_free(kbd_backlight *kb) {
+  if (kb != &instance_) {
+	return;
+  }
+  engine_stop();
+  instanceUsed_ = false;
+}
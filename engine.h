@@ -0,0 +1,232 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Engine of the service: device discovery, input filters, the timeout policy
+ * and the brightness sink. It runs on a single epoll fd which is driven by
+ * the daemon or, through the C API in kbd_backlight.h, by a host process.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_ENGINE_H
+#define KBD_BACKLIGHT_ENGINE_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#if DEBUG
+#define print_debug(fmt, ...) printf("%s:%d: " fmt, __FILE__, __LINE__, __VA_ARGS__)
+#define print_debug_n(fmt) printf("%s:%d: " fmt, __FILE__, __LINE__)
+#else
+#define print_debug(...)
+#define print_debug_n(...)
+#endif
+
+const std::string DEFAULT_BACKLIGHT_PATH = "/sys/class/leds/tpacpi::kbd_backlight/brightness";
+const std::string DEFAULT_STATUS_PATH = "/run/keyboard_backlight.status";
+const std::string DEFAULT_FLIGHT_PATH = "/run/keyboard_backlight.flight";
+const std::string DEFAULT_PROFILE_DIR = "/var/lib/keyboard_backlight";
+const unsigned long DEFAULT_AUDIT_SECONDS = 60;
+
+enum MOUSE_MODE {
+  ALL = 0,
+  INTERNAL = 1,
+  NONE = 2
+};
+
+// What the wheel and two finger scrolling do, reading a long document is only scrolling
+enum SCROLL_MODE {
+  // turns the lights on and keeps them on like other input
+  SCROLL_WAKE = 0,
+  // keeps the lights which are on from timing out, does not turn any on
+  SCROLL_KEEP = 1,
+  SCROLL_IGNORE = 2
+};
+
+// Input devices which are neither keyboards nor mice, told apart by their capabilities
+enum DEVICE_CLASS {
+  CLASS_TABLET = 0,
+  CLASS_GAMEPAD = 1,
+  CLASS_TRACKPOINT = 2,
+  CLASS_COUNT = 3,
+  CLASS_NONE = CLASS_COUNT
+};
+
+// Which events of a class device turn the light on
+enum CLASS_FILTER {
+  // not opened, unless the mouse mode picks it
+  CLASS_FILTER_OFF = 0,
+  CLASS_FILTER_ALL = 1,
+  // button presses only
+  CLASS_FILTER_BUTTONS = 2,
+  // tablets: a pen coming into range, or a button press
+  CLASS_FILTER_PROXIMITY = 3,
+  // gamepads: sticks moved out of the deadzone, or a button press
+  CLASS_FILTER_DEADZONE = 4
+};
+
+// Read from the device itself, unlike the node path it survives reboots and replugging
+struct device_identity {
+  uint16_t bus = 0;
+  uint16_t vendor = 0;
+  uint16_t product = 0;
+  std::string name;
+  std::string phys;
+  std::string uniq;
+};
+
+enum RULE_FIELD {
+  RULE_BUS = 0,
+  RULE_VENDOR = 1,
+  RULE_PRODUCT = 2,
+  RULE_NAME = 3,
+  RULE_PHYS = 4,
+  RULE_UNIQ = 5
+};
+
+struct rule_term {
+  RULE_FIELD field;
+  // bus, vendor and product
+  uint16_t id = 0;
+  // name, phys and uniq, a shell wildcard pattern
+  std::string pattern;
+};
+
+// Matches a device if all of its terms match
+struct device_rule {
+  std::vector<rule_term> terms;
+  std::string text;
+};
+
+struct options {
+  std::vector<std::string> ignoredDevices;
+  std::vector<device_rule> ignoreRules;
+  // devices used even if they are neither a keyboard nor a mouse
+  std::vector<device_rule> includeRules;
+  unsigned long timeout = 15;
+  // of the keyboard light while the session is locked, logind is not followed if 0
+  std::chrono::seconds lockedTimeout = std::chrono::seconds(0);
+  MOUSE_MODE mouseMode = MOUSE_MODE::ALL;
+  SCROLL_MODE scrollMode = SCROLL_WAKE;
+  std::array<CLASS_FILTER, CLASS_COUNT> classFilters = {CLASS_FILTER_OFF, CLASS_FILTER_OFF, CLASS_FILTER_OFF};
+  // percent of the half axis range around the resting position
+  unsigned int gamepadDeadzone = 20;
+  std::string backlightPath = DEFAULT_BACKLIGHT_PATH;
+  bool foreground = false;
+  long setBrightness = -1;
+  // measure the lights, save their profiles and exit
+  bool calibrate = false;
+  // profiles of the lights, see sink_profile.h
+  std::string profileDir = DEFAULT_PROFILE_DIR;
+  std::map<int, bool> ignoredKeys;
+  bool showPressedKeys = false;
+  bool useDbus = false;
+  bool earlyWake = false;
+  std::string statusPath = DEFAULT_STATUS_PATH;
+  // dump of the flight recorder, written on SIGUSR2 and when the daemon crashes
+  std::string flightPath = DEFAULT_FLIGHT_PATH;
+  std::chrono::milliseconds tolerance = std::chrono::milliseconds(500);
+  unsigned long auditSeconds = 0;
+  std::string tracePath;
+  // unix socket of the activity hub, disabled if empty
+  std::string activitySocket;
+  // display backlight, not managed if empty
+  std::string displayPath;
+  std::chrono::seconds displayDimAfter = std::chrono::seconds(60);
+  unsigned int displayDimPercent = 30;
+  std::chrono::seconds displayOffAfter = std::chrono::seconds(300);
+  // mW of the light, the points are spread evenly from level 0 to max_brightness.
+  // Rough values, measure the own machine for real numbers.
+  std::vector<unsigned int> keyboardPowerMw = {0, 250, 500};
+  std::vector<unsigned int> displayPowerMw = {0, 3000};
+};
+
+// Separated by space, symlinks are resolved
+void add_ignored_devices(options &opts, const std::string &devices);
+/* key=value pairs separated by comma, e.g. 'vendor=046d,product=c52b'
+ * or 'bus=bluetooth,name=*Keyboard*'. Returns false if the rule is invalid.
+ */
+bool add_device_rule(std::vector<device_rule> &rules, const std::string &text);
+bool device_rule_matches(const device_rule &rule, const device_identity &identity);
+/* class=filter, e.g. 'tablet=proximity' or 'gamepad=deadzone:30'
+ * Returns false if the class or the filter is unknown or does not fit the class.
+ */
+bool set_class_filter(options &opts, const std::string &text);
+/* sink=mW,mW,..., e.g. 'keyboard=0,200,450' or 'display=0,2800'
+ * Returns false if the sink is unknown or a value is not a number.
+ */
+bool set_power_model(options &opts, const std::string &text);
+// Separated by comma, returns false if a value is not a number
+bool add_ignored_keys(options &opts, const std::string &keys);
+
+bool file_read_uint64(const std::string &filename, uint64_t *val);
+bool file_write_uint64(const std::string &filename, uint64_t val);
+bool is_brightness_writable(const std::string &brightnessPath);
+
+// Returns the number of keyboards found
+size_t discover_devices(const options &opts,
+						std::vector<std::string> &inputDevices,
+						std::vector<std::string> &wakeDevices);
+
+/* Only one engine runs per process.
+ * Starting it opens the devices in the background and takes over the light.
+ */
+bool engine_start(const options &opts);
+void engine_stop();
+
+// Open fd handed to the next instance, e.g. through the systemd file descriptor store
+struct parked_fd {
+  // unique, at most 255 printable characters without ':'
+  std::string name;
+  int fd;
+};
+
+/* Duplicates of the open input devices and of the stage timer, and a memfd
+ * with the state of the lights. The caller closes them.
+ */
+std::vector<parked_fd> engine_park();
+/* Starts with the fds parked by the previous instance instead of discovering
+ * the devices and reading the lights. All fds are taken over or closed.
+ * Returns false without starting if they do not fit the options, e.g. the
+ * light is another one now.
+ */
+bool engine_resume(const options &opts, const std::vector<parked_fd> &fds);
+// Readable when dispatch has work to do
+int engine_fd();
+// Handles the pending events, waits up to timeoutMs for them (-1 forever)
+bool engine_dispatch(int timeoutMs);
+// The handler is called from dispatch when fd is readable
+bool engine_watch(int fd, std::function<void()> handler);
+// Input the engine does not see itself, e.g. from the compositor of a host
+void engine_notify_activity();
+// Writes the status report and the trace if one is recorded
+void engine_write_status();
+void engine_start_audit(unsigned long seconds);
+
+#endif //KBD_BACKLIGHT_ENGINE_H
@@ -0,0 +1,260 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Activity hub for other local idle consumers.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#include "hub.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// Limits how exactly the timing of key presses can be observed, too
+const std::chrono::milliseconds NOTIFY_INTERVAL = std::chrono::milliseconds(100);
+const size_t MAX_CLIENTS = 32;
+const std::string IDLE_AFTER_REQUEST = "idle-after ";
+
+}
+
+activity_hub::~activity_hub() {
+  close();
+}
+
+bool activity_hub::open(const std::string &path, std::chrono::milliseconds idleAfter) {
+  sockaddr_un addr = {};
+  if (path.size() >= sizeof(addr.sun_path)) {
+	printf("Activity socket path %s is too long\n", path.c_str());
+	return false;
+  }
+
+  idleAfter_ = idleAfter;
+  lastActivity_ = std::chrono::steady_clock::now();
+  lastNotify_ = lastActivity_ - NOTIFY_INTERVAL;
+  listenFd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (listenFd_ < 0 || epollFd_ < 0) {
+	perror("tp_kbd_backlight: activity socket");
+	close();
+	return false;
+  }
+
+  // A stale socket of a previous run would make bind fail
+  unlink(path.c_str());
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  if (bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+	  || listen(listenFd_, 8) < 0) {
+	perror("tp_kbd_backlight: activity socket");
+	close();
+	return false;
+  }
+  path_ = path;
+  // Idle tools of the users connect to it, they only learn when input happened
+  chmod(path.c_str(), 0666);
+
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev);
+  return true;
+}
+
+void activity_hub::close() {
+  while (!clients_.empty()) {
+	drop(clients_.front());
+  }
+  if (listenFd_ >= 0) {
+	::close(listenFd_);
+	listenFd_ = -1;
+  }
+  if (epollFd_ >= 0) {
+	::close(epollFd_);
+	epollFd_ = -1;
+  }
+  if (!path_.empty()) {
+	unlink(path_.c_str());
+	path_.clear();
+  }
+}
+
+void activity_hub::dispatch(time_point now) {
+  epoll_event events[8];
+  int count = epoll_wait(epollFd_, events, 8, 0);
+  for (int i = 0; i < count; ++i) {
+	auto c = static_cast<client *>(events[i].data.ptr);
+	if (c == nullptr) {
+	  accept_clients(now);
+	} else if ((events[i].events & (EPOLLHUP | EPOLLERR)) || !read_client(*c, now)) {
+	  drop(*c);
+	}
+  }
+}
+
+bool activity_hub::activity(time_point now) {
+  lastActivity_ = now;
+  bool woke = false;
+  for (auto it = clients_.begin(); it != clients_.end();) {
+	auto &c = *it++;
+	if (c.idle) {
+	  c.idle = false;
+	  woke = true;
+	  if (!send(c, "active")) {
+		drop(c);
+	  }
+	}
+  }
+
+  if (now - lastNotify_ >= NOTIFY_INTERVAL) {
+	lastNotify_ = now;
+	uint64_t one = 1;
+	for (const auto &c : clients_) {
+	  if (write(c.eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		perror("tp_kbd_backlight: activity eventfd");
+	  }
+	}
+  }
+  return woke;
+}
+
+activity_hub::time_point activity_hub::expire(time_point now) {
+  auto next = time_point::max();
+  for (auto it = clients_.begin(); it != clients_.end();) {
+	auto &c = *it++;
+	if (c.idle) {
+	  continue;
+	}
+	if (!is_idle(c, now)) {
+	  next = std::min(next, lastActivity_ + c.idleAfter);
+	  continue;
+	}
+	c.idle = true;
+	if (!send(c, "idle")) {
+	  drop(c);
+	}
+  }
+  return next;
+}
+
+void activity_hub::accept_clients(time_point now) {
+  while (true) {
+	int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+	  return;
+	}
+	if (clients_.size() >= MAX_CLIENTS) {
+	  ::close(fd);
+	  continue;
+	}
+
+	int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd < 0) {
+	  perror("tp_kbd_backlight: activity eventfd");
+	  ::close(fd);
+	  continue;
+	}
+
+	clients_.push_back({fd, eventFd, idleAfter_, false});
+	auto &c = clients_.back();
+	c.idle = is_idle(c, now);
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &c;
+	epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+	if (!send(c, c.idle ? "idle" : "active", eventFd)) {
+	  drop(c);
+	}
+  }
+}
+
+bool activity_hub::read_client(client &c, time_point now) {
+  char buf[64];
+  ssize_t rd = recv(c.fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+  if (rd <= 0) {
+	return rd < 0 && errno == EAGAIN;
+  }
+
+  std::string msg(buf, rd);
+  if (msg.rfind(IDLE_AFTER_REQUEST, 0) != 0) {
+	return false;
+  }
+
+  char *end;
+  auto ms = strtoul(msg.c_str() + IDLE_AFTER_REQUEST.size(), &end, 10);
+  if (*end != '\0' || ms == 0) {
+	return false;
+  }
+  c.idleAfter = std::chrono::milliseconds(ms);
+
+  // the new idle time can make the client idle right away, or active again
+  bool idle = is_idle(c, now);
+  if (idle != c.idle) {
+	c.idle = idle;
+	return send(c, idle ? "idle" : "active");
+  }
+  return true;
+}
+
+bool activity_hub::send(client &c, const std::string &msg, int passFd) {
+  iovec iov = {const_cast<char *>(msg.data()), msg.size()};
+  msghdr hdr = {};
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  if (passFd >= 0) {
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+	auto cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+  }
+
+  // A client which does not read its messages is dropped
+  return sendmsg(c.fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL) == static_cast<ssize_t>(msg.size());
+}
+
+void activity_hub::drop(client &c) {
+  epoll_ctl(epollFd_, EPOLL_CTL_DEL, c.fd, nullptr);
+  ::close(c.fd);
+  ::close(c.eventFd);
+  clients_.remove_if([&c](const client &other) { return &other == &c; });
+}
+
+bool activity_hub::is_idle(const client &c, time_point now) const {
+  return now - lastActivity_ >= c.idleAfter;
+}
@@ -0,0 +1,89 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Activity hub, hands the input activity seen by the service to other local
+ * idle consumers so they do not have to read the input devices themselves.
+ *
+ * Clients connect to a SOCK_SEQPACKET unix socket. The first message they
+ * receive is the current state, "active" or "idle", and carries an eventfd
+ * (SCM_RIGHTS) which is incremented on input, at most every 100ms.
+ * After that "active" and "idle" are sent on every change. A client can
+ * send "idle-after <ms>" to use its own idle time instead of the timeout.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_HUB_H
+#define KBD_BACKLIGHT_HUB_H
+
+#include <chrono>
+#include <list>
+#include <string>
+
+class activity_hub {
+ public:
+  using time_point = std::chrono::time_point<std::chrono::steady_clock>;
+
+  activity_hub() = default;
+  activity_hub(const activity_hub &) = delete;
+  activity_hub &operator=(const activity_hub &) = delete;
+  ~activity_hub();
+
+  bool open(const std::string &path, std::chrono::milliseconds idleAfter);
+  void close();
+  bool is_open() const { return listenFd_ >= 0; }
+
+  // Readable when a client connects, sends a message or hangs up
+  int fd() const { return epollFd_; }
+  void dispatch(time_point now);
+
+  // Returns true if a client became active, its idle deadline needs a timer
+  bool activity(time_point now);
+  // Sends the idle edges which are due and returns the next deadline
+  time_point expire(time_point now);
+
+  size_t clients() const { return clients_.size(); }
+
+ private:
+  struct client {
+	int fd;
+	int eventFd;
+	std::chrono::milliseconds idleAfter;
+	bool idle;
+  };
+
+  void accept_clients(time_point now);
+  bool read_client(client &c, time_point now);
+  bool send(client &c, const std::string &msg, int passFd = -1);
+  void drop(client &c);
+  bool is_idle(const client &c, time_point now) const;
+
+  std::string path_;
+  int listenFd_ = -1;
+  int epollFd_ = -1;
+  std::chrono::milliseconds idleAfter_{0};
+  std::list<client> clients_;
+  time_point lastActivity_;
+  time_point lastNotify_;
+};
+
+#endif //KBD_BACKLIGHT_HUB_H
@@ -25,49 +25,141 @@
 *  SOFTWARE.
  */
 
-#include <linux/input.h>
-#include <fcntl.h>
 #include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "engine.h"
+#include "recorder.h"
+#include "sink_profile.h"
 
 #include <cstdio>
 #include <cstdlib>
-#include <cstdint>
+#include <cstring>
 
 #include <algorithm>
-#include <vector>
-#include <string>
-#include <sstream>
-#include <iostream>
-#include <filesystem>
-#include <regex>
-#include <future>
 #include <csignal>
-#include <fstream>
-#include <thread>
+#include <iostream>
+#include <string>
+#include <vector>
 
-using namespace std::chrono_literals;
+bool end_ = false;
 
-std::chrono::time_point<std::chrono::system_clock> lastEvent_;
-uint64_t originalBrightness_;
-uint64_t currentBrightness_;
+/* sd_notify without libsystemd, does nothing if the service is not started by systemd.
+ * fd is sent along if it is not -1, e.g. for the file descriptor store.
+ */
+void notify_systemd(const std::string &state, int fd = -1) {
+  const char *socketPath = getenv("NOTIFY_SOCKET");
+  if (socketPath == nullptr || (socketPath[0] != '/' && socketPath[0] != '@')) {
+	return;
+  }
 
-bool end_ = false;
-const std::string DEFAULT_BACKLIGHT_PATH = "/sys/class/leds/tpacpi::kbd_backlight/brightness";
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  size_t len = strlen(socketPath);
+  if (len >= sizeof(addr.sun_path)) {
+	return;
+  }
+  memcpy(addr.sun_path, socketPath, len);
+  if (addr.sun_path[0] == '@') {
+	// abstract namespace
+	addr.sun_path[0] = '\0';
+  }
+
+  int socketFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (socketFd < 0) {
+	return;
+  }
+  iovec iov = {const_cast<char *>(state.data()), state.size()};
+  msghdr msg = {};
+  msg.msg_name = &addr;
+  msg.msg_namelen = offsetof(sockaddr_un, sun_path) + len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  if (fd >= 0) {
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  if (sendmsg(socketFd, &msg, MSG_NOSIGNAL) < 0) {
+	perror("tp_kbd_backlight: sd_notify");
+  }
+  close(socketFd);
+}
+
+/* fds of the previous instance from the systemd file descriptor store, see
+ * sd_listen_fds(3). Empty unless they were passed to this process.
+ */
+std::vector<parked_fd> listen_fds() {
+  const char *pidText = getenv("LISTEN_PID");
+  const char *countText = getenv("LISTEN_FDS");
+  const char *namesText = getenv("LISTEN_FDNAMES");
+  if (pidText == nullptr || countText == nullptr || strtol(pidText, nullptr, 10) != getpid()) {
+	return {};
+  }
 
+  std::vector<parked_fd> fds;
+  std::string names = namesText != nullptr ? namesText : "";
+  long count = strtol(countText, nullptr, 10);
+  size_t start = 0;
+  for (long i = 0; i < count; ++i) {
+	size_t end = std::min(names.find(':', start), names.size());
+	fds.push_back({start < names.size() ? names.substr(start, end - start) : "", static_cast<int>(3 + i)});
+	start = end + 1;
+  }
+  // not for the children
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  return fds;
+}
 
-enum MOUSE_MODE {
-  ALL = 0,
-  INTERNAL = 1,
-  NONE = 2
-};
+// Hands the devices and the state to the next instance, systemd keeps them while the service restarts
+void park_fds() {
+  if (getenv("NOTIFY_SOCKET") == nullptr) {
+	return;
+  }
+  for (const auto &parked : engine_park()) {
+	notify_systemd("FDSTORE=1\nFDNAME=" + parked.name, parked.fd);
+	close(parked.fd);
+  }
+}
 
-#if DEBUG
-#define print_debug(fmt, ...) printf("%s:%d: " fmt, __FILE__, __LINE__, __VA_ARGS__)
-#define print_debug_n(fmt) printf("%s:%d: " fmt, __FILE__, __LINE__)
-#else
-#define print_debug(...)
-#define print_debug_n(...)
-#endif
+/* Pings the systemd watchdog from the event loop at half its interval.
+ * A stuck loop misses the pings, systemd then sends SIGABRT and the
+ * flight recorder is dumped. Returns -1 if no watchdog is configured.
+ */
+int start_watchdog() {
+  const char *usecText = getenv("WATCHDOG_USEC");
+  const char *pidText = getenv("WATCHDOG_PID");
+  if (usecText == nullptr || (pidText != nullptr && strtol(pidText, nullptr, 10) != getpid())) {
+	return -1;
+  }
+  unsigned long long usec = strtoull(usecText, nullptr, 10);
+  if (usec == 0) {
+	return -1;
+  }
+
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+	perror("tp_kbd_backlight: timerfd_create");
+	return -1;
+  }
+  itimerspec spec = {};
+  spec.it_interval.tv_sec = static_cast<time_t>(usec / 2 / 1000000);
+  spec.it_interval.tv_nsec = static_cast<long>(usec / 2 % 1000000 * 1000);
+  spec.it_value = spec.it_interval;
+  timerfd_settime(fd, 0, &spec, nullptr);
+  return fd;
+}
 
 void help(const char *name) {
   printf("%s %s \n", name, VERSION);
@@ -76,327 +168,109 @@ void help(const char *name) {
 		 "    -i ignore an input device\n"
 		 "       This device does not re enable keyboard backlight.\n"
 		 "       Separate multiple device by space.\n"
+		 "       A rule of key=value pairs matches the device by its identity,\n"
+		 "       e.g. \'vendor=046d,product=c52b\' or \'bus=bluetooth,name=*Keyboard*\'.\n"
+		 "       Keys are bus, vendor, product (hex) and name, phys, uniq (wildcards).\n"
+		 "       Rules do not apply to /dev/input/mice, use -m 2 and -I for single mice.\n"
 		 "       Default: use all mice and keyboard.\n"
+		 "    -I (rule) use an input device matching the rule, even if it is neither\n"
+		 "       a keyboard nor a mouse. Ignore rules win. Can be given more than once.\n"
+		 "    -c (class=filter) turn the light on with tablets, gamepads or trackpoints\n"
+		 "       Filters are all, buttons, proximity (tablet) and deadzone[:percent] (gamepad),\n"
+		 "       e.g. tablet=proximity or gamepad=deadzone:30. Can be given once per class.\n"
+		 "       Default: off, devices of the class are not opened unless -m picks them.\n"
 		 "    -t configure timeout in seconds after which the backlight will be turned off\n"
 		 "       Defaults to 30s \n"
+		 "    -L timeout in seconds while the session is locked, only key presses\n"
+		 "       turn the light on then. The session is followed through logind.\n"
 		 "    -m configure mouse mode (0..2)\n"
 		 "       0 use all mice (default)\n"
 		 "       1 use all internal mice only\n"
 		 "       2 ignore mice\n"
+		 "    -S (wake|keep|ignore) what scrolling does, the wheel and two fingers on\n"
+		 "       the touchpad. wake turns the lights on like other input (default),\n"
+		 "       keep only keeps lights on which are on, e.g. while reading in the dark.\n"
+		 "       It is ignored while the session is locked.\n"
 		 "    -b set keyboard backlight device path\n"
 		 "       defaults to %s\n"
 		 "    -f stay in foreground and do not start daemon\n"
 		 "    -s Set a brightness value and exit\n"
+		 "    -C measure how the keyboard and display light take writes, save their\n"
+		 "       profiles and exit. Stop the service first, the lights flicker.\n"
+		 "       The service picks asynchronous writes, verification and fades from them.\n"
+		 "    -D set the directory of the light profiles\n"
+		 "       defaults to %s\n"
 		 "    -k (key code) Ignore key code\n"
 		 "       You can get the values using -d option.\n"
 		 "       Separate multiple values by comma, e.g. \'10,20,30\'.\n"
-		 "    -d Show pressed key codes\n",
-		 DEFAULT_BACKLIGHT_PATH.c_str()
+		 "    -d Show pressed key codes\n"
+		 "    -u Follow UPower and provide its KbdBacklight interface on the system bus\n"
+		 "       The bus address is taken from DBUS_SYSTEM_BUS_ADDRESS if it is set.\n"
+		 "    -w Turn the light on early when the lid is opened, after resume\n"
+		 "       and when a finger approaches the touchpad\n"
+		 "    -r set the status report path, written on SIGUSR1\n"
+		 "       defaults to %s\n"
+		 "    -F set the flight recorder path, the last decisions and light writes\n"
+		 "       are written there on SIGUSR2 and when the daemon crashes\n"
+		 "       defaults to %s\n"
+		 "    -T timer tolerance in milliseconds\n"
+		 "       The light is turned off up to this much later, so the wakeup\n"
+		 "       can be combined with other timers of the system.\n"
+		 "       Defaults to 500ms, 0 disables it.\n"
+		 "    -a audit the daemon itself for the given seconds after start\n"
+		 "       Wakeups, syscalls, context switches and memory are added\n"
+		 "       to the status report. SIGRTMIN starts an audit at any time.\n"
+		 "    -x record a trace of the event loop and write it to this path on SIGUSR1\n"
+		 "       Paths ending in .json are Chrome trace-event JSON, others Perfetto protobuf.\n"
+		 "    -l share the input activity with other idle tools on this unix socket\n"
+		 "       Clients get \'active\' and \'idle\' messages and an eventfd, so they do not\n"
+		 "       have to read the input devices themselves.\n"
+		 "    -p also dim and turn off this display backlight, e.g.\n"
+		 "       /sys/class/backlight/intel_backlight/brightness\n"
+		 "    -P (dim,off,percent) display timeline, seconds without input until\n"
+		 "       the display is dimmed to percent of its level and turned off.\n"
+		 "       0 skips a stage. Defaults to 60,300,30.\n"
+		 "    -e (sink=mW,mW,...) power of the keyboard or display light for the energy\n"
+		 "       report, spread evenly from level 0 to the maximum, e.g. keyboard=0,200,450.\n"
+		 "       Defaults to keyboard=0,250,500 and display=0,3000, rough guesses.\n",
+		 DEFAULT_BACKLIGHT_PATH.c_str(),
+		 DEFAULT_PROFILE_DIR.c_str(),
+		 DEFAULT_STATUS_PATH.c_str(),
+		 DEFAULT_FLIGHT_PATH.c_str()
 
   );
 }
 
-bool file_read_uint64(const std::string &filename, uint64_t *val) {
-  FILE *fp;
-  uint64_t data;
-
-  fp = fopen(filename.c_str(), "r");
-  if (!fp) {
-	return false;
-  }
-
-  if (fscanf(fp, "%lu", &data) != 1) {
-	fclose(fp);
-	return false;
-  }
-
-  *val = data;
-
-  fclose(fp);
-  return true;
-}
-
-bool file_write_uint64(const std::string &filename, uint64_t val) {
-  FILE *fp;
-
-  fp = fopen(filename.c_str(), "w");
-  if (!fp) {
-	return false;
-  }
-
-  if (fprintf(fp, "%lu", val) < 0) {
-	fclose(fp);
-	return false;
-  }
-
-  fclose(fp);
-  return true;
-}
-
-bool is_device_ignored(const std::string &device,
-					   const std::vector<std::string> &ignoredDevices) {
-  for (const auto &ignoredDev : ignoredDevices) {
-	if (device.find(ignoredDev) != std::string::npos) {
-	  return true;
-	}
-  }
-  return false;
-}
-
-/* Get keyboards from /proc/bus/input/devices
- * Example entry
-	I: Bus=0011 Vendor=0001 Product=0001 Version=ab54
-	N: Name="AT Translated Set 2 keyboard"
-	P: Phys=isa0060/serio0/input0
-	S: Sysfs=/devices/platform/i8042/serio0/input/input3
-	U: Uniq=
-	H: Handlers=sysrq kbd event3 leds
-	B: PROP=0
-	B: EV=120013
-	B: KEY=402000000 3803078f800d001 feffffdfffefffff fffffffffffffffe
- */
-void get_keyboards(std::vector<std::string> &ignoredDevices,
-				   std::vector<std::string> &keyboards) {
-  const std::string path = "/proc/bus/input/devices";
-  std::ifstream file(path);
-  if (!file.is_open()) {
-	print_debug("Failed to open %s...\n", path.c_str());
-	return;
-  }
-
-  bool isKeyboard = false;
-  std::string line;
-  std::string token;
-  std::istringstream ss;
-  while (std::getline(file, line)) {
-	auto lineLower = line;
-	std::transform(lineLower.begin(), lineLower.end(), lineLower.begin(), tolower);
-	// get device name
-	if (lineLower.find("name=") != std::string::npos) {
-	  isKeyboard = lineLower.find("keyboard") != std::string::npos;
-	  if (isKeyboard) {
-		print_debug("Detected keyboard: %s\n", lineLower.c_str());
-	  } else {
-		print_debug("Ignoring non keyboard device: %s\n", lineLower.c_str());
-	  }
-	}
-
-	if (lineLower.find("handlers=") != std::string::npos) {
-	  if (!isKeyboard) {
-		continue;
-	  }
-
-	  ss = std::istringstream(line);
-	  while (std::getline(ss, token, ' ')) {
-		if (token.find("event") != std::string::npos) {
-		  std::string deviceEventPath = "/dev/input/" + token;
-		  if (!is_device_ignored(deviceEventPath, ignoredDevices)) {
-			print_debug_n("Added keyboard\n");
-			keyboards.emplace_back(deviceEventPath);
-		  } else {
-			print_debug_n("Keyboard is ignored\n");
-		  }
-		  break;
-		}
-	  }
-	}
-  }
-}
-
-void get_devices_in_path(const std::vector<std::string> &ignoredDevices,
-						 const std::string &devicePath,
-						 const std::regex &regex,
-						 std::vector<std::string> &devices) {
-  for (const auto &dev : std::filesystem::directory_iterator(devicePath)) {
-	if (is_device_ignored(dev.path(), ignoredDevices)) {
-	  continue;
-	}
-
-	if (regex_match(std::string(dev.path()), regex)) {
-	  devices.push_back(dev.path());
-	}
-  }
-}
-
-int open_device(const std::string &path) {
-  int fd;
-
-  if ((fd = open(path.c_str(), O_RDONLY)) < 0) {
-	perror("tp_kbd_backlight: open");
-	return -1;
-  }
-
-  return fd;
-}
-
-std::vector<int> open_devices(const std::vector<std::string> &input_devices) {
-  std::vector<int> fds;
-  for (const auto &dev : input_devices) {
-	fds.push_back(open_device(dev));
-  }
-  return fds;
-}
-
-void brightness_control(const std::string &brightnessPath,
-						unsigned long timeoutMs) {
-  unsigned long tmpBrightness = currentBrightness_;
-  while (!end_) {
-	auto passedMs = std::chrono::duration_cast<
-		std::chrono::milliseconds>(
-		std::chrono::system_clock::now() - lastEvent_);
-
-	if (lastEvent_ < std::chrono::system_clock::now()) {
-	  auto sleepTime = std::chrono::milliseconds(timeoutMs - passedMs.count());
-	  if (0 != sleepTime.count()) {
-		print_debug("Sleeping for %lu ms\n", sleepTime.count());
-		std::this_thread::sleep_for(sleepTime);
-	  }
-	}
-
-	passedMs = std::chrono::duration_cast<
-		std::chrono::milliseconds>(
-		std::chrono::system_clock::now() - lastEvent_);
-	print_debug("Ms since last event: %lu\n", passedMs.count());
-	if (passedMs.count() >= static_cast<long>(timeoutMs)) {
-
-	  print_debug_n("Timeout reached \n");
-
-	  file_read_uint64(brightnessPath, &tmpBrightness);
-	  if (tmpBrightness != 0) {
-		originalBrightness_ = tmpBrightness;
-		currentBrightness_ = 0;
-		file_write_uint64(brightnessPath, 0);
-		print_debug("New Original brightness: %lu New Current Brightness: %lu\n",
-					originalBrightness_,
-					currentBrightness_);
-		print_debug_n("Turning lights off\n");
-	  }
-
-	  lastEvent_ = std::chrono::system_clock::now();
-	}
-  }
-}
-
-void read_events(int devFd, const std::string &brightnessPath,
-				 const std::map<int, bool> &ignoredKeys, bool showPressedKeys) {
-	int ignoreNextValues = 0;
-	while (!end_) {
-		struct input_event ie = {};
-		int rd = read(devFd, &ie, sizeof(struct input_event));
-		if (rd != 0) {
-			if (showPressedKeys && ie.type == EV_MSC && ie.code == MSC_SCAN) {
-				printf("Pressed key value: %d\n", ie.value);
-				fflush(stdout);
-			}
-
-			bool correctKey = true;
-			if (ie.type == EV_MSC && ie.code == MSC_SCAN) {
-				if (ignoredKeys.find(ie.value)->second == true) {
-					correctKey = false;
-					// There are 3 events for every key press, so we are ignoring
-					// the next 2 events
-					ignoreNextValues = 2;
-#if DEBUG_KEYS_IGNORE
-					printf("Ignoring key: type: %u, code: %u, value: %d\n",
-						   ie.type, ie.code, ie.value);
-					fflush(stdout);
-#endif
-				}
-			} else if (ignoreNextValues > 0) {
-				correctKey = false;
-				ignoreNextValues--;
-			}
-
-			if (correctKey) {
-#if DEBUG_KEYS_IGNORE
-				printf("Processing key type: %u, code: %u, value: %d\n",
-					   ie.type, ie.code, ie.value);
-				fflush(stdout);
-#endif
-				lastEvent_ = std::chrono::system_clock::now();
-
-				if (currentBrightness_ != originalBrightness_) {
-					file_write_uint64(brightnessPath, originalBrightness_);
-					currentBrightness_ = originalBrightness_;
-
-					print_debug("Event in fd %i, turning lights on\n", devFd);
-				}
-			}
-		}
-	}
-	close(devFd);
-}
-
-void signal_handler(int sig) {
-  switch (sig) {
-	case SIGTERM:
-	case SIGKILL:
-	  end_ = true;
-	  break;
-	default:
-	  break;
-  }
-}
-
-bool is_brightness_writable(const std::string &brightnessPath) {
-  std::filesystem::path p(brightnessPath);
-  if (!std::filesystem::exists(p)) {
-	printf("Brightness device %s does not exist\n", brightnessPath.c_str());
-	return false;
-  }
-
-  if (!file_read_uint64(brightnessPath, &originalBrightness_)
-	  || !file_write_uint64(brightnessPath, originalBrightness_)) {
-	printf("Write access to brightness device %s failed."
-		   " Please run with root privileges", brightnessPath.c_str());
-	return false;
-  }
-  return true;
-}
-
-void parse_opts(int argc,
-				char *const *argv,
-				std::vector<std::string> &ignoredDevices,
-				unsigned long &timeout,
-				MOUSE_MODE &mouseMode,
-				std::string &backlightPath,
-				bool &foreground,
-				long &setBrightness,
-				std::map<int, bool> &ignoredKeys,
-				bool &showPressedKeys) {
+void parse_opts(int argc, char *const *argv, options &opts) {
   int c;
-  std::istringstream ss;
-  std::string token;
   long mode;
 
-  while ((c = getopt(argc, argv, "hs:i:t:m:b:k:fd")) != -1) {
+  while ((c = getopt(argc, argv, "hs:Ci:I:c:t:L:m:S:b:k:fduwr:F:T:a:x:l:p:P:e:D:")) != -1) {
 	switch (c) {
 	  case 'b':
-		backlightPath = optarg;
+		opts.backlightPath = optarg;
 		break;
 	  case 'f':
-		foreground = true;
+		opts.foreground = true;
 		break;
 	  case 'i':
-		ss = std::istringstream(optarg);
-		while (std::getline(ss, token, ' ')) {
-		  ignoredDevices.push_back(token);
-
-		  // if the device is a symlink add the actual target to the
-		  // ignored device list too
-		  std::filesystem::path p = token;
-		  if (!std::filesystem::exists(p))
-			continue;
-
-		  std::filesystem::current_path(p.parent_path());
-		  if (std::filesystem::is_symlink(p)) {
-			p = std::filesystem::read_symlink(p);
-		  }
-
-		  if (!p.is_absolute()) {
-			p = std::filesystem::canonical(p);
-		  }
-		  ignoredDevices.push_back(p);
+		if (strchr(optarg, '=') == nullptr) {
+		  add_ignored_devices(opts, optarg);
+		} else if (!add_device_rule(opts.ignoreRules, optarg)) {
+		  printf("%s is not a valid device rule\n", optarg);
+		  exit(EXIT_FAILURE);
+		}
+		break;
+	  case 'I':
+		if (!add_device_rule(opts.includeRules, optarg)) {
+		  printf("%s is not a valid device rule\n", optarg);
+		  exit(EXIT_FAILURE);
+		}
+		break;
+	  case 'c':
+		if (!set_class_filter(opts, optarg)) {
+		  printf("%s is not a valid class filter\n", optarg);
+		  exit(EXIT_FAILURE);
 		}
 		break;
 	  case 'm':
@@ -405,26 +279,95 @@ void parse_opts(int argc,
 		  printf("%s is not a valid mouse mode\n", optarg);
 		  exit(EXIT_FAILURE);
 		}
-		mouseMode = static_cast<MOUSE_MODE>(mode);
+		opts.mouseMode = static_cast<MOUSE_MODE>(mode);
+		break;
+	  case 'S':
+		if (strcmp(optarg, "wake") == 0) {
+		  opts.scrollMode = SCROLL_WAKE;
+		} else if (strcmp(optarg, "keep") == 0) {
+		  opts.scrollMode = SCROLL_KEEP;
+		} else if (strcmp(optarg, "ignore") == 0) {
+		  opts.scrollMode = SCROLL_IGNORE;
+		} else {
+		  printf("%s is not a valid scroll mode\n", optarg);
+		  exit(EXIT_FAILURE);
+		}
 		break;
 	  case 't':
-		timeout = strtoul(optarg, nullptr, 0);
-		if (0 >= timeout) {
+		opts.timeout = strtoul(optarg, nullptr, 0);
+		if (0 >= opts.timeout) {
+		  printf("%s is not a valid timeout\n", optarg);
+		  exit(EXIT_FAILURE);
+		}
+		break;
+	  case 'L':
+		opts.lockedTimeout = std::chrono::seconds(strtoul(optarg, nullptr, 0));
+		if (opts.lockedTimeout.count() <= 0) {
 		  printf("%s is not a valid timeout\n", optarg);
 		  exit(EXIT_FAILURE);
 		}
 		break;
 	  case 's':
-		setBrightness = strtol(optarg, nullptr, 0);
+		opts.setBrightness = strtol(optarg, nullptr, 0);
+		break;
+	  case 'C':
+		opts.calibrate = true;
+		break;
+	  case 'D':
+		opts.profileDir = optarg;
 		break;
 	  case 'k':
-		ss = std::istringstream(optarg);
-		while (std::getline(ss, token, ',')) {
-		  ignoredKeys[std::stoi(token)] = true;
+		if (!add_ignored_keys(opts, optarg)) {
+		  printf("%s is not a valid list of key codes\n", optarg);
+		  exit(EXIT_FAILURE);
 		}
 		break;
 	  case 'd':
-		showPressedKeys = true;
+		opts.showPressedKeys = true;
+		break;
+	  case 'u':
+		opts.useDbus = true;
+		break;
+	  case 'w':
+		opts.earlyWake = true;
+		break;
+	  case 'r':
+		opts.statusPath = optarg;
+		break;
+	  case 'F':
+		opts.flightPath = optarg;
+		break;
+	  case 'T':
+		opts.tolerance = std::chrono::milliseconds(strtoul(optarg, nullptr, 0));
+		break;
+	  case 'a':
+		opts.auditSeconds = strtoul(optarg, nullptr, 0);
+		break;
+	  case 'x':
+		opts.tracePath = optarg;
+		break;
+	  case 'l':
+		opts.activitySocket = optarg;
+		break;
+	  case 'p':
+		opts.displayPath = optarg;
+		break;
+	  case 'P': {
+		unsigned long dim, off, percent;
+		if (sscanf(optarg, "%lu,%lu,%lu", &dim, &off, &percent) != 3 || percent > 100) {
+		  printf("%s is not a valid display timeline\n", optarg);
+		  exit(EXIT_FAILURE);
+		}
+		opts.displayDimAfter = std::chrono::seconds(dim);
+		opts.displayOffAfter = std::chrono::seconds(off);
+		opts.displayDimPercent = percent;
+		break;
+	  }
+	  case 'e':
+		if (!set_power_model(opts, optarg)) {
+		  printf("%s is not a valid power model\n", optarg);
+		  exit(EXIT_FAILURE);
+		}
 		break;
 	  case 'h':
 	  default:
@@ -434,103 +377,138 @@ void parse_opts(int argc,
   }
 }
 
-int main(int argc, char **argv) {
-  std::vector<int> eventFd;
-
-  std::vector<std::string> inputDevices;
-  std::vector<std::string> ignoredDevices;
-  std::map<int, bool> ignoredKeys;
-  bool showPressedKeys = false;
+void handle_signal(int signalFd, const options &opts) {
+  signalfd_siginfo info = {};
+  if (read(signalFd, &info, sizeof(info)) != sizeof(info)) {
+	return;
+  }
 
-  signal(SIGTERM, signal_handler);
-  signal(SIGKILL, signal_handler);
+  print_debug("Received signal %u\n", info.ssi_signo);
+  if (info.ssi_signo == SIGUSR1) {
+	engine_write_status();
+  } else if (info.ssi_signo == SIGUSR2) {
+	if (!recorder_.dump(opts.flightPath.c_str(), "SIGUSR2")) {
+	  perror("tp_kbd_backlight: flight recorder");
+	}
+  } else if (static_cast<int>(info.ssi_signo) == SIGRTMIN) {
+	engine_start_audit(opts.auditSeconds > 0 ? opts.auditSeconds : DEFAULT_AUDIT_SECONDS);
+  } else {
+	end_ = true;
+  }
+}
 
-  unsigned long timeout = 15;
-  long setBrightness = -1;
-  MOUSE_MODE mouseMode = MOUSE_MODE::ALL;
+int main(int argc, char **argv) {
+  std::vector<std::string> inputDevices;
+  std::vector<std::string> wakeDevices;
+  options opts;
 
-  bool foreground = false;
-  std::string backlightPath = DEFAULT_BACKLIGHT_PATH;
   print_debug_n("Parsing options...\n");
-  parse_opts(argc,
-			 argv,
-			 ignoredDevices,
-			 timeout,
-			 mouseMode,
-			 backlightPath,
-			 foreground,
-			 setBrightness,
-			 ignoredKeys,
-			 showPressedKeys);
-  print_debug("Using backlight device: %s\n", backlightPath.c_str());
-
-  print_debug_n("Getting keyboards...\n");
-  get_keyboards(ignoredDevices, inputDevices);
-  if (inputDevices.empty()) {
-	std::cout << "Warning no keyboards found!" << std::endl;
+  parse_opts(argc, argv, opts);
+  print_debug("Using backlight device: %s\n", opts.backlightPath.c_str());
+  // The lights only, no input device is needed for it
+  if (opts.calibrate) {
+	std::vector<std::string> lights = {opts.backlightPath};
+	if (!opts.displayPath.empty()) {
+	  lights.push_back(opts.displayPath);
+	}
+	for (const auto &light : lights) {
+	  if (!is_brightness_writable(light)) {
+		exit(EXIT_FAILURE);
+	  }
+	  sink_profile profile;
+	  auto file = sink_profile_path(opts.profileDir, light);
+	  if (!calibrate_sink(light, profile) || !save_sink_profile(file, profile)) {
+		exit(EXIT_FAILURE);
+	  }
+	  printf("  saved to %s\n", file.c_str());
+	}
+	exit(0);
   }
 
-  switch (mouseMode) {
-	case ALL:
-	  get_devices_in_path(ignoredDevices,
-						  "/dev/input/",
-						  std::regex(".*mice.*"),
-						  inputDevices);
-	  break;
-	case INTERNAL:
-	  get_devices_in_path(ignoredDevices,
-						  "/dev/input/by-path",
-						  std::regex("..*event\\-mouse.*"),
-						  inputDevices);
-	  break;
-	case NONE:
-	  break;
+  // A restart of the service, the previous instance checked all of this
+  auto parked = listen_fds();
+  if (parked.empty() && discover_devices(opts, inputDevices, wakeDevices) == 0) {
+	std::cout << "Warning no keyboards found!" << std::endl;
   }
 
-  if (inputDevices.empty()) {
+  // included and class devices are among the event devices, the probe picks them
+  bool classes = std::any_of(opts.classFilters.begin(), opts.classFilters.end(),
+							 [](CLASS_FILTER filter) { return filter != CLASS_FILTER_OFF; });
+  if (parked.empty() && inputDevices.empty()
+	  && ((opts.includeRules.empty() && !classes) || wakeDevices.empty())) {
 	std::cout << "No input device found or all ignored\n";
 	exit(EXIT_FAILURE);
   }
 
-  if (!is_brightness_writable(backlightPath)) {
+  if (parked.empty() && (!is_brightness_writable(opts.backlightPath)
+	  || (!opts.displayPath.empty() && !is_brightness_writable(opts.displayPath)))) {
 	exit(EXIT_FAILURE);
   }
 
-  if (setBrightness >= 0) {
-	file_write_uint64(backlightPath, setBrightness);
+  if (opts.setBrightness >= 0) {
+	file_write_uint64(opts.backlightPath, opts.setBrightness);
 	exit(0);
   }
 
-  currentBrightness_ = originalBrightness_;
-
-  auto fds = open_devices(inputDevices);
-  lastEvent_ = std::chrono::system_clock::now();
-
-  if (!foreground) {
+  // Before any probe thread is started, they would not survive the fork
+  if (!opts.foreground) {
 	if (daemon(0, 0)) {
 	  std::cout << "failed to daemonize" << std::endl;
 	  exit(EXIT_FAILURE);
 	}
   }
 
-  inputDevices.clear();
-  ignoredDevices.clear();
-
-  std::vector<std::future<void>> f;
-  for (const auto &fd : fds) {
-	f.emplace_back(std::async(std::launch::async,
-							  read_events,
-							  fd,
-							  backlightPath,
-							  ignoredKeys, 
-							  showPressedKeys));
+  // Signals are handled in the loop like everything else
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  sigaddset(&mask, SIGRTMIN);
+  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  int signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signalFd < 0) {
+	perror("tp_kbd_backlight: signalfd");
+	exit(EXIT_FAILURE);
+  }
+
+  install_crash_dump(opts.flightPath.c_str());
+  bool resumed = !parked.empty() && engine_resume(opts, parked);
+  if (!parked.empty()) {
+	// the store only holds what the running instance parks when it stops
+	for (const auto &fd : parked) {
+	  notify_systemd("FDSTOREREMOVE=1\nFDNAME=" + fd.name);
+	}
+	std::cout << (resumed ? "Resumed with the parked devices"
+						  : "The parked state does not fit, starting from scratch") << std::endl;
+  }
+  if (!(resumed || engine_start(opts))
+	  || !engine_watch(signalFd, [signalFd, &opts]() { handle_signal(signalFd, opts); })) {
+	exit(EXIT_FAILURE);
   }
 
-  brightness_control(backlightPath, timeout * 1000);
+  int watchdogFd = start_watchdog();
+  if (watchdogFd >= 0 && !engine_watch(watchdogFd, [watchdogFd]() {
+	uint64_t expirations;
+	if (read(watchdogFd, &expirations, sizeof(expirations)) > 0) {
+	  notify_systemd("WATCHDOG=1");
+	}
+  })) {
+	exit(EXIT_FAILURE);
+  }
+  notify_systemd("READY=1");
+
+  if (opts.tolerance.count() > 0) {
+	// Let the kernel delay our other wakeups by the same amount
+	prctl(PR_SET_TIMERSLACK,
+		  std::chrono::duration_cast<std::chrono::nanoseconds>(opts.tolerance).count());
+  }
 
-  for (const auto &fd : fds) {
-	close(fd);
+  while (!end_ && engine_dispatch(-1)) {
   }
+  park_fds();
+  engine_stop();
 
   exit(0);
 }
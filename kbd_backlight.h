@@ -0,0 +1,133 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * C interface to embed the keyboard light policy into another process.
+ * The policy runs on the thread of the host: add the fd of
+ * kbd_backlight_get_fd() to the event loop of the host and call
+ * kbd_backlight_dispatch() whenever it is readable. Each input device is
+ * opened on a short lived detached thread, so a device which blocks in
+ * open() does not block the host. These threads only open the device and
+ * hand the result to dispatch, no callback runs on them.
+ * A light whose profile (keyboard_backlight -C) asks for asynchronous writes
+ * gets a writer thread for the life of the instance. It writes the brightness
+ * file and adds to the trace and the flight recorder, no callback runs on it
+ * either. kbd_backlight_free() waits for its last write.
+ * Only one instance can exist per process.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_H
+#define KBD_BACKLIGHT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KBD_BACKLIGHT_EXPORT __attribute__((visibility("default")))
+
+typedef struct kbd_backlight kbd_backlight;
+
+struct kbd_backlight_config {
+  /* brightness file of the light, NULL for the thinkpad keyboard light */
+  const char *backlight_path;
+  /* seconds without input until the light is turned off */
+  unsigned long timeout;
+  /* the same while the session is locked, only keys turn the light on then.
+   * 0 does not follow the session through logind.
+   */
+  unsigned long locked_timeout;
+  /* 0 all mice, 1 internal mice only, 2 no mice */
+  int mouse_mode;
+  /* devices which do not turn the light on, separated by space, may be NULL */
+  const char *ignored_devices;
+  /* identity rules like "vendor=046d,name=*Mouse*", NULL terminated, may be NULL.
+   * Matching devices are ignored or used even if they are no keyboard or mouse.
+   */
+  const char *const *ignore_rules;
+  const char *const *include_rules;
+  /* input classes which turn the light on, like "tablet=proximity" or
+   * "gamepad=deadzone:30", NULL terminated, may be NULL. Other classes are not opened.
+   */
+  const char *const *class_filters;
+  /* power of the lights for the energy report, like "keyboard=0,200,450" or
+   * "display=0,2800" in mW from level 0 to the maximum, NULL terminated, may be NULL
+   */
+  const char *const *power_models;
+  /* scan codes which do not turn the light on, separated by comma, may be NULL */
+  const char *ignored_keys;
+  /* the light is turned off up to this much later to share the wakeup */
+  unsigned long tolerance_ms;
+  /* turn the light on when the lid opens or a finger approaches the touchpad */
+  int early_wake;
+  /* written by kbd_backlight_write_status(), NULL for the default */
+  const char *status_path;
+  /* serve the activity of the input devices on this unix socket, may be NULL */
+  const char *activity_socket;
+  /* brightness file of the display backlight to dim and turn off, may be NULL */
+  const char *display_path;
+  /* seconds without input until the display is dimmed or turned off, 0 skips it */
+  unsigned long display_dim;
+  unsigned long display_off;
+  /* dimmed level of the display in percent of its level */
+  unsigned int display_dim_percent;
+  /* profiles of the lights written by keyboard_backlight -C, NULL for the default */
+  const char *profile_dir;
+  /* 0 scrolling turns the light on, 1 only keeps it on, 2 it is no input */
+  int scroll_mode;
+};
+
+/* Fills in the defaults of the daemon */
+KBD_BACKLIGHT_EXPORT void kbd_backlight_config_init(struct kbd_backlight_config *config);
+
+/* Returns NULL if the light is not writable, the config is invalid
+ * or an instance exists already.
+ */
+KBD_BACKLIGHT_EXPORT kbd_backlight *kbd_backlight_new(const struct kbd_backlight_config *config);
+
+/* Pollable fd, readable when kbd_backlight_dispatch() has work to do */
+KBD_BACKLIGHT_EXPORT int kbd_backlight_get_fd(const kbd_backlight *kb);
+
+/* Handles everything that is pending without blocking.
+ * Returns 0 or -1 if the engine failed and has to be freed.
+ */
+KBD_BACKLIGHT_EXPORT int kbd_backlight_dispatch(kbd_backlight *kb);
+
+/* Reports input the engine cannot see itself, e.g. from the compositor */
+KBD_BACKLIGHT_EXPORT void kbd_backlight_notify_activity(kbd_backlight *kb);
+
+/* Writes the status report to the configured path */
+KBD_BACKLIGHT_EXPORT void kbd_backlight_write_status(kbd_backlight *kb);
+
+/* Writes the last decisions and light writes of the engine as text.
+ * Returns -1 if the file could not be written.
+ */
+KBD_BACKLIGHT_EXPORT int kbd_backlight_dump_flight(kbd_backlight *kb, const char *path);
+
+/* Stops the engine and closes all devices, the light keeps its level */
+KBD_BACKLIGHT_EXPORT void kbd_backlight_free(kbd_backlight *kb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //KBD_BACKLIGHT_H
@@ -0,0 +1,227 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Flight recorder of the last decisions, see recorder.h
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#include "recorder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+flight_recorder recorder_;
+
+namespace {
+
+const char *FLIGHT_EVENT_NAMES[FLIGHT_EVENT_COUNT] = {
+	"activity",
+	"stage",
+	"sink write",
+	"sink failed",
+	"sink power",
+	"timer arm",
+	"timeout",
+	"bus level",
+	"device",
+	"session"
+};
+
+const int FATAL_SIGNALS[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+
+char crashPath_[256];
+// a stack overflow can not be handled on the stack that overflowed
+char altStack_[64 * 1024];
+
+// printf is not async signal safe, the dump is formatted by hand
+class dump_writer {
+ public:
+  explicit dump_writer(int fd) : fd_(fd) {}
+
+  void add(const char *s) {
+	while (*s != '\0') {
+	  if (len_ == sizeof(buf_)) {
+		flush();
+	  }
+	  buf_[len_++] = *s++;
+	}
+  }
+
+  void add(int64_t val, int width = 0) {
+	char digits[24];
+	size_t n = 0;
+	uint64_t u = val < 0 ? -static_cast<uint64_t>(val) : static_cast<uint64_t>(val);
+	do {
+	  digits[n++] = static_cast<char>('0' + u % 10);
+	  u /= 10;
+	} while (u != 0);
+	while (static_cast<int>(n) < width) {
+	  digits[n++] = '0';
+	}
+	char out[26];
+	size_t o = 0;
+	if (val < 0) {
+	  out[o++] = '-';
+	}
+	while (n > 0) {
+	  out[o++] = digits[--n];
+	}
+	out[o] = '\0';
+	add(out);
+  }
+
+  bool flush() {
+	size_t done = 0;
+	while (done < len_) {
+	  ssize_t wr = write(fd_, buf_ + done, len_ - done);
+	  if (wr < 0 && errno == EINTR) {
+		continue;
+	  }
+	  if (wr <= 0) {
+		ok_ = false;
+		break;
+	  }
+	  done += wr;
+	}
+	len_ = 0;
+	return ok_;
+  }
+
+ private:
+  int fd_;
+  char buf_[4096];
+  size_t len_ = 0;
+  bool ok_ = true;
+};
+
+// strsignal is not async signal safe either
+const char *signal_name(int sig) {
+  switch (sig) {
+	case SIGSEGV:
+	  return "SIGSEGV";
+	case SIGBUS:
+	  return "SIGBUS";
+	case SIGILL:
+	  return "SIGILL";
+	case SIGFPE:
+	  return "SIGFPE";
+	case SIGABRT:
+	  return "SIGABRT, e.g. the watchdog";
+	default:
+	  return "signal";
+  }
+}
+
+void on_fatal_signal(int sig) {
+  int error = errno;
+  recorder_.dump(crashPath_, signal_name(sig));
+  errno = error;
+  // the handler was reset, the default action ends the process once we return
+  raise(sig);
+}
+
+} // namespace
+
+bool flight_recorder::dump(const char *path, const char *reason) const {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+	return false;
+  }
+
+  uint64_t end = next_.load(std::memory_order_acquire);
+  uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+  dump_writer w(fd);
+  w.add("# keyboard_backlight flight recorder, ");
+  w.add(reason);
+  w.add(", last ");
+  w.add(static_cast<int64_t>(end - begin));
+  w.add(" of ");
+  w.add(static_cast<int64_t>(end));
+  w.add(" records\n# monotonic seconds, event, a, b\n");
+  for (uint64_t i = begin; i < end; ++i) {
+	const auto &r = records_[i % CAPACITY];
+	if (r.seq.load(std::memory_order_acquire) != i + 1) {
+	  continue;
+	}
+	uint64_t timeNs = r.timeNs.load(std::memory_order_relaxed);
+	int32_t a = r.a.load(std::memory_order_relaxed);
+	int64_t b = r.b.load(std::memory_order_relaxed);
+	uint32_t event = r.event.load(std::memory_order_relaxed);
+	// a writer which wrapped around meanwhile may have mixed its fields into the copy
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (r.seq.load(std::memory_order_acquire) != i + 1) {
+	  continue;
+	}
+	w.add(static_cast<int64_t>(timeNs / 1000000000));
+	w.add(".");
+	w.add(static_cast<int64_t>(timeNs % 1000000000 / 1000), 6);
+	w.add(" ");
+	w.add(event < FLIGHT_EVENT_COUNT ? FLIGHT_EVENT_NAMES[event] : "unknown");
+	w.add(" ");
+	w.add(a);
+	w.add(" ");
+	w.add(b);
+	w.add("\n");
+  }
+  bool ok = w.flush();
+  close(fd);
+  return ok;
+}
+
+void flight_recorder::clear() {
+  for (auto &r : records_) {
+	r.seq.store(0, std::memory_order_relaxed);
+  }
+  next_ = 0;
+}
+
+bool install_crash_dump(const char *path) {
+  if (strlen(path) >= sizeof(crashPath_)) {
+	return false;
+  }
+  strcpy(crashPath_, path);
+
+  stack_t stack = {};
+  stack.ss_sp = altStack_;
+  stack.ss_size = sizeof(altStack_);
+  if (sigaltstack(&stack, nullptr) < 0) {
+	perror("tp_kbd_backlight: sigaltstack");
+  }
+
+  struct sigaction action = {};
+  action.sa_handler = on_fatal_signal;
+  action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  for (int sig : FATAL_SIGNALS) {
+	if (sigaction(sig, &action, nullptr) < 0) {
+	  perror("tp_kbd_backlight: sigaction");
+	  return false;
+	}
+  }
+  return true;
+}
@@ -0,0 +1,110 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Flight recorder of the last decisions, dumped when the daemon misbehaves
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_RECORDER_H
+#define KBD_BACKLIGHT_RECORDER_H
+
+#include <ctime>
+#include <cstdint>
+
+#include <atomic>
+
+// The meaning of a and b depends on the event
+enum FLIGHT_EVENT : uint32_t {
+  // a: wake trigger, b: 1 if a light was turned on
+  FLIGHT_ACTIVITY = 0,
+  // a: sink type, b: stage, 0 is on
+  FLIGHT_STAGE = 1,
+  // a: sink type, b: brightness
+  FLIGHT_SINK_WRITE = 2,
+  FLIGHT_SINK_FAILED = 3,
+  // a: sink type, b: 4 blanked, 0 unblanked
+  FLIGHT_SINK_POWER = 4,
+  // a: 1 if armed, b: ms until the next stage
+  FLIGHT_TIMER_ARM = 5,
+  // b: ms since the last input
+  FLIGHT_TIMEOUT = 6,
+  // a: 0 SetBrightness of a client, 1 changed in the desktop, b: level
+  FLIGHT_BUS_LEVEL = 7,
+  // a: number of the eventN node, -1 for others, b: device state
+  FLIGHT_DEVICE = 8,
+  // a: 0 unlocked, 1 locked
+  FLIGHT_SESSION = 9,
+  FLIGHT_EVENT_COUNT = 10
+};
+
+/* A seqlock, the sink writer thread records besides the event loop.
+ * The fields are atomics so a dump racing with a writer reads no torn value.
+ */
+struct flight_record {
+  // index + 1 once the record is complete, a dump skips torn records
+  std::atomic<uint64_t> seq;
+  std::atomic<uint64_t> timeNs;
+  std::atomic<int64_t> b;
+  std::atomic<int32_t> a;
+  std::atomic<uint32_t> event;
+};
+
+/* Ring of the last decisions, it is always on.
+ * The records are part of the object, recording never allocates or enters
+ * the kernel, clock_gettime is served by the vDSO.
+ */
+class flight_recorder {
+ public:
+  static const size_t CAPACITY = 4096;
+
+  void record(FLIGHT_EVENT event, int32_t a = 0, int64_t b = 0) {
+	uint64_t i = next_.fetch_add(1, std::memory_order_relaxed);
+	auto &r = records_[i % CAPACITY];
+	r.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r.timeNs.store(static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec, std::memory_order_relaxed);
+	r.a.store(a, std::memory_order_relaxed);
+	r.b.store(b, std::memory_order_relaxed);
+	r.event.store(event, std::memory_order_relaxed);
+	r.seq.store(i + 1, std::memory_order_release);
+  }
+
+  // Async signal safe, the records are written oldest first
+  bool dump(const char *path, const char *reason) const;
+  void clear();
+
+ private:
+  flight_record records_[CAPACITY] = {};
+  std::atomic<uint64_t> next_{0};
+};
+
+extern flight_recorder recorder_;
+
+/* Dumps the recorder to path when the process is killed by a fatal signal.
+ * systemd sends SIGABRT when the watchdog is not pinged in time.
+ */
+bool install_crash_dump(const char *path);
+
+#endif //KBD_BACKLIGHT_RECORDER_H
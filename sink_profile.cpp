@@ -0,0 +1,278 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Calibration of the lights and the writer of slow ones
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#include "sink_profile.h"
+
+#include "engine.h"
+#include "recorder.h"
+#include "trace.h"
+
+#include <cstdio>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <vector>
+
+const std::string PROFILE_VERSION = "keyboard_backlight-profile 1";
+// at most this many levels are written per pass, spread evenly
+const uint64_t CALIBRATION_LEVELS = 64;
+// up and down again, a light may take a falling level slower than a rising one
+const int CALIBRATION_PASSES = 2;
+// until actual_brightness shows the written level
+const std::chrono::milliseconds CALIBRATION_SETTLE(10);
+// an EC command takes longer than this, the event loop should not wait for it
+const std::chrono::microseconds ASYNC_WRITE_LATENCY(1000);
+const unsigned int MAX_FADE_FPS = 60;
+// below it a fade looks like a few steps anyway
+const unsigned int MIN_FADE_FPS = 5;
+// a light with fewer levels is stepped down at once
+const uint64_t MIN_FADE_LEVELS = 4;
+const int VERIFY_RETRIES = 2;
+
+std::string sink_profile_path(const std::string &dir, const std::string &sinkPath) {
+  std::string name = sinkPath.substr(sinkPath.find_first_not_of('/'));
+  std::replace(name.begin(), name.end(), '/', '-');
+  return (std::filesystem::path(dir) / (name + ".profile")).string();
+}
+
+bool load_sink_profile(const std::string &file, sink_profile &profile) {
+  std::ifstream in(file);
+  std::string line;
+  if (!std::getline(in, line) || line != PROFILE_VERSION) {
+	return false;
+  }
+
+  sink_profile loaded;
+  while (std::getline(in, line)) {
+	std::istringstream record(line);
+	std::string key;
+	record >> key >> std::ws;
+	bool valid = true;
+	if (key == "path") {
+	  valid = static_cast<bool>(std::getline(record, loaded.path));
+	} else if (key == "max_level") {
+	  valid = static_cast<bool>(record >> loaded.maxLevel);
+	} else if (key == "write_us") {
+	  long long us;
+	  valid = static_cast<bool>(record >> us);
+	  loaded.writeLatency = std::chrono::microseconds(us);
+	} else if (key == "readbacks") {
+	  valid = static_cast<bool>(record >> loaded.readbacks);
+	} else if (key == "mismatches") {
+	  valid = static_cast<bool>(record >> loaded.mismatches);
+	} else if (key == "levels") {
+	  valid = static_cast<bool>(record >> loaded.levels);
+	} else if (key == "async") {
+	  valid = static_cast<bool>(record >> loaded.async);
+	} else if (key == "verify") {
+	  valid = static_cast<bool>(record >> loaded.verify);
+	} else if (key == "fade_fps") {
+	  valid = static_cast<bool>(record >> loaded.fadeFps);
+	}
+	// unknown keys are from a newer version
+	if (!valid) {
+	  printf("Invalid line in %s: %s\n", file.c_str(), line.c_str());
+	  return false;
+	}
+  }
+  loaded.fadeFps = std::min(loaded.fadeFps, MAX_FADE_FPS);
+  profile = loaded;
+  return true;
+}
+
+bool save_sink_profile(const std::string &file, const sink_profile &profile) {
+  std::error_code ec;
+  std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+  FILE *fp = fopen(file.c_str(), "w");
+  if (!fp) {
+	perror("tp_kbd_backlight: profile");
+	return false;
+  }
+
+  fprintf(fp, "%s\n", PROFILE_VERSION.c_str());
+  fprintf(fp, "path %s\n", profile.path.c_str());
+  fprintf(fp, "max_level %lu\n", profile.maxLevel);
+  fprintf(fp, "write_us %ld\n", static_cast<long>(profile.writeLatency.count()));
+  fprintf(fp, "readbacks %u\n", profile.readbacks);
+  fprintf(fp, "mismatches %u\n", profile.mismatches);
+  fprintf(fp, "levels %lu\n", profile.levels);
+  fprintf(fp, "async %d\n", profile.async);
+  fprintf(fp, "verify %d\n", profile.verify);
+  fprintf(fp, "fade_fps %u\n", profile.fadeFps);
+  return fclose(fp) == 0;
+}
+
+// What the daemon does with a light which behaves like this
+void choose_strategy(sink_profile &profile) {
+  profile.async = profile.writeLatency >= ASYNC_WRITE_LATENCY;
+  profile.verify = profile.mismatches > 0;
+  profile.fadeFps = 0;
+  if (profile.levels >= MIN_FADE_LEVELS) {
+	// every other frame time is left to the rest of the system
+	auto frame = std::max<long>(2 * profile.writeLatency.count(), 1);
+	auto fps = static_cast<unsigned int>(std::min<long>(1000000 / frame, MAX_FADE_FPS));
+	profile.fadeFps = fps >= MIN_FADE_FPS ? fps : 0;
+  }
+}
+
+bool calibrate_sink(const std::string &sinkPath, sink_profile &profile) {
+  auto dir = std::filesystem::path(sinkPath).parent_path();
+  uint64_t original, maxLevel;
+  if (!file_read_uint64(sinkPath, &original)
+	  || !file_read_uint64(dir / "max_brightness", &maxLevel) || maxLevel == 0) {
+	printf("%s has no readable level or max_brightness\n", sinkPath.c_str());
+	return false;
+  }
+  // backlights report what the hardware shows, leds only the last written level
+  std::string shownPath = std::filesystem::exists(dir / "actual_brightness")
+	  ? (dir / "actual_brightness").string() : sinkPath;
+
+  std::vector<uint64_t> levels;
+  uint64_t count = std::min(maxLevel + 1, CALIBRATION_LEVELS);
+  for (uint64_t i = 0; i < count; ++i) {
+	levels.push_back(maxLevel * i / (count - 1));
+  }
+  printf("Calibrating %s, %lu levels of %lu, the light flickers for a few seconds\n",
+		 sinkPath.c_str(), count, maxLevel + 1);
+
+  profile = sink_profile();
+  profile.path = sinkPath;
+  profile.maxLevel = maxLevel;
+  std::vector<std::chrono::microseconds> latencies;
+  std::set<uint64_t> shown;
+  bool failed = false;
+  for (int pass = 0; pass < CALIBRATION_PASSES && !failed; ++pass) {
+	for (size_t i = 0; i < levels.size(); ++i) {
+	  uint64_t level = pass % 2 == 0 ? levels[i] : levels[levels.size() - 1 - i];
+	  auto start = std::chrono::steady_clock::now();
+	  if (!file_write_uint64(sinkPath, level)) {
+		perror("tp_kbd_backlight: calibration write");
+		failed = true;
+		break;
+	  }
+	  latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+		  std::chrono::steady_clock::now() - start));
+
+	  uint64_t readback;
+	  profile.readbacks++;
+	  if (!file_read_uint64(sinkPath, &readback) || readback != level) {
+		profile.mismatches++;
+	  }
+	  std::this_thread::sleep_for(CALIBRATION_SETTLE);
+	  if (file_read_uint64(shownPath, &readback)) {
+		shown.insert(readback);
+	  }
+	}
+  }
+  file_write_uint64(sinkPath, original);
+  if (failed) {
+	return false;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  profile.writeLatency = latencies[latencies.size() * 9 / 10];
+  profile.levels = shown.size();
+  choose_strategy(profile);
+
+  printf("  write p90 %ld us (max %ld us), %u of %u readbacks differed, %lu distinct levels\n",
+		 static_cast<long>(profile.writeLatency.count()), static_cast<long>(latencies.back().count()),
+		 profile.mismatches, profile.readbacks, profile.levels);
+  printf("  %s writes, %s, ", profile.async ? "asynchronous" : "synchronous",
+		 profile.verify ? "verified" : "not verified");
+  if (profile.fadeFps > 0) {
+	printf("fades at %u fps\n", profile.fadeFps);
+  } else {
+	printf("no fades\n");
+  }
+  return true;
+}
+
+bool write_level(const std::string &path, uint64_t level, bool verify) {
+  for (int attempt = 0; attempt <= VERIFY_RETRIES; ++attempt) {
+	if (!file_write_uint64(path, level)) {
+	  return false;
+	}
+	uint64_t readback;
+	if (!verify || (file_read_uint64(path, &readback) && readback == level)) {
+	  return true;
+	}
+  }
+  return false;
+}
+
+sink_writer::sink_writer(std::string path, int type, bool verify)
+	: path_(std::move(path)), type_(type), verify_(verify), thread_(&sink_writer::run, this) {
+}
+
+sink_writer::~sink_writer() {
+  {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+void sink_writer::write(uint64_t level) {
+  {
+	std::lock_guard<std::mutex> lock(mutex_);
+	pending_ = level;
+  }
+  wake_.notify_one();
+}
+
+bool sink_writer::busy() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_ || writing_;
+}
+
+void sink_writer::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+	wake_.wait(lock, [this]() { return pending_ || stop_; });
+	if (!pending_) {
+	  return;
+	}
+	uint64_t level = *pending_;
+	pending_.reset();
+	writing_ = true;
+	lock.unlock();
+
+	bool written;
+	{
+	  trace_span span(TRACE_SINK_WRITE, static_cast<int64_t>(level));
+	  written = write_level(path_, level, verify_);
+	}
+	recorder_.record(written ? FLIGHT_SINK_WRITE : FLIGHT_SINK_FAILED, type_, static_cast<int64_t>(level));
+	writes_.fetch_add(written, std::memory_order_relaxed);
+	lock.lock();
+	writing_ = false;
+  }
+}
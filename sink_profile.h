@@ -0,0 +1,112 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * Profiles of the lights, measured once by writing them through their levels.
+ * The daemon picks how it writes a light from its profile.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_SINK_PROFILE_H
+#define KBD_BACKLIGHT_SINK_PROFILE_H
+
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+struct sink_profile {
+  std::string path;
+  // a profile of a light with another max_brightness is outdated
+  uint64_t maxLevel = 0;
+  // 90th percentile of a write
+  std::chrono::microseconds writeLatency{0};
+  // writes which read back another level right after
+  unsigned int readbacks = 0;
+  unsigned int mismatches = 0;
+  // distinct levels the light showed, actual_brightness if it has one
+  uint64_t levels = 0;
+
+  // Chosen from the measurements, the file may be edited to override them
+  // writes on a thread of their own, the event loop does not wait for the light
+  bool async = false;
+  // read back after each write, the level is written again if the light dropped it
+  bool verify = false;
+  // frames per second of a fade to a lower level, 0 steps at once
+  unsigned int fadeFps = 0;
+};
+
+// The file of a light in dir, e.g. sys-class-leds-tpacpi::kbd_backlight-brightness.profile
+std::string sink_profile_path(const std::string &dir, const std::string &sinkPath);
+bool load_sink_profile(const std::string &file, sink_profile &profile);
+// The directory is created if needed
+bool save_sink_profile(const std::string &file, const sink_profile &profile);
+
+/* Writes the light through its levels, twice, and restores the level it had.
+ * Nothing else may write it meanwhile, i.e. the service has to be stopped.
+ */
+bool calibrate_sink(const std::string &sinkPath, sink_profile &profile);
+
+/* Writes the level and, if verify is set, reads it back and writes it again
+ * when the light did not take it. Returns false if the light never took it.
+ */
+bool write_level(const std::string &path, uint64_t level, bool verify);
+
+/* Writes the level of a slow light on its own thread, the event loop only
+ * hands the level over. A level which is not written yet is replaced by a newer one.
+ */
+class sink_writer {
+ public:
+  // type is the sink type of the flight records
+  sink_writer(std::string path, int type, bool verify);
+  sink_writer(const sink_writer &) = delete;
+  sink_writer &operator=(const sink_writer &) = delete;
+  // Writes the pending level before it returns
+  ~sink_writer();
+
+  void write(uint64_t level);
+  // A level is pending or being written, the light may not show the last one yet
+  bool busy() const;
+  // successful writes so far
+  uint64_t writes() const { return writes_.load(std::memory_order_relaxed); }
+
+ private:
+  void run();
+
+  std::string path_;
+  int type_;
+  bool verify_;
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::optional<uint64_t> pending_;
+  bool writing_ = false;
+  bool stop_ = false;
+  std::atomic<uint64_t> writes_{0};
+  std::thread thread_;
+};
+
+#endif //KBD_BACKLIGHT_SINK_PROFILE_H
@@ -0,0 +1,405 @@
+#!/usr/bin/env python3
+# Thinkpad backlight service
+#
+# Copyright (c) 2020 Alexander Mohr
+#
+# MIT License, see LICENSE
+
+"""Runs keyboard_backlight -u against a private dbus-daemon.
+
+A fake UPower is on the bus as well. The D-Bus protocol is spoken directly,
+the test does not need any python bindings.
+
+usage: dbus_test.py <keyboard_backlight> <dbus-daemon>
+"""
+
+import os
+import select
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SKIP = 77
+SERVICE = "io.github.alexmohr.KeyboardBacklight"
+UPOWER = "org.freedesktop.UPower"
+KBD_PATH = "/org/freedesktop/UPower/KbdBacklight"
+KBD_INTERFACE = "org.freedesktop.UPower.KbdBacklight"
+
+METHOD_CALL, METHOD_RETURN, ERROR, SIGNAL = 1, 2, 3, 4
+FIELD_PATH, FIELD_INTERFACE, FIELD_MEMBER, FIELD_ERROR_NAME = 1, 2, 3, 4
+FIELD_REPLY_SERIAL, FIELD_DESTINATION, FIELD_SENDER, FIELD_SIGNATURE = 5, 6, 7, 8
+
+ALIGN = {"y": 1, "b": 4, "i": 4, "u": 4, "s": 4, "o": 4, "g": 1, "v": 1, "a": 4, "(": 8, "{": 8}
+
+
+def split(signature):
+    """Splits a signature into its complete types."""
+    types, i = [], 0
+    while i < len(signature):
+        j = i
+        while signature[j] == "a":
+            j += 1
+        depth = 0
+        while True:
+            depth += signature[j] in "({"
+            depth -= signature[j] in ")}"
+            j += 1
+            if depth == 0:
+                break
+        types.append(signature[i:j])
+        i = j
+    return types
+
+
+class Writer:
+    def __init__(self, endian):
+        self.endian = endian
+        self.buf = bytearray()
+
+    def align(self, n):
+        self.buf += b"\0" * (-len(self.buf) % n)
+
+    def add(self, sig, value):
+        self.align(ALIGN[sig[0]])
+        if sig[0] in "({":
+            # structs are tuples, dict entries (key, value)
+            for member, item in zip(split(sig[1:-1]), value):
+                self.add(member, item)
+        elif sig[0] == "a":
+            size = len(self.buf)
+            self.buf += b"\0" * 4
+            self.align(ALIGN[sig[1]])
+            start = len(self.buf)
+            for item in (value.items() if sig[1] == "{" else value):
+                self.add(sig[1:], item)
+            struct.pack_into(self.endian + "I", self.buf, size, len(self.buf) - start)
+        elif sig == "y":
+            self.buf += struct.pack("B", value)
+        elif sig in "bu":
+            self.buf += struct.pack(self.endian + "I", value)
+        elif sig == "i":
+            self.buf += struct.pack(self.endian + "i", value)
+        elif sig in "so":
+            data = value.encode()
+            self.buf += struct.pack(self.endian + "I", len(data)) + data + b"\0"
+        elif sig == "g":
+            data = value.encode()
+            self.buf += struct.pack("B", len(data)) + data + b"\0"
+        elif sig == "v":
+            self.add("g", value[0])
+            self.add(value[0], value[1])
+
+
+class Reader:
+    def __init__(self, endian, data, pos=0):
+        self.endian = endian
+        self.data = data
+        self.pos = pos
+
+    def align(self, n):
+        self.pos += -self.pos % n
+
+    def read(self, sig):
+        self.align(ALIGN[sig[0]])
+        if sig == "y":
+            self.pos += 1
+            return self.data[self.pos - 1]
+        if sig in "bui":
+            value, = struct.unpack_from(self.endian + ("i" if sig == "i" else "I"),
+                                        self.data, self.pos)
+            self.pos += 4
+            return bool(value) if sig == "b" else value
+        if sig in "so":
+            size, = struct.unpack_from(self.endian + "I", self.data, self.pos)
+            self.pos += 4 + size + 1
+            return self.data[self.pos - size - 1:self.pos - 1].decode()
+        if sig == "g":
+            size = self.data[self.pos]
+            self.pos += 1 + size + 1
+            return self.data[self.pos - size - 1:self.pos - 1].decode()
+        if sig == "v":
+            return self.read(self.read("g"))
+        raise ValueError("unsupported signature " + sig)
+
+
+def encode(kind, serial, fields, signature="", args=(), endian="<", flags=0):
+    body = Writer(endian)
+    for sig, value in zip(split(signature), args):
+        body.add(sig, value)
+
+    array = Writer(endian)
+    for code, sig, value in fields:
+        array.align(8)
+        array.add("y", code)
+        array.add("v", (sig, value))
+    if signature:
+        array.align(8)
+        array.add("y", FIELD_SIGNATURE)
+        array.add("v", ("g", signature))
+
+    head = Writer(endian)
+    head.buf += (b"l" if endian == "<" else b"B") + struct.pack("BBB", kind, flags, 1)
+    head.buf += struct.pack(endian + "III", len(body.buf), serial, len(array.buf))
+    head.buf += array.buf
+    head.align(8)
+    return bytes(head.buf + body.buf)
+
+
+def decode(data):
+    """Returns (message, size) or (None, 0) if data holds no full message."""
+    if len(data) < 16:
+        return None, 0
+    endian = "<" if data[0:1] == b"l" else ">"
+    body_len, serial, fields_len = struct.unpack_from(endian + "III", data, 4)
+    start = 16 + fields_len
+    start += -start % 8
+    if len(data) < start + body_len:
+        return None, 0
+
+    msg = {"type": data[1], "serial": serial, "fields": {}}
+    r = Reader(endian, data, 16)
+    while r.pos < 16 + fields_len:
+        r.align(8)
+        code = r.read("y")
+        msg["fields"][code] = r.read("v")
+    signature = msg["fields"].get(FIELD_SIGNATURE, "")
+    body = Reader(endian, data[start:start + body_len])
+    msg["args"] = [body.read(sig) for sig in split(signature)]
+    return msg, start + body_len
+
+
+class Connection:
+    def __init__(self, address):
+        path = dict(kv.split("=", 1) for kv in address.split(":", 1)[1].split(","))["path"]
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.sock.sendall(b"\0AUTH EXTERNAL " + str(os.getuid()).encode().hex().encode() + b"\r\n")
+        reply = self.sock.recv(4096)
+        assert reply.startswith(b"OK"), reply
+        self.sock.sendall(b"BEGIN\r\n")
+        self.serial = 0
+        self.data = b""
+        self.queue = []
+        self.name = self.call("org.freedesktop.DBus", "/org/freedesktop/DBus",
+                              "org.freedesktop.DBus", "Hello")["args"][0]
+
+    def send(self, kind, fields, signature="", args=(), endian="<"):
+        self.serial += 1
+        self.sock.sendall(encode(kind, self.serial, fields, signature, args, endian))
+        return self.serial
+
+    def receive(self, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            msg, size = decode(self.data)
+            if msg:
+                self.data = self.data[size:]
+                return msg
+            left = deadline - time.monotonic()
+            if left <= 0 or not select.select([self.sock], [], [], left)[0]:
+                return None
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise EOFError("bus closed the connection")
+            self.data += chunk
+
+    def wait(self, match, timeout=5):
+        for msg in self.queue:
+            if match(msg):
+                self.queue.remove(msg)
+                return msg
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            msg = self.receive(deadline - time.monotonic())
+            if msg is None:
+                break
+            if match(msg):
+                return msg
+            self.queue.append(msg)
+        return None
+
+    def call(self, dest, path, interface, member, signature="", args=(), endian="<"):
+        serial = self.send(METHOD_CALL,
+                           [(FIELD_PATH, "o", path), (FIELD_INTERFACE, "s", interface),
+                            (FIELD_MEMBER, "s", member), (FIELD_DESTINATION, "s", dest)],
+                           signature, args, endian)
+        reply = self.wait(lambda m: m["type"] in (METHOD_RETURN, ERROR)
+                          and m["fields"].get(FIELD_REPLY_SERIAL) == serial)
+        assert reply is not None, "no reply to " + member
+        return reply
+
+    def reply(self, call, signature="", args=()):
+        self.send(METHOD_RETURN, [(FIELD_REPLY_SERIAL, "u", call["serial"]),
+                                  (FIELD_DESTINATION, "s", call["fields"][FIELD_SENDER])],
+                  signature, args)
+
+    def signal(self, path, interface, member, signature="", args=()):
+        self.send(SIGNAL, [(FIELD_PATH, "o", path), (FIELD_INTERFACE, "s", interface),
+                           (FIELD_MEMBER, "s", member)], signature, args)
+
+    def bus(self, member, signature="", args=()):
+        return self.call("org.freedesktop.DBus", "/org/freedesktop/DBus",
+                         "org.freedesktop.DBus", member, signature, args)
+
+
+def is_signal(member, value):
+    return lambda m: (m["type"] == SIGNAL and m["fields"].get(FIELD_MEMBER) == member
+                      and m["args"][:1] == [value])
+
+
+failures = []
+
+
+def check(ok, what):
+    print(("ok   " if ok else "FAIL ") + what)
+    if not ok:
+        failures.append(what)
+
+
+def kbd(conn, member, signature="", args=(), endian="<"):
+    return conn.call(SERVICE, KBD_PATH, KBD_INTERFACE, member, signature, args, endian)
+
+
+def run(binary, address, tmp):
+    led = os.path.join(tmp, "brightness")
+    with open(led, "w") as f:
+        f.write("2\n")
+    with open(os.path.join(tmp, "max_brightness"), "w") as f:
+        f.write("3\n")
+
+    # Fake UPower, it answers SetBrightness like UPower: signal first, then return
+    upower = Connection(address)
+    upower.bus("RequestName", "su", (UPOWER, 4))
+    upower_levels = []
+
+    client = Connection(address)
+    client.bus("AddMatch", "s", ("type='signal',sender='%s'" % SERVICE,))
+
+    # The service needs an input device, a fifo on a private /dev/input is enough
+    env = dict(os.environ, DBUS_SYSTEM_BUS_ADDRESS=address)
+    script = ("mount -t tmpfs none /dev/input && mkfifo /dev/input/mice "
+              "&& exec 3<>/dev/input/mice && exec \"$0\" -f -u -t 60 -b \"$1\"")
+    service = subprocess.Popen(["unshare", "-rm", "sh", "-c", script, binary, led],
+                               env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    try:
+        deadline = time.monotonic() + 5
+        while not client.bus("NameHasOwner", "s", (SERVICE,))["args"][0]:
+            if service.poll() is not None or time.monotonic() > deadline:
+                print(service.stdout.read().decode())
+                check(False, "service owns " + SERVICE)
+                return
+            time.sleep(0.05)
+        check(client.bus("GetNameOwner", "s", (UPOWER,))["args"][0] == upower.name,
+              "UPower keeps its name")
+
+        reply = kbd(client, "GetMaxBrightness")
+        check(reply["type"] == METHOD_RETURN and reply["args"] == [3], "GetMaxBrightness")
+        reply = kbd(client, "GetBrightness")
+        check(reply["type"] == METHOD_RETURN and reply["args"] == [2], "GetBrightness")
+
+        reply = kbd(client, "SetBrightness", "i", (1,))
+        check(reply["type"] == METHOD_RETURN, "SetBrightness")
+        check(client.wait(is_signal("BrightnessChanged", 1)) is not None,
+              "BrightnessChanged after SetBrightness")
+        check(client.wait(is_signal("BrightnessChangedWithSource", 1)) is not None,
+              "BrightnessChangedWithSource after SetBrightness")
+        with open(led) as f:
+            check(f.read().strip() == "1", "SetBrightness writes the light")
+
+        call = upower.wait(lambda m: m["type"] == METHOD_CALL
+                           and m["fields"].get(FIELD_MEMBER) == "SetBrightness")
+        check(call is not None and call["args"] == [1], "level is set through UPower")
+        if call:
+            upower_levels.append(call["args"][0])
+            upower.signal(KBD_PATH, KBD_INTERFACE, "BrightnessChanged", "i", (1,))
+            upower.reply(call)
+
+        reply = kbd(client, "SetBrightness", "i", (4,))
+        check(reply["type"] == ERROR
+              and reply["fields"][FIELD_ERROR_NAME] == "org.freedesktop.DBus.Error.InvalidArgs",
+              "SetBrightness above the maximum is rejected")
+        reply = kbd(client, "SetBrightness", "s", ("1",))
+        check(reply["type"] == ERROR, "SetBrightness with a string is rejected")
+        reply = kbd(client, "SetBrightness")
+        check(reply["type"] == ERROR, "SetBrightness without argument is rejected")
+
+        reply = kbd(client, "GetBrightness", endian=">")
+        check(reply["type"] == METHOD_RETURN and reply["args"] == [1],
+              "big-endian GetBrightness")
+        reply = kbd(client, "SetBrightness", "i", (3,), endian=">")
+        check(reply["type"] == METHOD_RETURN and client.wait(is_signal("BrightnessChanged", 3)),
+              "big-endian SetBrightness")
+        call = upower.wait(lambda m: m["type"] == METHOD_CALL and m["args"] == [3])
+        if call:
+            upower.signal(KBD_PATH, KBD_INTERFACE, "BrightnessChanged", "i", (3,))
+            upower.reply(call)
+
+        # The echo of our own level must not be taken as a change of the user
+        check(client.wait(is_signal("BrightnessChanged", 3), timeout=0.5) is None,
+              "UPower echo is ignored")
+
+        # Changed in the desktop: UPower wrote the light and signals it
+        with open(led, "w") as f:
+            f.write("2\n")
+        upower.signal(KBD_PATH, KBD_INTERFACE, "BrightnessChanged", "i", (2,))
+        check(client.wait(is_signal("BrightnessChanged", 2)) is not None,
+              "desktop change is followed")
+        reply = kbd(client, "GetBrightness")
+        check(reply["args"] == [2], "GetBrightness after desktop change")
+
+        # A broken message makes the daemon drop the sender, nobody else
+        broken = Connection(address)
+        header = bytearray(encode(METHOD_CALL, 1, [(FIELD_PATH, "o", KBD_PATH),
+                                                   (FIELD_MEMBER, "s", "GetBrightness"),
+                                                   (FIELD_DESTINATION, "s", SERVICE)]))
+        header[12:16] = struct.pack("<I", 0xffff)
+        broken.sock.sendall(bytes(header) + b"\xff" * 64)
+        broken.sock.close()
+        reply = client.call(SERVICE, KBD_PATH, "org.freedesktop.DBus.Peer", "Ping")
+        check(reply["type"] == METHOD_RETURN, "service survives a malformed message")
+
+        reply = client.call(SERVICE, "/", KBD_INTERFACE, "GetBrightness")
+        check(reply["type"] == ERROR, "unknown object is rejected")
+        reply = kbd(client, "Explode")
+        check(reply["type"] == ERROR, "unknown method is rejected")
+
+        # UPower goes away, the service keeps serving its own name
+        upower.sock.close()
+        reply = kbd(client, "SetBrightness", "i", (1,))
+        check(reply["type"] == METHOD_RETURN, "SetBrightness without UPower")
+        check(service.poll() is None, "service is still running")
+    finally:
+        service.terminate()
+        output = service.communicate(timeout=5)[0].decode()
+        if failures:
+            print(output)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__)
+        return 2
+    binary, daemon = sys.argv[1:]
+    if subprocess.run(["unshare", "-rm", "true"], stderr=subprocess.DEVNULL).returncode != 0:
+        print("unshare -rm is not permitted, skipping")
+        return SKIP
+
+    tmp = tempfile.mkdtemp()
+    bus = subprocess.Popen([daemon, "--session", "--print-address", "--nofork"],
+                           stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    try:
+        address = bus.stdout.readline().decode().strip()
+        run(binary, address, tmp)
+    finally:
+        bus.terminate()
+        bus.wait()
+        shutil.rmtree(tmp)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+# Thinkpad backlight service
+#
+# Copyright (c) 2020 Alexander Mohr
+#
+# MIT License, see LICENSE
+
+"""Runs keyboard_backlight -L against a private dbus-daemon.
+
+A fake logind is on the bus and locks and unlocks its sessions. The light
+is watched in its file, the mouse is a fifo in place of /dev/input/mice.
+
+usage: logind_test.py <keyboard_backlight> <dbus-daemon>
+"""
+
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+from dbus_test import METHOD_CALL, FIELD_MEMBER, FIELD_PATH, SKIP, Connection, check, failures
+
+LOGIND = "org.freedesktop.login1"
+SEAT_PATH = "/org/freedesktop/login1/seat/seat0"
+SEAT_INTERFACE = "org.freedesktop.login1.Seat"
+SESSION_INTERFACE = "org.freedesktop.login1.Session"
+PROPERTIES = "org.freedesktop.DBus.Properties"
+FIRST = "/org/freedesktop/login1/session/c1"
+SECOND = "/org/freedesktop/login1/session/c2"
+
+
+class Logind:
+    """Answers Get of ActiveSession and LockedHint, the rest are signals."""
+
+    def __init__(self, address):
+        self.conn = Connection(address)
+        self.conn.bus("RequestName", "su", (LOGIND, 4))
+        self.active = FIRST
+        self.locked = {FIRST: False, SECOND: False}
+        self.asked = []
+
+    def serve(self, seconds):
+        deadline = time.monotonic() + seconds
+        while True:
+            left = deadline - time.monotonic()
+            msg = self.conn.receive(left) if left > 0 else None
+            if msg is None:
+                return
+            if msg["type"] != METHOD_CALL or msg["fields"].get(FIELD_MEMBER) != "Get":
+                continue
+            interface, name = msg["args"]
+            self.asked.append(name)
+            if name == "ActiveSession":
+                self.conn.reply(msg, "v", (("(so)", (os.path.basename(self.active), self.active)),))
+            elif name == "LockedHint":
+                self.conn.reply(msg, "v", (("b", self.locked[msg["fields"][FIELD_PATH]]),))
+
+    def session_signal(self, path, member):
+        self.conn.signal(path, SESSION_INTERFACE, member)
+
+    def changed(self, path, interface, properties):
+        self.conn.signal(path, PROPERTIES, "PropertiesChanged", "sa{sv}as", (interface, properties, []))
+
+
+def light(led):
+    with open(led) as f:
+        return f.read().strip()
+
+
+def run(binary, address, tmp):
+    led = os.path.join(tmp, "brightness")
+    with open(led, "w") as f:
+        f.write("2\n")
+    with open(os.path.join(tmp, "max_brightness"), "w") as f:
+        f.write("2\n")
+    os.mkdir(os.path.join(tmp, "display"))
+    display = os.path.join(tmp, "display", "brightness")
+    with open(display, "w") as f:
+        f.write("50\n")
+    with open(os.path.join(tmp, "display", "max_brightness"), "w") as f:
+        f.write("100\n")
+    status = os.path.join(tmp, "status")
+
+    logind = Logind(address)
+    env = dict(os.environ, DBUS_SYSTEM_BUS_ADDRESS=address)
+    script = ("mount -t tmpfs none /dev/input && mkfifo /dev/input/mice "
+              "&& exec 3<>/dev/input/mice "
+              "&& exec \"$0\" -f -t 60 -L 1 -T 0 -b \"$1\" -r \"$2\" -p \"$3\" -P 0,2,0 -F /dev/null")
+    service = subprocess.Popen(["unshare", "-rm", "sh", "-c", script, binary, led, status, display],
+                               env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    mouse = None
+    try:
+        fifo = "/proc/%d/root/dev/input/mice" % service.pid
+        deadline = time.monotonic() + 5
+        while mouse is None and time.monotonic() < deadline and service.poll() is None:
+            try:
+                mouse = os.open(fifo, os.O_WRONLY | os.O_NONBLOCK)
+            except OSError:
+                time.sleep(0.05)
+        if mouse is None:
+            check(False, "service started")
+            return
+
+        def move():
+            # one ps/2 packet
+            os.write(mouse, b"\x08\x01\x00")
+
+        def report():
+            service.send_signal(signal.SIGUSR1)
+            logind.serve(0.3)
+            with open(status) as f:
+                return f.read()
+
+        logind.serve(1)
+        check(logind.asked[:2] == ["ActiveSession", "LockedHint"],
+              "active session and its lock are asked for")
+        check("session: " + FIRST + "\n" in report(), "service follows the active session")
+
+        move()
+        logind.session_signal(FIRST, "Lock")
+        logind.serve(1.6)
+        check(light(led) == "0", "the light times out after -L while locked")
+        check("locked" in report(), "status shows the locked session")
+
+        move()
+        logind.serve(0.5)
+        check(light(led) == "0", "the mouse does not wake a locked session")
+
+        logind.session_signal(FIRST, "Unlock")
+        logind.serve(0.3)
+        move()
+        logind.serve(0.3)
+        check(light(led) == "2", "the mouse wakes an unlocked session")
+        logind.serve(1.5)
+        check(light(led) == "2", "the timeout of -t is back after unlock")
+
+        logind.changed(FIRST, SESSION_INTERFACE, {"LockedHint": ("b", True), "Active": ("b", True)})
+        logind.serve(0.5)
+        check(light(led) == "0", "LockedHint of the screen locker locks")
+
+        logind.active = SECOND
+        logind.changed(SEAT_PATH, SEAT_INTERFACE, {"ActiveSession": ("(so)", ("c2", SECOND))})
+        logind.serve(0.5)
+        move()
+        logind.serve(0.3)
+        check(light(led) == "2", "switching to an unlocked session unlocks")
+
+        logind.session_signal(FIRST, "Lock")
+        logind.serve(1.5)
+        check(light(led) == "2", "a lock of another session is ignored")
+
+        logind.session_signal(SECOND, "Lock")
+        logind.serve(2.5)
+        check(light(led) == "0" and light(display) == "0", "both lights time out while locked")
+        move()
+        logind.serve(0.3)
+        check(light(display) == "50", "the mouse restores the display while locked")
+        check(light(led) == "0", "the mouse does not restore the keyboard light while locked")
+        check(service.poll() is None, "service is still running")
+    finally:
+        if mouse is not None:
+            os.close(mouse)
+        service.terminate()
+        output = service.communicate(timeout=5)[0].decode()
+        if failures:
+            print(output)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__)
+        return 2
+    binary, daemon = sys.argv[1:]
+    if subprocess.run(["unshare", "-rm", "true"], stderr=subprocess.DEVNULL).returncode != 0:
+        print("unshare -rm is not permitted, skipping")
+        return SKIP
+
+    tmp = tempfile.mkdtemp()
+    bus = subprocess.Popen([daemon, "--session", "--print-address", "--nofork"],
+                           stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    try:
+        address = bus.stdout.readline().decode().strip()
+        run(binary, address, tmp)
+    finally:
+        bus.terminate()
+        bus.wait()
+        shutil.rmtree(tmp)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
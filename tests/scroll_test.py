@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# Thinkpad backlight service
+#
+# Copyright (c) 2020 Alexander Mohr
+#
+# MIT License, see LICENSE
+
+"""Scrolls a fifo in place of /dev/input/mice and watches the light.
+
+mousedev sends a wheel notch as a ps/2 packet without motion.
+
+usage: scroll_test.py <keyboard_backlight>
+"""
+
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+from dbus_test import SKIP, check, failures
+
+NOTCH = b"\x08\x00\x00"
+MOVE = b"\x08\x01\x00"
+
+
+def light(led):
+    with open(led) as f:
+        return f.read().strip()
+
+
+class Service:
+    """keyboard_backlight -t 2 in its own mount namespace."""
+
+    def __init__(self, binary, tmp, mode):
+        self.led = os.path.join(tmp, "brightness")
+        with open(self.led, "w") as f:
+            f.write("2\n")
+        with open(os.path.join(tmp, "max_brightness"), "w") as f:
+            f.write("2\n")
+        self.status = os.path.join(tmp, "status")
+        script = ("mount -t tmpfs none /dev/input && mkfifo /dev/input/mice "
+                  "&& exec 3<>/dev/input/mice "
+                  "&& exec \"$0\" -f -t 2 -T 0 -S \"$3\" -b \"$1\" -r \"$2\" -F /dev/null -D /nonexistent")
+        self.process = subprocess.Popen(["unshare", "-rm", "sh", "-c", script, binary, self.led, self.status, mode],
+                                        stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        self.mouse = None
+        fifo = "/proc/%d/root/dev/input/mice" % self.process.pid
+        deadline = time.monotonic() + 5
+        while self.mouse is None and time.monotonic() < deadline and self.process.poll() is None:
+            try:
+                self.mouse = os.open(fifo, os.O_WRONLY | os.O_NONBLOCK)
+            except OSError:
+                time.sleep(0.05)
+
+    def write(self, packet):
+        os.write(self.mouse, packet)
+
+    def scroll(self, seconds):
+        deadline = time.monotonic() + seconds
+        while time.monotonic() < deadline:
+            self.write(NOTCH)
+            time.sleep(0.1)
+
+    def report(self):
+        self.process.send_signal(signal.SIGUSR1)
+        time.sleep(0.3)
+        with open(self.status) as f:
+            return f.read()
+
+    def stop(self):
+        if self.mouse is not None:
+            os.close(self.mouse)
+        self.process.terminate()
+        output = self.process.communicate(timeout=5)[0].decode()
+        if failures:
+            print(output)
+
+
+def scroll_line(report):
+    return next((line for line in report.splitlines() if line.startswith("scroll")), "")
+
+
+def wake(binary, tmp):
+    service = Service(binary, tmp, "wake")
+    try:
+        check(service.mouse is not None, "service started")
+        if service.mouse is None:
+            return
+        service.scroll(3)
+        check(light(service.led) == "2", "scrolling keeps the light on past the timeout")
+        line = scroll_line(service.report())
+        reads, activities = [int(word) for word in line.split() if word.isdigit()]
+        check(reads >= 10, "the notches are counted as scroll reads: " + line)
+        check(activities <= 4, "at most one activity per second is passed on: " + line)
+
+        time.sleep(2.3)
+        check(light(service.led) == "0", "the light times out after the last notch")
+        service.write(NOTCH)
+        time.sleep(0.3)
+        check(light(service.led) == "2", "a notch turns the light on right away")
+    finally:
+        service.stop()
+
+
+def keep(binary, tmp):
+    service = Service(binary, tmp, "keep")
+    try:
+        check(service.mouse is not None, "service started with -S keep")
+        if service.mouse is None:
+            return
+        service.scroll(2.5)
+        check(light(service.led) == "2", "scrolling keeps the light on with -S keep")
+        time.sleep(2.3)
+        check(light(service.led) == "0", "the light times out after the last notch with -S keep")
+        service.write(NOTCH)
+        time.sleep(0.3)
+        check(light(service.led) == "0", "a notch does not turn the light on with -S keep")
+        service.write(MOVE)
+        time.sleep(0.3)
+        check(light(service.led) == "2", "motion turns the light on with -S keep")
+    finally:
+        service.stop()
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return 2
+    if subprocess.run(["unshare", "-rm", "true"], stderr=subprocess.DEVNULL).returncode != 0:
+        print("unshare -rm is not permitted, skipping")
+        return SKIP
+
+    tmp = tempfile.mkdtemp()
+    try:
+        wake(sys.argv[1], tmp)
+        keep(sys.argv[1], tmp)
+    finally:
+        shutil.rmtree(tmp)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,248 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * In memory trace of the daemon's timeline, see trace.h
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include <set>
+
+trace_buffer trace_;
+
+namespace {
+
+const char *TRACE_EVENT_NAMES[TRACE_EVENT_COUNT] = {
+	"input batch",
+	"decision",
+	"timer arm",
+	"sink write",
+	"timeout",
+	"dbus",
+	"probe"
+};
+
+uint32_t current_tid() {
+  thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+  return tid;
+}
+
+// Protobuf wire format, only what the Perfetto trace needs
+void proto_varint(std::string &out, uint64_t val) {
+  while (val >= 0x80) {
+	out += static_cast<char>((val & 0x7f) | 0x80);
+	val >>= 7;
+  }
+  out += static_cast<char>(val);
+}
+
+void proto_uint(std::string &out, uint32_t field, uint64_t val) {
+  proto_varint(out, field << 3);
+  proto_varint(out, val);
+}
+
+void proto_bytes(std::string &out, uint32_t field, const std::string &val) {
+  proto_varint(out, (field << 3) | 2);
+  proto_varint(out, val.size());
+  out += val;
+}
+
+// Field numbers from perfetto/protos/perfetto/trace
+enum PERFETTO_FIELD : uint32_t {
+  TRACE_PACKET = 1,
+  PACKET_TIMESTAMP = 8,
+  PACKET_SEQUENCE_ID = 10,
+  PACKET_TRACK_EVENT = 11,
+  PACKET_SEQUENCE_FLAGS = 13,
+  PACKET_TRACK_DESCRIPTOR = 60,
+  TRACK_UUID = 1,
+  TRACK_NAME = 2,
+  TRACK_PROCESS = 3,
+  TRACK_THREAD = 4,
+  PROCESS_PID = 1,
+  PROCESS_NAME = 6,
+  THREAD_PID = 1,
+  THREAD_TID = 2,
+  EVENT_ANNOTATIONS = 4,
+  EVENT_TYPE = 9,
+  EVENT_TRACK_UUID = 11,
+  EVENT_NAME = 23,
+  ANNOTATION_INT = 4,
+  ANNOTATION_NAME = 10
+};
+
+enum PERFETTO_EVENT_TYPE : uint32_t {
+  SLICE_BEGIN = 1,
+  SLICE_END = 2
+};
+
+const uint32_t SEQUENCE_ID = 1;
+const uint32_t SEQ_INCREMENTAL_STATE_CLEARED = 1;
+
+} // namespace
+
+void trace_buffer::enable(size_t capacity) {
+  if (records_ == nullptr || capacity_ != capacity) {
+	records_ = std::make_unique<trace_record[]>(capacity);
+	capacity_ = capacity;
+  }
+  next_ = 0;
+  enabled_ = true;
+}
+
+void trace_buffer::disable() {
+  enabled_ = false;
+  next_ = 0;
+}
+
+void trace_buffer::record(TRACE_EVENT event, uint64_t startNs, uint64_t endNs, int64_t arg) {
+  auto &r = records_[next_.fetch_add(1, std::memory_order_relaxed) % capacity_];
+  r.startNs = startNs;
+  r.durationNs = endNs - startNs;
+  r.arg = arg;
+  r.tid = current_tid();
+  r.event = event;
+}
+
+template<typename F>
+void trace_buffer::for_each(F f) const {
+  uint64_t end = next_.load(std::memory_order_relaxed);
+  uint64_t begin = end > capacity_ ? end - capacity_ : 0;
+  for (uint64_t i = begin; i < end; ++i) {
+	f(records_[i % capacity_]);
+  }
+}
+
+bool trace_buffer::write_json(FILE *fp) const {
+  const int pid = getpid();
+  std::set<uint32_t> threads;
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			  "\"args\":{\"name\":\"keyboard_backlight\"}}", pid);
+  for_each([&](const trace_record &r) {
+	threads.insert(r.tid);
+	fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+				"\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":%ld}}",
+			TRACE_EVENT_NAMES[r.event],
+			r.startNs / 1000.0,
+			r.durationNs / 1000.0,
+			pid,
+			r.tid,
+			r.arg);
+  });
+  for (const auto tid : threads) {
+	fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+				"\"args\":{\"name\":\"%s\"}}",
+			pid, tid, static_cast<int>(tid) == pid ? "event loop" : "worker");
+  }
+  fprintf(fp, "\n]}\n");
+  return !ferror(fp);
+}
+
+bool trace_buffer::write_perfetto(FILE *fp) const {
+  const int pid = getpid();
+  std::string out;
+  auto packet = [&out](const std::string &body) {
+	proto_bytes(out, TRACE_PACKET, body);
+  };
+
+  std::string process;
+  proto_uint(process, PROCESS_PID, pid);
+  proto_bytes(process, PROCESS_NAME, "keyboard_backlight");
+  std::string descriptor;
+  proto_uint(descriptor, TRACK_UUID, pid);
+  proto_bytes(descriptor, TRACK_PROCESS, process);
+  std::string first;
+  proto_uint(first, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+  proto_uint(first, PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+  proto_bytes(first, PACKET_TRACK_DESCRIPTOR, descriptor);
+  packet(first);
+
+  std::set<uint32_t> threads;
+  for_each([&](const trace_record &r) {
+	threads.insert(r.tid);
+  });
+  for (const auto tid : threads) {
+	std::string thread;
+	proto_uint(thread, THREAD_PID, pid);
+	proto_uint(thread, THREAD_TID, tid);
+	std::string track;
+	// pids and tids share one number space, the process track uses the pid
+	proto_uint(track, TRACK_UUID, (1ull << 32u) | tid);
+	proto_bytes(track, TRACK_NAME, static_cast<int>(tid) == pid ? "event loop" : "worker");
+	proto_bytes(track, TRACK_THREAD, thread);
+	std::string body;
+	proto_uint(body, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+	proto_bytes(body, PACKET_TRACK_DESCRIPTOR, track);
+	packet(body);
+  }
+
+  for_each([&](const trace_record &r) {
+	std::string annotation;
+	proto_bytes(annotation, ANNOTATION_NAME, "arg");
+	proto_uint(annotation, ANNOTATION_INT, static_cast<uint64_t>(r.arg));
+
+	std::string begin;
+	proto_uint(begin, EVENT_TYPE, SLICE_BEGIN);
+	proto_uint(begin, EVENT_TRACK_UUID, (1ull << 32u) | r.tid);
+	proto_bytes(begin, EVENT_NAME, TRACE_EVENT_NAMES[r.event]);
+	proto_bytes(begin, EVENT_ANNOTATIONS, annotation);
+	std::string body;
+	proto_uint(body, PACKET_TIMESTAMP, r.startNs);
+	proto_uint(body, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+	proto_bytes(body, PACKET_TRACK_EVENT, begin);
+	packet(body);
+
+	std::string end;
+	proto_uint(end, EVENT_TYPE, SLICE_END);
+	proto_uint(end, EVENT_TRACK_UUID, (1ull << 32u) | r.tid);
+	body.clear();
+	proto_uint(body, PACKET_TIMESTAMP, r.startNs + r.durationNs);
+	proto_uint(body, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+	proto_bytes(body, PACKET_TRACK_EVENT, end);
+	packet(body);
+  });
+
+  return fwrite(out.data(), 1, out.size(), fp) == out.size();
+}
+
+bool trace_buffer::write(const std::string &path) const {
+  if (!enabled()) {
+	return false;
+  }
+
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+	return false;
+  }
+
+  bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+  bool ok = json ? write_json(fp) : write_perfetto(fp);
+  return fclose(fp) == 0 && ok;
+}
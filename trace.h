@@ -0,0 +1,115 @@
+/*
+ * Thinkpad backlight service
+ *
+ * Copyright (c) 2020 Alexander Mohr
+ *
+ * In memory trace of the daemon's timeline.
+ * Spans are kept in a fixed ring buffer and written as Chrome trace-event
+ * JSON or Perfetto protobuf on request. When tracing is disabled a span is a
+ * single branch, when it is enabled two clock reads and a few stores.
+*  MIT License
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+ */
+
+#ifndef KBD_BACKLIGHT_TRACE_H
+#define KBD_BACKLIGHT_TRACE_H
+
+#include <ctime>
+#include <cstdint>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+enum TRACE_EVENT : uint32_t {
+  TRACE_INPUT_BATCH = 0,
+  TRACE_DECISION = 1,
+  TRACE_TIMER_ARM = 2,
+  TRACE_SINK_WRITE = 3,
+  TRACE_TIMEOUT = 4,
+  TRACE_DBUS = 5,
+  TRACE_PROBE = 6,
+  TRACE_EVENT_COUNT = 7
+};
+
+struct trace_record {
+  uint64_t startNs;
+  uint64_t durationNs;
+  int64_t arg;
+  uint32_t tid;
+  TRACE_EVENT event;
+};
+
+class trace_buffer {
+ public:
+  // Allocates the ring buffer, tracing is disabled until this is called
+  void enable(size_t capacity);
+  // Drops the records, the buffer is kept for probes which still finish a span
+  void disable();
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  static uint64_t now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  }
+
+  void record(TRACE_EVENT event, uint64_t startNs, uint64_t endNs, int64_t arg);
+
+  // The format is picked by the extension, .json is Chrome trace-event JSON,
+  // everything else Perfetto protobuf
+  bool write(const std::string &path) const;
+
+ private:
+  bool write_json(FILE *fp) const;
+  bool write_perfetto(FILE *fp) const;
+  template<typename F>
+  void for_each(F f) const;
+
+  std::unique_ptr<trace_record[]> records_;
+  size_t capacity_ = 0;
+  std::atomic<uint64_t> next_{0};
+  std::atomic<bool> enabled_{false};
+};
+
+extern trace_buffer trace_;
+
+// Records the time between construction and destruction
+class trace_span {
+ public:
+  explicit trace_span(TRACE_EVENT event, int64_t arg = 0)
+	  : event_(event), arg_(arg), startNs_(trace_.enabled() ? trace_buffer::now_ns() : 0) {}
+  ~trace_span() {
+	if (startNs_ != 0) {
+	  trace_.record(event_, startNs_, trace_buffer::now_ns(), arg_);
+	}
+  }
+  void set_arg(int64_t arg) { arg_ = arg; }
+
+  trace_span(const trace_span &) = delete;
+  trace_span &operator=(const trace_span &) = delete;
+
+ private:
+  TRACE_EVENT event_;
+  int64_t arg_;
+  uint64_t startNs_;
+};
+
+#endif //KBD_BACKLIGHT_TRACE_H